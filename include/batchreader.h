@@ -0,0 +1,69 @@
+#ifndef BATCHREADER_H
+#define BATCHREADER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "resourceview.h"
+#include "threadpool.h"
+
+
+/**
+ * @brief Reads many files at once into memory.
+ *
+ * Uses io_uring on Linux, keeping many reads in flight from a single thread.
+ * Where io_uring is not available, the files are read with pread by a pool
+ * of threads instead.
+ */
+class BatchReader
+{
+public:
+	/// Number of reads in flight at once.
+	static constexpr unsigned DEPTH = 64;
+	/// Number of threads reading if io_uring is not available.
+	static constexpr std::size_t FALLBACK_THREADS = 8;
+
+	BatchReader();
+	~BatchReader();
+
+	BatchReader(const BatchReader&) = delete;
+	BatchReader &operator=(const BatchReader&) = delete;
+
+	bool usesIoUring() const {
+		return mRing != nullptr;
+	}
+
+	std::vector<std::shared_future<ResourceView>> read(const std::vector<std::string> &paths);
+
+	static ResourceView readFile(const std::string &path);
+
+private:
+	struct Ring;
+	struct Request {
+		std::string path;
+		std::promise<ResourceView> result;
+	};
+
+	void run();
+	void readAll(std::deque<Request> &requests);
+
+	// buffers of reads which did not end when the ring failed, freed after it is closed
+	std::vector<std::shared_ptr<unsigned char>> mAbandoned;
+	std::unique_ptr<Ring> mRing;
+	std::unique_ptr<ThreadPool> mPool;
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	std::deque<Request> mRequests;
+	bool mStop;
+	std::thread mThread;
+
+};
+
+#endif // BATCHREADER_H
@@ -0,0 +1,10 @@
+#ifndef BLOCKCOMPRESSION_H
+#define BLOCKCOMPRESSION_H
+
+#include <cstddef>
+
+
+std::size_t compressBlock(const unsigned char *src, std::size_t size, unsigned char *dst, std::size_t capacity);
+bool decompressBlock(const unsigned char *src, std::size_t size, unsigned char *dst, std::size_t dstSize);
+
+#endif // BLOCKCOMPRESSION_H
@@ -6,4 +6,21 @@
 #define WINDOW_HEIGHT 600
 #define WINDOW_FULLSCREEN false
 
+// time in seconds per frame spent on uploading textures loaded in background
+#define RESOURCE_UPLOAD_BUDGET 0.002
+// bytes of unused resources kept in memory to avoid reloading them
+#define TEXTURE_CACHE_BUDGET (256u << 20)
+#define PROGRAM_CACHE_BUDGET (16u << 20)
+// decoded size in bytes from which textures are uploaded while decoding
+#define TEXTURE_STREAMING_THRESHOLD (64u << 20)
+// mapped memory textures loaded in background are decoded into, in equal slots
+#define UPLOAD_RING_SIZE (64u << 20)
+#define UPLOAD_RING_SLOTS 4
+
+// file in the cache directory receiving the resources accessed at startup,
+// which are loaded ahead in that order on the next start
+#define ACCESS_TRACE "startup.trace"
+// file receiving the frame time percentiles on exit
+#define PROFILE_REPORT "profile.txt"
+
 #endif // DEFINES_H
@@ -0,0 +1,24 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <memory>
+
+
+struct Image
+{
+	Image() :
+		width(0), height(0), channels(0), levels(1), compressed(false), generateMipmaps(false)
+	{}
+
+	int width;
+	int height;
+	int channels;
+	// the pixels of all levels follow each other, as DXT blocks if compressed
+	int levels;
+	bool compressed;
+	// only the first level is stored, the others are generated by OpenGL
+	bool generateMipmaps;
+	std::shared_ptr<unsigned char> pixels;
+};
+
+#endif // IMAGE_H
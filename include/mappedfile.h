@@ -0,0 +1,34 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+
+class MappedFile
+{
+public:
+	MappedFile(const std::string &path);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile &operator=(const MappedFile&) = delete;
+
+	const unsigned char *data() const {
+		return mData;
+	}
+	std::size_t size() const {
+		return mSize;
+	}
+
+private:
+	const unsigned char *mData;
+	std::size_t mSize;
+#ifdef _WIN32
+	std::vector<unsigned char> mBuffer;
+#endif
+
+};
+
+#endif // MAPPEDFILE_H
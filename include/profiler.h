@@ -0,0 +1,103 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+
+
+/**
+ * @brief Measures the CPU and GPU time of named zones per frame.
+ *
+ * GPU times are measured with timestamp queries which are read two frames
+ * later. If a result is not available by then, the sample is dropped instead
+ * of waiting for the GPU. Each zone should be entered at most once per frame.
+ */
+class Profiler
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	/// Number of frames kept for each zone.
+	static constexpr std::size_t HISTORY = 1024;
+
+	class Zone
+	{
+	public:
+		Zone(Profiler &profiler, const char *name) :
+			mProfiler(profiler),
+			mIndex(profiler.begin(name))
+		{}
+		~Zone() {
+			mProfiler.end(mIndex);
+		}
+
+		Zone(const Zone&) = delete;
+		Zone &operator=(const Zone&) = delete;
+
+	private:
+		Profiler &mProfiler;
+		std::size_t mIndex;
+	};
+
+	struct Percentiles {
+		std::size_t samples;
+		double p50;
+		double p95;
+		double p99;
+	};
+
+	Profiler(bool gpu = true);
+	~Profiler();
+
+	Profiler(const Profiler&) = delete;
+	Profiler &operator=(const Profiler&) = delete;
+
+	void beginFrame();
+	void endFrame();
+
+	std::size_t begin(const char *name);
+	void end(std::size_t zone);
+
+	Percentiles getCpuTimes(const std::string &name) const;
+	Percentiles getGpuTimes(const std::string &name) const;
+
+	std::string getSummary() const;
+	bool writeReport(const std::string &path) const;
+
+private:
+	class Samples
+	{
+	public:
+		Samples();
+		void add(float ms);
+		Percentiles getPercentiles() const;
+
+	private:
+		std::vector<float> mValues;
+		std::size_t mNext;
+	};
+
+	struct ZoneData {
+		std::string name;
+		Samples cpu;
+		Samples gpu;
+		Clock::time_point start;
+		GLuint queries[2][2];
+		bool pending[2];
+	};
+
+	const ZoneData *find(const std::string &name) const;
+	void collect(ZoneData &zone, std::size_t slot);
+
+	bool mGpu;
+	std::size_t mFrame;
+	std::size_t mFrameZone;
+	std::vector<ZoneData> mZones;
+
+};
+
+#endif // PROFILER_H
@@ -0,0 +1,92 @@
+#ifndef RESOURCEARCHIVE_H
+#define RESOURCEARCHIVE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mappedfile.h"
+#include "resourceview.h"
+
+class ThreadPool;
+
+/**
+ * @brief Read-only archive containing many resources in a single file.
+ *
+ * An archive starts with a header followed by an index of all entries sorted
+ * by the hash of their names, a table of names and the content of the
+ * entries. Integers are stored in native byte order, the content of each
+ * entry starts at a multiple of ResourceArchive::ALIGNMENT.
+ *
+ * Entries which compress well are split into blocks of BLOCK_SIZE bytes,
+ * compressed independently with compressBlock, so they can be decompressed
+ * in parallel and partially. Such an entry starts with the compressed size
+ * of each block, a size with RAW_BLOCK set is stored uncompressed, followed
+ * by the blocks.
+ */
+class ResourceArchive
+{
+public:
+	static constexpr std::uint32_t VERSION = 2;
+	static constexpr std::size_t ALIGNMENT = 64;
+	static constexpr std::size_t BLOCK_SIZE = 64 << 10;
+	static constexpr std::uint32_t RAW_BLOCK = 0x80000000u;
+	/// Entries with more blocks are decompressed by several threads, see ResourceArchive::setThreadPool.
+	static constexpr std::size_t PARALLEL_BLOCKS = 16;
+
+	ResourceArchive(const std::string &path);
+
+	std::size_t size() const {
+		return mCount;
+	}
+
+	bool contains(const std::string &name) const;
+	bool find(const std::string &name, ResourceView &view) const;
+	bool findStored(const std::string &name, ResourceView &view) const;
+	bool stat(const std::string &name, std::uint64_t &size, bool &compressed) const;
+	void read(const std::string &name, std::uint64_t offset, void *dst, std::uint64_t size,
+				bool writeCombined = false) const;
+
+	void setThreadPool(ThreadPool *pool) {
+		mPool = pool;
+	}
+
+	static void write(const std::string &path,
+				const std::vector<std::pair<std::string,std::string>> &files);
+
+	static std::uint64_t hash(const std::string &name);
+
+private:
+	struct Header {
+		char magic[4];
+		std::uint32_t version;
+		std::uint32_t count;
+		std::uint32_t reserved;
+		std::uint64_t indexOffset;
+		std::uint64_t namesOffset;
+	};
+	struct Entry {
+		std::uint64_t hash;
+		std::uint64_t offset;
+		std::uint64_t size;
+		std::uint64_t storedSize; // less than size if compressed
+		std::uint32_t nameOffset;
+		std::uint32_t nameLength;
+	};
+
+	const Entry *lookup(const std::string &name) const;
+	void extract(const Entry &e, std::uint64_t offset, unsigned char *dst, std::uint64_t size,
+				bool writeCombined) const;
+
+	std::shared_ptr<const MappedFile> mFile;
+	const Entry *mIndex;
+	const char *mNames;
+	std::size_t mCount;
+	ThreadPool *mPool;
+
+};
+
+#endif // RESOURCEARCHIVE_H
@@ -2,44 +2,455 @@
 #define RESOURCECACHE_H
 
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <list>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 
+/**
+ * @brief Estimates the memory used by a cached resource.
+ *
+ * Specialize this template for resources whose memory is not owned by the
+ * object itself (e.g. OpenGL objects).
+ */
+template<class T>
+struct ResourceSize
+{
+	static std::size_t estimate(const T &) {
+		return sizeof(T);
+	}
+};
+
+/**
+ * @brief How often resources were shared by their content instead of loaded.
+ */
+struct DedupStats
+{
+	std::size_t hits; // names given a resource loaded for another name
+	std::size_t misses; // names whose content was loaded
+	std::size_t savedSize; // estimated size of the resources not loaded again
+};
+
+/**
+ * @brief Shares resources by name.
+ *
+ * Resources which are no longer used are kept in a least recently used pool
+ * until their estimated size (see ResourceSize) exceeds the budget of the
+ * cache. With a budget of zero, resources are released immediately.
+ *
+ * The names are distributed over several shards with their own lock, the pool
+ * and its budget are shared by all shards. Resources are loaded without
+ * holding a lock, concurrent requests for a resource which is being loaded
+ * wait for that load instead of loading it again.
+ *
+ * Optionally, names with equal content share one resource (see
+ * ResourceCache::setContentKey). A shared resource counts against the budget
+ * of every name holding it.
+ */
 template<class T, class L, T(L::*Func)(const std::string&) const>
 class ResourceCache
 {
 public:
-	ResourceCache(const L *loader) :
-		mLoader(loader)
-	{}
+	static constexpr std::size_t SHARDS = 16;
+
+	/// Gets a hash of the content of a name before it is loaded, 0 if unknown. May set a
+	/// function loading the name from what was read for the key, used unless it is shared.
+	typedef std::function<std::uint64_t(const std::string&, std::function<T()>&)> ContentKey;
+	/// Called with the cache locked when no name holds the content of a key anymore.
+	typedef std::function<void(std::uint64_t)> ContentDropped;
+
+	ResourceCache(const L *loader, std::size_t budget = 0) :
+		mLoader(loader),
+		mBudget(0),
+		mRetained(0),
+		mNextPoolId(0),
+		mDedupStats{0, 0, 0}
+	{
+		setBudget(budget);
+	}
 	~ResourceCache() {
-		assert(mMap.empty());
+		for (Shard &shard : mShards) {
+			for (auto &entry : shard.map) {
+				assert(entry.second.object && entry.second.handle.expired());
+				(void) entry;
+			}
+		}
 	}
 
 	std::shared_ptr<T> get(const std::string &name) {
-		std::shared_ptr<T> result;
-		std::lock_guard<std::mutex> lock(mMutex);
-
-		auto it = mMap.find(name);
-		if (it == mMap.end() || (result = it->second.lock()) == nullptr) {
-			result = std::shared_ptr<T>(new T((mLoader->*Func)(name)), [this,name](T* o){
-				std::lock_guard<std::mutex> lock(mMutex);
-				mMap.erase(name);
-				delete o;
-			});
-			mMap[name] = result;
+		Shard &shard = getShard(name);
+		std::unique_lock<std::mutex> lock(shard.mutex);
+
+		auto it = shard.map.find(name);
+		if (it != shard.map.end()) {
+			if (!it->second.object) {
+				// somebody else is loading the resource
+				std::shared_future<std::shared_ptr<T>> pending = it->second.pending;
+				lock.unlock();
+				return pending.get();
+			}
+			return acquire(it->first, it->second);
 		}
+
+		std::promise<std::shared_ptr<T>> promise;
+		shard.map[name].pending = promise.get_future().share();
+		lock.unlock();
+
+		std::shared_ptr<T> object;
+		std::size_t size;
+		std::uint64_t key;
+		try {
+			object = load(name, size, key);
+		} catch (...) {
+			lock.lock();
+			shard.map.erase(name);
+			lock.unlock();
+			promise.set_exception(std::current_exception());
+			throw;
+		}
+
+		lock.lock();
+		auto entry = shard.map.find(name);
+		assert(entry != shard.map.end());
+		entry->second.object = std::move(object);
+		entry->second.size = size;
+		entry->second.key = key;
+		entry->second.pending = std::shared_future<std::shared_ptr<T>>();
+		std::shared_ptr<T> result = acquire(entry->first, entry->second);
+		lock.unlock();
+
+		promise.set_value(result);
 		return result;
 	}
 
+	bool contains(const std::string &name) {
+		Shard &shard = getShard(name);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.map.find(name);
+		return it != shard.map.end() && it->second.object;
+	}
+
+	std::vector<std::string> getNames() {
+		std::vector<std::string> names;
+		for (Shard &shard : mShards) {
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			for (auto &entry : shard.map) {
+				if (entry.second.object)
+					names.push_back(entry.first);
+			}
+		}
+		return names;
+	}
+
+	/**
+	 * @brief Replaces a cached resource in place.
+	 *
+	 * Everybody holding the resource sees the new object. Nothing happens if
+	 * the resource is not cached. A resource shared with other names is not
+	 * replaced but copied first, so only those getting it afterwards see the
+	 * new object.
+	 *
+	 * @return <code>true</code> if the resource was replaced.
+	 */
+	bool replace(const std::string &name, T &&object) {
+		std::size_t size = ResourceSize<T>::estimate(object);
+		Shard &shard = getShard(name);
+		std::vector<Retained> victims;
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+
+			auto it = shard.map.find(name);
+			if (it == shard.map.end() || !it->second.object)
+				return false;
+
+			if (forget(it->second)) {
+				// the content is no longer equal, the others keep the old object
+				it->second.object = std::make_shared<T>(std::move(object));
+				it->second.handle.reset();
+			} else {
+				*it->second.object = std::move(object);
+			}
+			it->second.size = size;
+			if (it->second.poolId != 0) {
+				std::lock_guard<std::mutex> poolLock(mPoolMutex);
+				auto pos = mPoolIndex.find(it->second.poolId);
+				if (pos != mPoolIndex.end()) {
+					mRetained = mRetained - pos->second->size + size;
+					pos->second->size = size;
+					takeVictims(victims);
+				}
+			}
+		}
+		evict(victims);
+		return true;
+	}
+
+	void setBudget(std::size_t budget) {
+		std::vector<Retained> victims;
+		{
+			std::lock_guard<std::mutex> lock(mPoolMutex);
+			mBudget = budget;
+			takeVictims(victims);
+		}
+		evict(victims);
+	}
+
+	/**
+	 * @brief Shares one resource between names with equal content.
+	 *
+	 * The key is computed before a name is loaded, outside of any lock. If a
+	 * resource with the same key is still loaded for another name, that
+	 * resource is used. Names loaded before are not affected.
+	 *
+	 * @param key Computes the key of a name, nullptr to not share names
+	 *        loaded afterwards.
+	 * @param dropped Lets the caller forget what it keeps about a key once
+	 *        its content is dropped. Must not call back into the cache.
+	 */
+	void setContentKey(ContentKey key, ContentDropped dropped = nullptr) {
+		std::lock_guard<std::mutex> lock(mContentMutex);
+		mContentKey = std::move(key);
+		mContentDropped = std::move(dropped);
+	}
+
+	DedupStats getDedupStats() {
+		std::lock_guard<std::mutex> lock(mContentMutex);
+		return mDedupStats;
+	}
+
+	std::size_t getRetainedSize() {
+		std::lock_guard<std::mutex> lock(mPoolMutex);
+		return mRetained;
+	}
+
 private:
+	struct Entry {
+		Entry() :
+			size(0),
+			key(0),
+			poolId(0)
+		{}
+
+		std::shared_ptr<T> object; // nullptr while loading, shared by equal content
+		std::shared_future<std::shared_ptr<T>> pending;
+		std::weak_ptr<T> handle;
+		std::size_t size;
+		std::uint64_t key; // of the content, 0 if not shared by content
+		std::uint64_t poolId; // while in the pool, 0 otherwise
+	};
+
+	struct Shard {
+		std::mutex mutex;
+		std::unordered_map<std::string,Entry> map;
+	};
+
+	/**
+	 * @brief An unused resource in the pool.
+	 *
+	 * Evicted resources leave the pool before their shard is locked to erase
+	 * them. The id tells whether the entry was put into the pool again in the
+	 * meantime.
+	 */
+	struct Retained {
+		std::uint64_t id;
+		std::string name;
+		std::size_t size;
+	};
+
+	struct Content {
+		std::weak_ptr<T> object;
+		std::size_t size;
+		std::size_t names; // holding the object
+	};
+
+	/**
+	 * @brief Loads a resource, or finds a resource with equal content.
+	 */
+	std::shared_ptr<T> load(const std::string &name, std::size_t &size, std::uint64_t &key) {
+		ContentKey contentKey;
+		{
+			std::lock_guard<std::mutex> lock(mContentMutex);
+			contentKey = mContentKey;
+		}
+		std::function<T()> loadContent;
+		key = contentKey ? contentKey(name, loadContent) : 0;
+		if (key != 0) {
+			std::lock_guard<std::mutex> lock(mContentMutex);
+			auto it = mContents.find(key);
+			if (it != mContents.end()) {
+				std::shared_ptr<T> object = it->second.object.lock();
+				if (object) {
+					++it->second.names;
+					size = it->second.size;
+					++mDedupStats.hits;
+					mDedupStats.savedSize += size;
+					return object;
+				}
+				mContents.erase(it);
+			}
+		}
+
+		std::shared_ptr<T> object;
+		try {
+			object = std::make_shared<T>(loadContent ? loadContent() : (mLoader->*Func)(name));
+		} catch (...) {
+			if (key != 0) {
+				std::lock_guard<std::mutex> lock(mContentMutex);
+				if (mContents.find(key) == mContents.end() && mContentDropped)
+					mContentDropped(key);
+			}
+			throw;
+		}
+		size = ResourceSize<T>::estimate(*object);
+		if (key != 0) {
+			std::lock_guard<std::mutex> lock(mContentMutex);
+			// a concurrent load of equal content may have come first, both stay valid
+			mContents[key] = Content{object, size, 1};
+			++mDedupStats.misses;
+		}
+		return object;
+	}
+
+	/**
+	 * @brief Removes an entry from the names holding its content.
+	 *
+	 * The content of a replaced entry is not known anymore, so resources with
+	 * its old content are not shared with it.
+	 *
+	 * @return <code>true</code> if other names still hold the object.
+	 */
+	bool forget(Entry &entry) {
+		if (entry.key == 0)
+			return false;
+		std::lock_guard<std::mutex> lock(mContentMutex);
+		auto it = mContents.find(entry.key);
+		entry.key = 0;
+		if (it == mContents.end() || it->second.object.lock() != entry.object)
+			return false;
+		if (--it->second.names > 0)
+			return true;
+		const std::uint64_t key = it->first;
+		mContents.erase(it);
+		if (mContentDropped)
+			mContentDropped(key);
+		return false;
+	}
+
+	Shard &getShard(const std::string &name) {
+		return mShards[std::hash<std::string>()(name) % SHARDS];
+	}
+
+	std::shared_ptr<T> acquire(const std::string &name, Entry &entry) {
+		std::shared_ptr<T> result = entry.handle.lock();
+		if (result)
+			return result;
+
+		if (entry.poolId != 0) {
+			std::lock_guard<std::mutex> lock(mPoolMutex);
+			// the entry may be evicted already and only wait to be erased
+			auto pos = mPoolIndex.find(entry.poolId);
+			if (pos != mPoolIndex.end()) {
+				mRetained -= pos->second->size;
+				mLru.erase(pos->second);
+				mPoolIndex.erase(pos);
+			}
+			entry.poolId = 0;
+		}
+		// the handle keeps the object, which may be replaced in the entry
+		std::shared_ptr<T> object = entry.object;
+		result = std::shared_ptr<T>(object.get(), [this,name,object](T*){
+			release(name);
+		});
+		entry.handle = result;
+		return result;
+	}
+
+	void release(const std::string &name) {
+		Shard &shard = getShard(name);
+		std::vector<Retained> victims;
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+
+			auto it = shard.map.find(name);
+			// the resource may have been handed out again in the meantime
+			if (it == shard.map.end() || !it->second.handle.expired() || it->second.poolId != 0)
+				return;
+
+			std::unique_lock<std::mutex> poolLock(mPoolMutex);
+			if (it->second.size > mBudget) {
+				poolLock.unlock();
+				forget(it->second);
+				shard.map.erase(it);
+				return;
+			}
+
+			Retained retained = {++mNextPoolId, name, it->second.size};
+			mLru.push_front(retained);
+			mPoolIndex[retained.id] = mLru.begin();
+			mRetained += retained.size;
+			it->second.poolId = retained.id;
+			takeVictims(victims);
+		}
+		evict(victims);
+	}
+
+	/**
+	 * @brief Removes the least recently used resources from the pool until it fits the budget.
+	 *
+	 * Must be called with the pool locked. The victims are erased from their
+	 * shards by ResourceCache::evict after the locks are released, as they may
+	 * belong to any shard.
+	 */
+	void takeVictims(std::vector<Retained> &victims) {
+		while (mRetained > mBudget) {
+			Retained &victim = mLru.back();
+			mRetained -= victim.size;
+			mPoolIndex.erase(victim.id);
+			victims.push_back(std::move(victim));
+			mLru.pop_back();
+		}
+	}
+
+	void evict(const std::vector<Retained> &victims) {
+		for (const Retained &victim : victims) {
+			Shard &shard = getShard(victim.name);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto it = shard.map.find(victim.name);
+			// skip entries acquired since, or put into the pool again
+			if (it == shard.map.end() || it->second.poolId != victim.id)
+				continue;
+			forget(it->second);
+			shard.map.erase(it);
+		}
+	}
+
 	const L * mLoader;
-	std::mutex mMutex;
-	std::unordered_map<std::string,std::weak_ptr<T>> mMap;
+	Shard mShards[SHARDS];
+	// the pool of unused resources, locked after a shard
+	std::mutex mPoolMutex;
+	std::list<Retained> mLru;
+	std::unordered_map<std::uint64_t,typename std::list<Retained>::iterator> mPoolIndex;
+	std::size_t mBudget;
+	std::size_t mRetained;
+	std::uint64_t mNextPoolId;
+	std::mutex mContentMutex;
+	ContentKey mContentKey;
+	ContentDropped mContentDropped;
+	// resources by key of their content, only while a name holds them
+	std::unordered_map<std::uint64_t,Content> mContents;
+	DedupStats mDedupStats;
 
 };
 
+template<class T, class L, T(L::*Func)(const std::string&) const>
+constexpr std::size_t ResourceCache<T,L,Func>::SHARDS;
+
 #endif // RESOURCECACHE_H
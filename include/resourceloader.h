@@ -1,19 +1,52 @@
 #ifndef RESOURCELOADER_H
 #define RESOURCELOADER_H
 
+#include <chrono>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
 #include <istream>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <gtl/ogl/program.h>
 #include <gtl/ogl/shader.h>
 #include <gtl/ogl/texture.h>
 
+#include "batchreader.h"
+#include "image.h"
+#include "resourcearchive.h"
 #include "resourcecache.h"
+#include "resourceview.h"
+#include "resourcewatcher.h"
+#include "threadpool.h"
+#include "uploadring.h"
 
 
+template<>
+struct ResourceSize<gtl::ogl::Texture>
+{
+	static std::size_t estimate(const gtl::ogl::Texture &texture);
+};
+
+template<>
+struct ResourceSize<gtl::ogl::Shader>
+{
+	static std::size_t estimate(const gtl::ogl::Shader &shader);
+};
+
+template<>
+struct ResourceSize<gtl::ogl::Program>
+{
+	static std::size_t estimate(const gtl::ogl::Program &program);
+};
+
 class ResourceNotFoundException : public std::runtime_error
 {
 public:
@@ -33,10 +66,17 @@ public:
 	virtual ~ResourceLoader();
 
 	bool exists(const std::string &name) const;
+	ResourceView map(const std::string &name) const;
 	std::unique_ptr<std::istream> open(const std::string &name) const;
 	std::string load(const std::string &name) const;
+	void prefetch(const std::vector<std::string> &names);
+	void startAccessTrace(const std::string &file);
+	void finishAccessTrace();
 
+	Image decodeTexture(const std::string &name) const;
+	gtl::ogl::Texture createTexture(const Image &image) const;
 	gtl::ogl::Texture loadTexture(const std::string &name) const;
+	std::future<gtl::ogl::Texture> loadTextureAsync(const std::string &name);
 	std::shared_ptr<const gtl::ogl::Texture> getTexture(const std::string &name);
 
 	gtl::ogl::Texture loadArrayTexture(const std::string names[], std::size_t len) const;
@@ -46,12 +86,116 @@ public:
 	std::shared_ptr<const gtl::ogl::Shader> getShader(const std::string &name);
 
 	gtl::ogl::Program loadShaderProgram(const std::string &name) const;
+	std::vector<gtl::ogl::Program> loadShaderPrograms(const std::vector<std::string> &names) const;
 	std::shared_ptr<const gtl::ogl::Program> getShaderProgram(const std::string &name);
 
+	std::size_t processUploads(double budget);
+
+	void enableHotReload();
+	void reloadChanged();
+
+	void setProgramBinaryCache(const std::string &dir);
+	void setCookedTextures(const std::string &dir);
+	void setTextureCacheBudget(std::size_t bytes);
+	void setProgramCacheBudget(std::size_t bytes);
+	void setTextureStreamingThreshold(std::size_t bytes);
+	void enableUploadRing(std::size_t size, std::size_t slots);
+	void enableTextureDedup();
+	DedupStats getTextureDedupStats();
+
 private:
+	struct PendingUpload {
+		std::future<Image> image;
+		std::promise<gtl::ogl::Texture> texture;
+	};
+	struct ShaderSource {
+		std::string source;
+		std::vector<std::string> dependencies;
+	};
+	struct TraceEntry {
+		bool texture; // decoded image, otherwise file
+		std::string name;
+		std::size_t size;
+		double start; // ms since the trace started
+		double duration; // ms
+	};
+	struct PendingReload {
+		std::string name;
+		ResourceWatcher::Clock::time_point time;
+		std::future<gtl::ogl::Texture> texture;
+	};
+	struct ContentId {
+		std::size_t size;
+		std::uint64_t check; // hash with another seed than the key
+	};
+
+	ResourceView readFile(const std::string &path) const;
+	void recordAccess(bool texture, const std::string &name, std::size_t size,
+				ResourceWatcher::Clock::time_point start) const;
+	bool takePredecoded(const std::string &name, Image &image, bool wait) const;
+	std::uint64_t getTextureContentKey(const std::string &name, std::function<gtl::ogl::Texture()> &load) const;
+	void dropTextureContentKey(std::uint64_t key) const;
+	std::string getCookedPath(const std::string &name) const;
+	ResourceView mapCookedTexture(const std::string &name) const;
+	Image decodeImage(const std::string &name) const;
+	gtl::ogl::Texture streamTexture(const std::string &name) const;
+	Image stageTexture(const std::string &name) const;
+	bool stageArchivedTexture(const std::string &name, Image &image) const;
+	gtl::ogl::Texture loadArrayTexture(const std::string &key) const;
+	void expandShader(const std::string &name, std::vector<std::string> &stack,
+				std::vector<std::string> &once, ShaderSource &out) const;
+	std::shared_ptr<const ShaderSource> preprocessShader(const std::string &name) const;
+	void invalidateShaderSources(const std::string &name);
+	std::string getShaderSource(const std::string &variant) const;
+	std::vector<std::string> getShaderDependencies(const std::string &variant) const;
+	gtl::ogl::Shader createShader(const std::string &variant) const;
+	gtl::ogl::Shader compileShader(const std::string &name) const;
+	std::vector<std::string> parseShaderProgram(const std::string &name) const;
+	std::uint64_t hashShaderProgram(const std::string &name, const std::vector<std::string> &shaders) const;
+	std::string getProgramBinaryPath(const std::string &name, const std::vector<std::string> &shaders) const;
+	std::vector<std::string> getShaderProgramDependencies(const std::string &name) const;
+
 	std::string mSearchpath;
+	std::unique_ptr<ResourceArchive> mArchive;
+	// reads prefetched files, only without an archive
+	std::unique_ptr<BatchReader> mReader;
+	mutable std::mutex mPrefetchMutex;
+	mutable std::unordered_map<std::string,std::shared_future<ResourceView>> mPrefetched;
+	// accesses of this run and the run replayed, see ResourceLoader::startAccessTrace
+	std::string mTraceFile;
+	mutable std::mutex mTraceMutex;
+	bool mTracing;
+	ResourceWatcher::Clock::time_point mTraceStart;
+	mutable std::vector<TraceEntry> mTrace;
+	std::vector<TraceEntry> mReplayed;
+	mutable std::unordered_map<std::string,std::future<Image>> mPredecoded;
+	std::string mProgramBinaryDir;
+	std::string mCookedDir;
+	bool mCookedTextures;
+	std::size_t mStreamingThreshold;
+	// content keys of textures by hash of their file, see ResourceLoader::getTextureContentKey
+	mutable std::mutex mContentKeyMutex;
+	mutable std::unordered_map<std::uint64_t,std::pair<ContentId,std::uint64_t>> mContentKeys;
+	// what each content key was computed from, to tell collisions from equal content
+	mutable std::unordered_map<std::uint64_t,ContentId> mContentIds;
+	// the file keys of mContentKeys by the content key they map to
+	mutable std::unordered_multimap<std::uint64_t,std::uint64_t> mFileKeys;
 	ResourceCache<gtl::ogl::Texture,ResourceLoader,&ResourceLoader::loadTexture> textureCache;
+	ResourceCache<gtl::ogl::Texture,ResourceLoader,&ResourceLoader::loadArrayTexture> arrayTextureCache;
+	// programs share their shaders through this cache, even from const functions
+	mutable ResourceCache<gtl::ogl::Shader,ResourceLoader,&ResourceLoader::compileShader> shaderCache;
 	ResourceCache<gtl::ogl::Program,ResourceLoader,&ResourceLoader::loadShaderProgram> programCache;
+	// expanded shader sources by name, see ResourceLoader::preprocessShader
+	mutable std::mutex mShaderSourceMutex;
+	mutable std::unordered_map<std::string,std::shared_ptr<const ShaderSource>> mShaderSources;
+	// declared before anything holding images in its slots
+	std::unique_ptr<UploadRing> mUploadRing;
+	std::mutex mUploadMutex;
+	std::deque<PendingUpload> mUploads;
+	std::unique_ptr<ResourceWatcher> mWatcher;
+	std::vector<PendingReload> mReloads;
+	// declared last to join the workers before anything they use is destroyed
+	mutable ThreadPool mWorkers;
 
 };
 
@@ -0,0 +1,71 @@
+#ifndef RESOURCEVIEW_H
+#define RESOURCEVIEW_H
+
+#include <cstddef>
+#include <istream>
+#include <memory>
+#include <streambuf>
+#include <utility>
+
+
+class ResourceView
+{
+public:
+	ResourceView() :
+		mData(nullptr),
+		mSize(0)
+	{}
+	ResourceView(std::shared_ptr<const void> owner, const unsigned char *data, std::size_t size) :
+		mOwner(std::move(owner)),
+		mData(data),
+		mSize(size)
+	{}
+
+	const unsigned char *data() const {
+		return mData;
+	}
+	std::size_t size() const {
+		return mSize;
+	}
+	bool empty() const {
+		return mSize == 0;
+	}
+
+private:
+	std::shared_ptr<const void> mOwner;
+	const unsigned char *mData;
+	std::size_t mSize;
+
+};
+
+class ResourceViewBuf : public std::streambuf
+{
+public:
+	ResourceViewBuf(const ResourceView &view);
+
+protected:
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+				std::ios_base::openmode which) override;
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+	ResourceView mView;
+
+};
+
+class ResourceViewStream : public std::istream
+{
+public:
+	ResourceViewStream(const ResourceView &view) :
+		std::istream(nullptr),
+		mBuf(view)
+	{
+		rdbuf(&mBuf);
+	}
+
+private:
+	ResourceViewBuf mBuf;
+
+};
+
+#endif // RESOURCEVIEW_H
@@ -0,0 +1,49 @@
+#ifndef RESOURCEWATCHER_H
+#define RESOURCEWATCHER_H
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+/**
+ * @brief Watches a directory tree for modified files.
+ *
+ * Uses inotify on Linux. On other systems no changes are reported.
+ */
+class ResourceWatcher
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Change {
+		std::string name;
+		Clock::time_point time;
+	};
+
+	ResourceWatcher(const std::string &dir);
+	~ResourceWatcher();
+
+	ResourceWatcher(const ResourceWatcher&) = delete;
+	ResourceWatcher &operator=(const ResourceWatcher&) = delete;
+
+	std::vector<Change> poll();
+
+private:
+	void addWatches(const std::string &name);
+	void run();
+
+	std::string mDir;
+	int mFd;
+	int mWakeup[2];
+	std::unordered_map<int,std::string> mWatches;
+	std::mutex mMutex;
+	std::vector<Change> mChanges;
+	std::thread mThread;
+
+};
+
+#endif // RESOURCEWATCHER_H
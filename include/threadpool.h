@@ -0,0 +1,53 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+class ThreadPool
+{
+public:
+	ThreadPool(std::size_t threads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool &operator=(const ThreadPool&) = delete;
+
+	std::size_t size() const {
+		return mThreads.size();
+	}
+
+	bool isWorker() const;
+
+	template<class F>
+	std::future<typename std::result_of<F()>::type> submit(F &&func) {
+		typedef typename std::result_of<F()>::type R;
+		auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(func));
+		std::future<R> result = task->get_future();
+		post([task](){ (*task)(); });
+		return result;
+	}
+
+private:
+	void post(std::function<void()> &&job);
+	void run();
+
+	std::vector<std::thread> mThreads;
+	std::deque<std::function<void()>> mJobs;
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	bool mStop;
+
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,52 @@
+#ifndef UPLOADRING_H
+#define UPLOADRING_H
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include <GL/glew.h>
+
+
+class UploadRing
+{
+public:
+	UploadRing(std::size_t size, std::size_t slots);
+	~UploadRing();
+
+	UploadRing(const UploadRing&) = delete;
+	UploadRing &operator=(const UploadRing&) = delete;
+
+	GLuint getBuffer() const {
+		return mBuffer;
+	}
+	std::size_t getSlotSize() const {
+		return mSlotSize;
+	}
+	bool contains(const unsigned char *data) const {
+		return data >= mData && data < mData + mSlotSize * mSlots.size();
+	}
+	std::size_t getOffset(const unsigned char *data) const {
+		return data - mData;
+	}
+
+	unsigned char *acquire(std::size_t size);
+	void release(const unsigned char *data);
+	void fence(const unsigned char *data);
+	void retire();
+
+private:
+	struct Slot {
+		bool used;
+		GLsync fence; // nullptr once OpenGL finished reading the slot
+	};
+
+	GLuint mBuffer;
+	unsigned char *mData;
+	std::size_t mSlotSize;
+	std::mutex mMutex;
+	std::vector<Slot> mSlots;
+
+};
+
+#endif // UPLOADRING_H
@@ -390,6 +390,28 @@ unsigned char*
 		int force_channels
 	);
 
+/**
+	Decodes an image from memory a few rows at a time, so large images
+	never have to be held in memory as a whole.  begin is called once
+	with the size of the image and the channel count of the rows, which
+	is force_channels unless that is SOIL_LOAD_AUTO.  Then rows receives
+	the rows in order, in batches of count tightly packed rows starting
+	at row y; the pixels are only valid during the call.  Either callback
+	may return 0 to stop.  PNG and baseline JPEG images are streamed,
+	other formats are decoded at once and passed on in a single batch.
+	\return 0 if failed or stopped, otherwise returns 1
+**/
+int
+	SOIL_load_image_rows_from_memory
+	(
+		const unsigned char *const buffer,
+		int buffer_length,
+		int force_channels,
+		int (*begin)(void *user, int width, int height, int channels),
+		int (*rows)(void *user, int y, int count, const unsigned char *pixels),
+		void *user
+	);
+
 /**
 	Saves an image from an array of unsigned chars (RGBA) to disk
 	\return 0 if failed, otherwise returns 1
@@ -416,8 +438,8 @@ void
 
 /**
 	This function resturn a pointer to a string describing the last thing
-	that happened inside SOIL.  It can be used to determine why an image
-	failed to load.
+	that happened inside SOIL on the calling thread.  It can be used to
+	determine why an image failed to load.
 **/
 const char*
 	SOIL_last_result
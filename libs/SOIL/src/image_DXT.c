@@ -13,6 +13,25 @@
 #include <string.h>
 #include <stdio.h>
 
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+#else
+	#include <pthread.h>
+	#include <unistd.h>
+#endif
+
+/*	SSE2 is part of every x86-64 CPU (define STBI_NO_SIMD to remove code)	*/
+#if !defined(STBI_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#define DXT_SSE2
+	#include <emmintrin.h>
+#endif
+
+/*	the rows of blocks are split across up to this many threads, as long
+	as every thread gets at least DXT_MIN_BLOCKS_PER_THREAD blocks	*/
+#define DXT_MAX_THREADS	16
+#define DXT_MIN_BLOCKS_PER_THREAD	1024
+
 /*	set this =1 if you want to use the covarince matrix method...
 	which is better than my method of using standard deviations
 	overall, except on the infintesimal chance that the power
@@ -37,6 +56,34 @@ void compress_DDS_color_block(
 void compress_DDS_alpha_block(
 				const unsigned char *const uncompressed,
 				unsigned char compressed[8] );
+/*
+	Compresses the rows of blocks [first_row, last_row) of an image,
+	into the location of these rows in the compressed image.
+*/
+typedef void (*DXT_rows_func)(
+				const unsigned char *const uncompressed,
+				int width, int height, int channels,
+				unsigned char *compressed,
+				int first_row, int last_row );
+static void compress_DXT1_rows(
+				const unsigned char *const uncompressed,
+				int width, int height, int channels,
+				unsigned char *compressed,
+				int first_row, int last_row );
+static void compress_DXT5_rows(
+				const unsigned char *const uncompressed,
+				int width, int height, int channels,
+				unsigned char *compressed,
+				int first_row, int last_row );
+/*
+	Runs func on all rows of blocks, split across several threads
+	if the image is large enough.
+*/
+static void compress_DXT_parallel(
+				DXT_rows_func func,
+				const unsigned char *const uncompressed,
+				int width, int height, int channels,
+				unsigned char *compressed );
 
 /********* Actual Exposed Functions *********/
 int
@@ -104,11 +151,6 @@ unsigned char* convert_image_to_DXT1(
 		int *out_size )
 {
 	unsigned char *compressed;
-	int i, j, x, y;
-	unsigned char ublock[16*3];
-	unsigned char cblock[8];
-	int index = 0, chan_step = 1;
-	int block_count = 0;
 	/*	error check	*/
 	*out_size = 0;
 	if( (width < 1) || (height < 1) ||
@@ -117,17 +159,38 @@ unsigned char* convert_image_to_DXT1(
 	{
 		return NULL;
 	}
+	/*	get the RAM for the compressed image
+		(8 bytes per 4x4 pixel block)	*/
+	*out_size = ((width+3) >> 2) * ((height+3) >> 2) * 8;
+	compressed = (unsigned char*)malloc( *out_size );
+	if( NULL == compressed )
+	{
+		*out_size = 0;
+		return NULL;
+	}
+	/*	the blocks are independent of each other	*/
+	compress_DXT_parallel( compress_DXT1_rows,
+			uncompressed, width, height, channels, compressed );
+	return compressed;
+}
+
+static void compress_DXT1_rows(
+		const unsigned char *const uncompressed,
+		int width, int height, int channels,
+		unsigned char *compressed,
+		int first_row, int last_row )
+{
+	int i, j, x, y;
+	unsigned char ublock[16*3];
+	unsigned char cblock[8];
+	int index = first_row * ((width+3) >> 2) * 8, chan_step = 1;
 	/*	for channels == 1 or 2, I do not step forward for R,G,B values	*/
 	if( channels < 3 )
 	{
 		chan_step = 0;
 	}
-	/*	get the RAM for the compressed image
-		(8 bytes per 4x4 pixel block)	*/
-	*out_size = ((width+3) >> 2) * ((height+3) >> 2) * 8;
-	compressed = (unsigned char*)malloc( *out_size );
 	/*	go through each block	*/
-	for( j = 0; j < height; j += 4 )
+	for( j = first_row*4; j < last_row*4; j += 4 )
 	{
 		for( i = 0; i < width; i += 4 )
 		{
@@ -142,32 +205,19 @@ unsigned char* convert_image_to_DXT1(
 			{
 				mx = width - i;
 			}
-			for( y = 0; y < my; ++y )
-			{
-				for( x = 0; x < mx; ++x )
-				{
-					ublock[idx++] = uncompressed[(j+y)*width*channels+(i+x)*channels];
-					ublock[idx++] = uncompressed[(j+y)*width*channels+(i+x)*channels+chan_step];
-					ublock[idx++] = uncompressed[(j+y)*width*channels+(i+x)*channels+chan_step+chan_step];
-				}
-				for( x = mx; x < 4; ++x )
-				{
-					ublock[idx++] = ublock[0];
-					ublock[idx++] = ublock[1];
-					ublock[idx++] = ublock[2];
-				}
-			}
-			for( y = my; y < 4; ++y )
+			/*	edge blocks repeat the last row and column of the image	*/
+			for( y = 0; y < 4; ++y )
 			{
+				int row = (j + ((y < my) ? y : my - 1)) * width;
 				for( x = 0; x < 4; ++x )
 				{
-					ublock[idx++] = ublock[0];
-					ublock[idx++] = ublock[1];
-					ublock[idx++] = ublock[2];
+					int src = (row + i + ((x < mx) ? x : mx - 1)) * channels;
+					ublock[idx++] = uncompressed[src];
+					ublock[idx++] = uncompressed[src+chan_step];
+					ublock[idx++] = uncompressed[src+chan_step+chan_step];
 				}
 			}
 			/*	compress the block	*/
-			++block_count;
 			compress_DDS_color_block( 3, ublock, cblock );
 			/*	copy the data from the block into the main block	*/
 			for( x = 0; x < 8; ++x )
@@ -176,7 +226,6 @@ unsigned char* convert_image_to_DXT1(
 			}
 		}
 	}
-	return compressed;
 }
 
 unsigned char* convert_image_to_DXT5(
@@ -185,11 +234,6 @@ unsigned char* convert_image_to_DXT5(
 		int *out_size )
 {
 	unsigned char *compressed;
-	int i, j, x, y;
-	unsigned char ublock[16*4];
-	unsigned char cblock[8];
-	int index = 0, chan_step = 1;
-	int block_count = 0, has_alpha;
 	/*	error check	*/
 	*out_size = 0;
 	if( (width < 1) || (height < 1) ||
@@ -198,6 +242,32 @@ unsigned char* convert_image_to_DXT5(
 	{
 		return NULL;
 	}
+	/*	get the RAM for the compressed image
+		(16 bytes per 4x4 pixel block)	*/
+	*out_size = ((width+3) >> 2) * ((height+3) >> 2) * 16;
+	compressed = (unsigned char*)malloc( *out_size );
+	if( NULL == compressed )
+	{
+		*out_size = 0;
+		return NULL;
+	}
+	/*	the blocks are independent of each other	*/
+	compress_DXT_parallel( compress_DXT5_rows,
+			uncompressed, width, height, channels, compressed );
+	return compressed;
+}
+
+static void compress_DXT5_rows(
+		const unsigned char *const uncompressed,
+		int width, int height, int channels,
+		unsigned char *compressed,
+		int first_row, int last_row )
+{
+	int i, j, x, y;
+	unsigned char ublock[16*4];
+	unsigned char cblock[8];
+	int index = first_row * ((width+3) >> 2) * 16, chan_step = 1;
+	int has_alpha;
 	/*	for channels == 1 or 2, I do not step forward for R,G,B vales	*/
 	if( channels < 3 )
 	{
@@ -205,12 +275,8 @@ unsigned char* convert_image_to_DXT5(
 	}
 	/*	# channels = 1 or 3 have no alpha, 2 & 4 do have alpha	*/
 	has_alpha = 1 - (channels & 1);
-	/*	get the RAM for the compressed image
-		(16 bytes per 4x4 pixel block)	*/
-	*out_size = ((width+3) >> 2) * ((height+3) >> 2) * 16;
-	compressed = (unsigned char*)malloc( *out_size );
 	/*	go through each block	*/
-	for( j = 0; j < height; j += 4 )
+	for( j = first_row*4; j < last_row*4; j += 4 )
 	{
 		for( i = 0; i < width; i += 4 )
 		{
@@ -225,34 +291,20 @@ unsigned char* convert_image_to_DXT5(
 			{
 				mx = width - i;
 			}
-			for( y = 0; y < my; ++y )
+			/*	edge blocks repeat the last row and column of the image	*/
+			for( y = 0; y < 4; ++y )
 			{
-				for( x = 0; x < mx; ++x )
+				int row = (j + ((y < my) ? y : my - 1)) * width;
+				for( x = 0; x < 4; ++x )
 				{
-					ublock[idx++] = uncompressed[(j+y)*width*channels+(i+x)*channels];
-					ublock[idx++] = uncompressed[(j+y)*width*channels+(i+x)*channels+chan_step];
-					ublock[idx++] = uncompressed[(j+y)*width*channels+(i+x)*channels+chan_step+chan_step];
+					int src = (row + i + ((x < mx) ? x : mx - 1)) * channels;
+					ublock[idx++] = uncompressed[src];
+					ublock[idx++] = uncompressed[src+chan_step];
+					ublock[idx++] = uncompressed[src+chan_step+chan_step];
 					ublock[idx++] =
-						has_alpha * uncompressed[(j+y)*width*channels+(i+x)*channels+channels-1]
+						has_alpha * uncompressed[src+channels-1]
 						+ (1-has_alpha)*255;
 				}
-				for( x = mx; x < 4; ++x )
-				{
-					ublock[idx++] = ublock[0];
-					ublock[idx++] = ublock[1];
-					ublock[idx++] = ublock[2];
-					ublock[idx++] = ublock[3];
-				}
-			}
-			for( y = my; y < 4; ++y )
-			{
-				for( x = 0; x < 4; ++x )
-				{
-					ublock[idx++] = ublock[0];
-					ublock[idx++] = ublock[1];
-					ublock[idx++] = ublock[2];
-					ublock[idx++] = ublock[3];
-				}
 			}
 			/*	now compress the alpha block	*/
 			compress_DDS_alpha_block( ublock, cblock );
@@ -262,7 +314,6 @@ unsigned char* convert_image_to_DXT5(
 				compressed[index++] = cblock[x];
 			}
 			/*	then compress the color block	*/
-			++block_count;
 			compress_DDS_color_block( 4, ublock, cblock );
 			/*	copy the data from the compressed color block into the main buffer	*/
 			for( x = 0; x < 8; ++x )
@@ -271,7 +322,123 @@ unsigned char* convert_image_to_DXT5(
 			}
 		}
 	}
-	return compressed;
+}
+
+/********* Threading *********/
+typedef struct
+{
+	DXT_rows_func func;
+	const unsigned char *uncompressed;
+	int width, height, channels;
+	unsigned char *compressed;
+	int first_row, last_row;
+} DXT_task;
+
+static void run_DXT_task( DXT_task *task )
+{
+	task->func( task->uncompressed, task->width, task->height, task->channels,
+			task->compressed, task->first_row, task->last_row );
+}
+
+#ifdef _WIN32
+static DWORD WINAPI DXT_thread( LPVOID arg )
+{
+	run_DXT_task( (DXT_task*)arg );
+	return 0;
+}
+#else
+static void* DXT_thread( void *arg )
+{
+	run_DXT_task( (DXT_task*)arg );
+	return NULL;
+}
+#endif
+
+static int DXT_cpu_count( void )
+{
+	#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo( &info );
+	return (int)info.dwNumberOfProcessors;
+	#else
+	long n = sysconf( _SC_NPROCESSORS_ONLN );
+	return n > 0 ? (int)n : 1;
+	#endif
+}
+
+static void compress_DXT_parallel(
+		DXT_rows_func func,
+		const unsigned char *const uncompressed,
+		int width, int height, int channels,
+		unsigned char *compressed )
+{
+	DXT_task tasks[DXT_MAX_THREADS];
+	#ifdef _WIN32
+	HANDLE threads[DXT_MAX_THREADS];
+	#else
+	pthread_t threads[DXT_MAX_THREADS];
+	#endif
+	int started[DXT_MAX_THREADS];
+	int rows = (height+3) >> 2;
+	int blocks = ((width+3) >> 2) * rows;
+	int count = DXT_cpu_count(), i;
+	/*	small images are not worth the threads	*/
+	if( count > blocks / DXT_MIN_BLOCKS_PER_THREAD )
+	{
+		count = blocks / DXT_MIN_BLOCKS_PER_THREAD;
+	}
+	if( count > DXT_MAX_THREADS )
+	{
+		count = DXT_MAX_THREADS;
+	}
+	if( count > rows )
+	{
+		count = rows;
+	}
+	if( count < 2 )
+	{
+		func( uncompressed, width, height, channels, compressed, 0, rows );
+		return;
+	}
+	/*	split the rows evenly	*/
+	for( i = 0; i < count; ++i )
+	{
+		tasks[i].func = func;
+		tasks[i].uncompressed = uncompressed;
+		tasks[i].width = width;
+		tasks[i].height = height;
+		tasks[i].channels = channels;
+		tasks[i].compressed = compressed;
+		tasks[i].first_row = rows * i / count;
+		tasks[i].last_row = rows * (i+1) / count;
+	}
+	/*	the calling thread does the last part itself	*/
+	for( i = 0; i < count-1; ++i )
+	{
+		#ifdef _WIN32
+		threads[i] = CreateThread( NULL, 0, DXT_thread, &tasks[i], 0, NULL );
+		started[i] = (threads[i] != NULL);
+		#else
+		started[i] = (pthread_create( &threads[i], NULL, DXT_thread, &tasks[i] ) == 0);
+		#endif
+	}
+	run_DXT_task( &tasks[count-1] );
+	for( i = 0; i < count-1; ++i )
+	{
+		if( started[i] )
+		{
+			#ifdef _WIN32
+			WaitForSingleObject( threads[i], INFINITE );
+			CloseHandle( threads[i] );
+			#else
+			pthread_join( threads[i], NULL );
+			#endif
+		} else
+		{
+			/*	could not get a thread, do it here	*/
+			run_DXT_task( &tasks[i] );
+		}
+	}
 }
 
 /********* Helper Functions *********/
@@ -296,16 +463,131 @@ void rgb_888_from_565( unsigned int c, int *r, int *g, int *b )
 	*b = convert_bit_range( (c >> 00) & 31, 5, 8 );
 }
 
+#ifdef DXT_SSE2
+/*	gathers the R, G and B values of a 4x4 block into one register each	*/
+static void load_block_SSE2(
+		const unsigned char *const uncompressed,
+		int channels,
+		__m128i *r, __m128i *g, __m128i *b )
+{
+	unsigned char planes[3][16];
+	int i;
+	for( i = 0; i < 16; ++i )
+	{
+		planes[0][i] = uncompressed[i*channels+0];
+		planes[1][i] = uncompressed[i*channels+1];
+		planes[2][i] = uncompressed[i*channels+2];
+	}
+	*r = _mm_loadu_si128( (const __m128i*)planes[0] );
+	*g = _mm_loadu_si128( (const __m128i*)planes[1] );
+	*b = _mm_loadu_si128( (const __m128i*)planes[2] );
+}
+
+static int hsum_SSE2( __m128i v )
+{
+	v = _mm_add_epi32( v, _mm_shuffle_epi32( v, 0x4e ) );
+	v = _mm_add_epi32( v, _mm_shuffle_epi32( v, 0xb1 ) );
+	return _mm_cvtsi128_si32( v );
+}
+
+/*	the sum of the products of two rows of 16 values	*/
+static int dot16_SSE2( __m128i x, __m128i y )
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_madd_epi16( _mm_unpacklo_epi8( x, zero ), _mm_unpacklo_epi8( y, zero ) );
+	__m128i hi = _mm_madd_epi16( _mm_unpackhi_epi8( x, zero ), _mm_unpackhi_epi8( y, zero ) );
+	return hsum_SSE2( _mm_add_epi32( lo, hi ) );
+}
+
+static int sum16_SSE2( __m128i x )
+{
+	__m128i sad = _mm_sad_epu8( x, _mm_setzero_si128() );
+	return _mm_cvtsi128_si32( sad ) + _mm_cvtsi128_si32( _mm_srli_si128( sad, 8 ) );
+}
+
+/*	the integer sums are exact, and so are the float sums of the
+	scalar code (they stay below 2^24), so both give the same result	*/
+static void sum_block_colors_SSE2(
+		const unsigned char *const uncompressed,
+		int channels,
+		int sums[9] )
+{
+	__m128i r, g, b;
+	load_block_SSE2( uncompressed, channels, &r, &g, &b );
+	sums[0] = sum16_SSE2( r );
+	sums[1] = sum16_SSE2( g );
+	sums[2] = sum16_SSE2( b );
+	sums[3] = dot16_SSE2( r, r );
+	sums[4] = dot16_SSE2( g, g );
+	sums[5] = dot16_SSE2( b, b );
+	sums[6] = dot16_SSE2( r, g );
+	sums[7] = dot16_SSE2( r, b );
+	sums[8] = dot16_SSE2( g, b );
+}
+
+/*	the range of the dot products of the block with a direction, four
+	pixels at a time (same operations in the same order as the scalar code)	*/
+static void dot_range_SSE2(
+		const unsigned char *const uncompressed,
+		int channels,
+		const float direction[3],
+		float *dot_min, float *dot_max )
+{
+	__m128i r, g, b, zero = _mm_setzero_si128();
+	__m128 dr = _mm_set1_ps( direction[0] );
+	__m128 dg = _mm_set1_ps( direction[1] );
+	__m128 db = _mm_set1_ps( direction[2] );
+	__m128 vmin = _mm_set1_ps( 3.0e38f ), vmax = _mm_set1_ps( -3.0e38f );
+	float out[4];
+	int i;
+	load_block_SSE2( uncompressed, channels, &r, &g, &b );
+	for( i = 0; i < 4; ++i )
+	{
+		/*	widen the next four pixels to floats	*/
+		__m128 fr = _mm_cvtepi32_ps( _mm_unpacklo_epi16( _mm_unpacklo_epi8( r, zero ), zero ) );
+		__m128 fg = _mm_cvtepi32_ps( _mm_unpacklo_epi16( _mm_unpacklo_epi8( g, zero ), zero ) );
+		__m128 fb = _mm_cvtepi32_ps( _mm_unpacklo_epi16( _mm_unpacklo_epi8( b, zero ), zero ) );
+		__m128 dot = _mm_add_ps( _mm_add_ps( _mm_mul_ps( dr, fr ), _mm_mul_ps( dg, fg ) ), _mm_mul_ps( db, fb ) );
+		vmin = _mm_min_ps( vmin, dot );
+		vmax = _mm_max_ps( vmax, dot );
+		r = _mm_srli_si128( r, 4 );
+		g = _mm_srli_si128( g, 4 );
+		b = _mm_srli_si128( b, 4 );
+	}
+	vmin = _mm_min_ps( vmin, _mm_shuffle_ps( vmin, vmin, 0x4e ) );
+	vmin = _mm_min_ps( vmin, _mm_shuffle_ps( vmin, vmin, 0xb1 ) );
+	vmax = _mm_max_ps( vmax, _mm_shuffle_ps( vmax, vmax, 0x4e ) );
+	vmax = _mm_max_ps( vmax, _mm_shuffle_ps( vmax, vmax, 0xb1 ) );
+	_mm_storeu_ps( out, vmin );
+	*dot_min = out[0];
+	_mm_storeu_ps( out, vmax );
+	*dot_max = out[0];
+}
+#endif
+
 void compute_color_line_STDEV(
 		const unsigned char *const uncompressed,
 		int channels,
 		float point[3], float direction[3] )
 {
 	const float inv_16 = 1.0f / 16.0f;
-	int i;
 	float sum_r = 0.0f, sum_g = 0.0f, sum_b = 0.0f;
 	float sum_rr = 0.0f, sum_gg = 0.0f, sum_bb = 0.0f;
 	float sum_rg = 0.0f, sum_rb = 0.0f, sum_gb = 0.0f;
+	#ifdef DXT_SSE2
+	int sums[9];
+	sum_block_colors_SSE2( uncompressed, channels, sums );
+	sum_r = (float)sums[0];
+	sum_g = (float)sums[1];
+	sum_b = (float)sums[2];
+	sum_rr = (float)sums[3];
+	sum_gg = (float)sums[4];
+	sum_bb = (float)sums[5];
+	sum_rg = (float)sums[6];
+	sum_rb = (float)sums[7];
+	sum_gb = (float)sums[8];
+	#else
+	int i;
 	/*	calculate all data needed for the covariance matrix
 		( to compare with _rygdxt code)	*/
 	for( i = 0; i < 16*channels; i += channels )
@@ -320,6 +602,7 @@ void compute_color_line_STDEV(
 		sum_rb += uncompressed[i+0] * uncompressed[i+2];
 		sum_gb += uncompressed[i+1] * uncompressed[i+2];
 	}
+	#endif
 	/*	convert the sums to averages	*/
 	sum_r *= inv_16;
 	sum_g *= inv_16;
@@ -431,6 +714,9 @@ void LSE_master_colors_max_min(
 	vec_len2 = 1.0f / ( 0.00001f +
 			sum_x2[0]*sum_x2[0] + sum_x2[1]*sum_x2[1] + sum_x2[2]*sum_x2[2] );
 	/*	finding the max and min vector values	*/
+	#ifdef DXT_SSE2
+	dot_range_SSE2( uncompressed, channels, sum_x2, &dot_min, &dot_max );
+	#else
 	dot_max =
 			(
 				sum_x2[0] * uncompressed[0] +
@@ -454,6 +740,7 @@ void LSE_master_colors_max_min(
 			dot_max = dot;
 		}
 	}
+	#endif
 	/*	and the offset (from the average location)	*/
 	dot = sum_x2[0]*sum_x[0] + sum_x2[1]*sum_x[1] + sum_x2[2]*sum_x[2];
 	dot_min -= dot;
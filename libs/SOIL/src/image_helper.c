@@ -10,6 +10,12 @@
 #include <stdlib.h>
 #include <math.h>
 
+/*	SSE2 is part of every x86-64 CPU (define STBI_NO_SIMD to remove code)	*/
+#if !defined(STBI_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#define MIP_SSE2
+	#include <emmintrin.h>
+#endif
+
 /*	Upscaling the image uses simple bilinear interpolation	*/
 int
 	up_scale_image
@@ -151,6 +157,244 @@ int
 	return 1;
 }
 
+int
+	mipmap_chain_size
+	(
+		int width, int height, int channels,
+		int *levels
+	)
+{
+	int size = 0;
+	int n = 1;
+	/*	error check	*/
+	if( (width < 1) || (height < 1) || (channels < 1) )
+	{
+		if( levels != NULL )
+		{
+			*levels = 0;
+		}
+		return 0;
+	}
+	while( (width > 1) || (height > 1) )
+	{
+		width = (width > 1) ? width / 2 : 1;
+		height = (height > 1) ? height / 2 : 1;
+		size += width * height * channels;
+		++n;
+	}
+	if( levels != NULL )
+	{
+		*levels = n;
+	}
+	return size;
+}
+
+#ifdef MIP_SSE2
+/*	averages the 2x2 blocks of two rows of a 1, 2 or 4 channel image,
+	returns the number of pixels written (the rest is left to the caller)	*/
+static int mipmap_row_SSE2(
+		const unsigned char *row0, const unsigned char *row1,
+		unsigned char *out, int mip_width, int channels )
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16( 2 );
+	const __m128i low_bytes = _mm_set1_epi16( 0xFF );
+	/*	every iteration reads 32 bytes of each row and writes 16	*/
+	const int step = 16 / channels;
+	int i;
+	if( (channels != 1) && (channels != 2) && (channels != 4) )
+	{
+		return 0;
+	}
+	for( i = 0; i + step <= mip_width; i += step )
+	{
+		__m128i sums[2];
+		int k;
+		for( k = 0; k < 2; ++k )
+		{
+			__m128i a = _mm_loadu_si128( (const __m128i*)(row0 + i * 2 * channels + k * 16) );
+			__m128i b = _mm_loadu_si128( (const __m128i*)(row1 + i * 2 * channels + k * 16) );
+			if( channels == 1 )
+			{
+				/*	the two pixels of each pair share a 16 bit lane	*/
+				__m128i even = _mm_add_epi16( _mm_and_si128( a, low_bytes ), _mm_and_si128( b, low_bytes ) );
+				__m128i odd = _mm_add_epi16( _mm_srli_epi16( a, 8 ), _mm_srli_epi16( b, 8 ) );
+				sums[k] = _mm_add_epi16( even, odd );
+			} else
+			{
+				/*	add the rows, then the left and right pixel of each pair	*/
+				__m128i lo = _mm_add_epi16( _mm_unpacklo_epi8( a, zero ), _mm_unpacklo_epi8( b, zero ) );
+				__m128i hi = _mm_add_epi16( _mm_unpackhi_epi8( a, zero ), _mm_unpackhi_epi8( b, zero ) );
+				if( channels == 2 )
+				{
+					lo = _mm_shuffle_epi32( lo, _MM_SHUFFLE( 3, 1, 2, 0 ) );
+					hi = _mm_shuffle_epi32( hi, _MM_SHUFFLE( 3, 1, 2, 0 ) );
+				}
+				sums[k] = _mm_add_epi16( _mm_unpacklo_epi64( lo, hi ), _mm_unpackhi_epi64( lo, hi ) );
+			}
+			sums[k] = _mm_srli_epi16( _mm_add_epi16( sums[k], round ), 2 );
+		}
+		_mm_storeu_si128( (__m128i*)(out + i * channels), _mm_packus_epi16( sums[0], sums[1] ) );
+	}
+	return i;
+}
+#endif
+
+/*	builds the next level with a 2x2 box filter, odd rows and columns are dropped
+	like mipmap_image does (a 1 pixel wide or high level averages pairs)	*/
+static void mipmap_level(
+		const unsigned char *orig, int width, int height, int channels,
+		unsigned char *resampled, int mip_width, int mip_height )
+{
+	const int stride = width * channels;
+	const int dx = (width > 1) ? channels : 0;
+	const int dy = (height > 1) ? stride : 0;
+	int i, j, c;
+	for( j = 0; j < mip_height; ++j )
+	{
+		const unsigned char *row0 = orig + (dy ? 2 * j * stride : 0);
+		const unsigned char *row1 = row0 + dy;
+		unsigned char *out = resampled + j * mip_width * channels;
+		i = 0;
+#ifdef MIP_SSE2
+		if( dx && dy )
+		{
+			i = mipmap_row_SSE2( row0, row1, out, mip_width, channels );
+		}
+#endif
+		if( dx && dy )
+		{
+			/*	the pixels of a row are contiguous, so run over all their bytes	*/
+			const unsigned char *end = out + mip_width * channels;
+			const unsigned char *a = row0 + 2 * i * channels;
+			const unsigned char *b = row1 + 2 * i * channels;
+			for( out += i * channels; out < end; a += 2 * channels, b += 2 * channels )
+			{
+				for( c = 0; c < channels; ++c )
+				{
+					*out++ = (unsigned char)((a[c] + a[c + channels] + b[c] + b[c + channels] + 2) >> 2);
+				}
+			}
+			continue;
+		}
+		for( ; i < mip_width; ++i )
+		{
+			/*	a single row or column averages pairs of neighbours	*/
+			const int index = (dx ? 2 * i : 0) * channels;
+			for( c = 0; c < channels; ++c )
+			{
+				int sum = row0[index + c] + row0[index + dx + dy + c];
+				out[i * channels + c] = (unsigned char)((sum + 1) >> 1);
+			}
+		}
+	}
+}
+
+/*	the same filter, but averaging the colors in linear space	*/
+static void mipmap_level_sRGB(
+		const unsigned char *orig, int width, int height, int channels,
+		unsigned char *resampled, int mip_width, int mip_height,
+		const float *to_linear, const unsigned char *to_sRGB )
+{
+	const int stride = width * channels;
+	const int dx = (width > 1) ? channels : 0;
+	const int dy = (height > 1) ? stride : 0;
+	const float scale = (dx && dy) ? 0.25f : 0.5f;
+	/*	the alpha of 2 and 4 channel images stays linear	*/
+	const int colors = channels - 1 + (channels & 1);
+	int i, j, c;
+	for( j = 0; j < mip_height; ++j )
+	{
+		const unsigned char *row0 = orig + (dy ? 2 * j * stride : 0);
+		unsigned char *out = resampled + j * mip_width * channels;
+		for( i = 0; i < mip_width; ++i )
+		{
+			const unsigned char *p = row0 + (dx ? 2 * i : 0) * channels;
+			for( c = 0; c < channels; ++c )
+			{
+				if( c < colors )
+				{
+					float sum = to_linear[p[c]] + to_linear[p[c + dx + dy]];
+					if( dx && dy )
+					{
+						sum += to_linear[p[c + dx]] + to_linear[p[c + stride]];
+					}
+					out[i * channels + c] = to_sRGB[(int)(sum * scale * 4095.0f + 0.5f)];
+				} else
+				{
+					int sum = p[c] + p[c + dx + dy];
+					if( dx && dy )
+					{
+						sum += p[c + dx] + p[c + stride];
+					}
+					out[i * channels + c] = (dx && dy) ? (unsigned char)((sum + 2) >> 2)
+							: (unsigned char)((sum + 1) >> 1);
+				}
+			}
+		}
+	}
+}
+
+int
+	mipmap_chain
+	(
+		const unsigned char* const orig,
+		int width, int height, int channels,
+		int sRGB,
+		unsigned char* chain
+	)
+{
+	float to_linear[256];
+	unsigned char to_sRGB[4096];
+	const unsigned char *level = orig;
+	int levels = 1;
+	int i;
+	/*	error check	*/
+	if( (width < 1) || (height < 1) ||
+		(channels < 1) || (channels > 4) ||
+		(orig == NULL) || (chain == NULL) )
+	{
+		/*	nothing to do	*/
+		return 0;
+	}
+	if( sRGB )
+	{
+		/*	the tables live on the stack, so concurrent calls share nothing	*/
+		for( i = 0; i < 256; ++i )
+		{
+			float c = i / 255.0f;
+			to_linear[i] = (c <= 0.04045f) ? c / 12.92f : powf( (c + 0.055f) / 1.055f, 2.4f );
+		}
+		for( i = 0; i < 4096; ++i )
+		{
+			float l = i / 4095.0f;
+			float c = (l <= 0.0031308f) ? l * 12.92f : 1.055f * powf( l, 1.0f / 2.4f ) - 0.055f;
+			to_sRGB[i] = (unsigned char)(c * 255.0f + 0.5f);
+		}
+	}
+	while( (width > 1) || (height > 1) )
+	{
+		const int mip_width = (width > 1) ? width / 2 : 1;
+		const int mip_height = (height > 1) ? height / 2 : 1;
+		if( sRGB )
+		{
+			mipmap_level_sRGB( level, width, height, channels,
+					chain, mip_width, mip_height, to_linear, to_sRGB );
+		} else
+		{
+			mipmap_level( level, width, height, channels,
+					chain, mip_width, mip_height );
+		}
+		/*	the next level is built from this one while it is still in the cache	*/
+		level = chain;
+		chain += mip_width * mip_height * channels;
+		width = mip_width;
+		height = mip_height;
+		++levels;
+	}
+	return levels;
+}
+
 int
 	scale_image_RGB_to_NTSC_safe
 	(
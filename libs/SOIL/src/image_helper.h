@@ -43,6 +43,38 @@ int
 		int block_size_x, int block_size_y
 	);
 
+/**
+	Computes the number of MIPmap levels of an image,
+	from the full size down to 1x1 (each level is half
+	the size of the previous one, rounded down).
+	\return the bytes needed for all levels but the first
+**/
+int
+	mipmap_chain_size
+	(
+		int width, int height, int channels,
+		int *levels
+	);
+
+/**
+	This function builds all MIPmap levels of an image
+	in one pass.  Each level is box-filtered from the
+	previous one and stored right after it in chain,
+	which must hold mipmap_chain_size() bytes.  Any image
+	size works.  With sRGB set, the color channels are
+	averaged in linear space (alpha never is).  There is
+	no global state, so it may run on several threads.
+	\return 0 if failed, otherwise the number of levels
+**/
+int
+	mipmap_chain
+	(
+		const unsigned char* const orig,
+		int width, int height, int channels,
+		int sRGB,
+		unsigned char* chain
+	);
+
 /**
 	This function takes the RGB components of the image
 	and scales each channel from [0,255] to [16,235].
@@ -14,6 +14,7 @@
       writes BMP,TGA (define STBI_NO_WRITE to remove code)
       decoded from memory or through stdio FILE (define STBI_NO_STDIO to remove code)
       supports installable dequantizing-IDCT, YCbCr-to-RGB conversion (define STBI_SIMD)
+      SSE2 IDCT, SSE2/AVX2 YCbCr-to-RGB conversion chosen at runtime (define STBI_NO_SIMD to remove code)
 
    TODO:
       stbi_info_*
@@ -86,6 +87,20 @@
   #endif
 #endif
 
+// SSE2 is part of every x86-64 CPU, AVX2 kernels are compiled with a target
+// attribute and only called if the CPU supports them. Nothing is installed
+// globally, so decoding on several threads at once stays safe.
+#if !defined(STBI_NO_SIMD) && !STBI_SIMD
+  #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #define STBI_SSE2
+  #include <emmintrin.h>
+  #endif
+  #if defined(STBI_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define STBI_AVX2
+  #include <immintrin.h>
+  #endif
+#endif
+
 
 // implementation:
 typedef unsigned char uint8;
@@ -114,8 +129,8 @@ typedef unsigned char validate_uint32[sizeof(uint32)==4];
 // Generic API that works on all image types
 //
 
-// this is not threadsafe
-static char *failure_reason;
+// every thread has its own, so concurrent loads report their own failures
+static STBI_THREAD_LOCAL char *failure_reason;
 
 char *stbi_failure_reason(void)
 {
@@ -447,6 +462,14 @@ static void getn(stbi *s, stbi_uc *buffer, int n)
       return;
    }
 #endif
+   // like get8, read zeros past the end instead of beyond the buffer
+   if (n > s->img_buffer_end - s->img_buffer) {
+      int avail = (int) (s->img_buffer_end - s->img_buffer);
+      memcpy(buffer, s->img_buffer, avail);
+      memset(buffer+avail, 0, n-avail);
+      s->img_buffer = s->img_buffer_end;
+      return;
+   }
    memcpy(buffer, s->img_buffer, n);
    s->img_buffer += n;
 }
@@ -467,22 +490,12 @@ static uint8 compute_y(int r, int g, int b)
    return (uint8) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
-static unsigned char *convert_format(unsigned char *data, int img_n, int req_comp, uint x, uint y)
+// converts rows into a separate buffer, also used by the streaming decoders
+static void convert_rows(unsigned char *good, unsigned char const *data, int img_n, int req_comp, uint x, uint y)
 {
    int i,j;
-   unsigned char *good;
-
-   if (req_comp == img_n) return data;
-   assert(req_comp >= 1 && req_comp <= 4);
-
-   good = (unsigned char *) malloc(req_comp * x * y);
-   if (good == NULL) {
-      free(data);
-      return epuc("outofmem", "Out of memory");
-   }
-
    for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
+      unsigned char const *src = data + j * x * img_n;
       unsigned char *dest = good + j * x * req_comp;
 
       #define COMBO(a,b)  ((a)*8+(b))
@@ -506,7 +519,22 @@ static unsigned char *convert_format(unsigned char *data, int img_n, int req_com
       }
       #undef CASE
    }
+}
+
+static unsigned char *convert_format(unsigned char *data, int img_n, int req_comp, uint x, uint y)
+{
+   unsigned char *good;
+
+   if (req_comp == img_n) return data;
+   assert(req_comp >= 1 && req_comp <= 4);
+
+   good = (unsigned char *) malloc(req_comp * x * y);
+   if (good == NULL) {
+      free(data);
+      return epuc("outofmem", "Out of memory");
+   }
 
+   convert_rows(good, data, img_n, req_comp, x, y);
    free(data);
    return good;
 }
@@ -634,8 +662,16 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+
+   // streaming decode: with 'ring' set, the component buffers only hold the
+   // last JPEG_STREAM_MCU_ROWS MCU rows, which are handed out while decoding
+   struct jpeg_stream *stream;
+   int ring;
 } jpeg;
 
+#define JPEG_STREAM_MCU_ROWS  3
+static int stream_jpeg_rows(jpeg *z, uint32 y_end);
+
 static int build_huffman(huffman *h, int *count)
 {
    int i,j,k=0,code;
@@ -817,6 +853,7 @@ static int decode_block(jpeg *j, short data[64], huffman *hdc, huffman *hac, int
    return 1;
 }
 
+#ifndef STBI_SSE2
 // take a -128..127 value and clamp it and convert to 0..255
 __forceinline static uint8 clamp(int x)
 {
@@ -828,6 +865,7 @@ __forceinline static uint8 clamp(int x)
    }
    return (uint8) x;
 }
+#endif
 
 #define f2f(x)  (int) (((x) * 4096 + 0.5))
 #define fsh(x)  ((x) << 12)
@@ -870,7 +908,181 @@ __forceinline static uint8 clamp(int x)
    t1 += p2+p4;                                \
    t0 += p1+p3;
 
-#if !STBI_SIMD
+#if defined(STBI_SSE2)
+// same arithmetic as the scalar version below, on 16-bit lanes: the products
+// of two inputs with their constants are formed at once with pmaddwd, and
+// rows are turned into columns with unpack based transposes.
+static void idct_block(uint8 *out, int out_stride, short data[64], uint8 *dequantize)
+{
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i tmp;
+   __m128i zero = _mm_setzero_si128();
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y))
+
+   // out0 = c0[even]*x + c0[odd]*y, out1 = c1[even]*x + c1[odd]*y  (32-bit)
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m128i c0##lo = _mm_unpacklo_epi16((x),(y)); \
+      __m128i c0##hi = _mm_unpackhi_epi16((x),(y)); \
+      __m128i out0##_l = _mm_madd_epi16(c0##lo, c0); \
+      __m128i out0##_h = _mm_madd_epi16(c0##hi, c0); \
+      __m128i out1##_l = _mm_madd_epi16(c0##lo, c1); \
+      __m128i out1##_h = _mm_madd_epi16(c0##hi, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(zero, (in)), 4); \
+      __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(zero, (in)), 4)
+
+   #define dct_wadd(out, a, b) \
+      __m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+
+   #define dct_wsub(out, a, b) \
+      __m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by "s" and pack to 16-bit
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m128i abiased_l = _mm_add_epi32(a##_l, bias); \
+         __m128i abiased_h = _mm_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
+         out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+      }
+
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
+
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi16(a, b); \
+      b = _mm_unpackhi_epi16(tmp, b)
+
+   // one IDCT_1D on eight columns at once
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m128i sum04 = _mm_add_epi16(row0, row4); \
+         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m128i rot0_0 = dct_const(f2f(0.5411961f), f2f(0.5411961f) + f2f(-1.847759065f));
+   __m128i rot0_1 = dct_const(f2f(0.5411961f) + f2f( 0.765366865f), f2f(0.5411961f));
+   __m128i rot1_0 = dct_const(f2f(1.175875602f) + f2f(-0.899976223f), f2f(1.175875602f));
+   __m128i rot1_1 = dct_const(f2f(1.175875602f), f2f(1.175875602f) + f2f(-2.562915447f));
+   __m128i rot2_0 = dct_const(f2f(-1.961570560f) + f2f( 0.298631336f), f2f(-1.961570560f));
+   __m128i rot2_1 = dct_const(f2f(-1.961570560f), f2f(-1.961570560f) + f2f( 3.072711026f));
+   __m128i rot3_0 = dct_const(f2f(-0.390180644f) + f2f( 2.053119869f), f2f(-0.390180644f));
+   __m128i rot3_1 = dct_const(f2f(-0.390180644f), f2f(-0.390180644f) + f2f( 1.501321110f));
+
+   // rounding biases of both passes, the second one includes the +128 of clamp()
+   __m128i bias_0 = _mm_set1_epi32(512);
+   __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+
+   // load and dequantize
+   #define dct_load(r, i) \
+      r = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *) (data + (i)*8)), \
+                          _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (dequantize + (i)*8)), zero))
+   dct_load(row0, 0);
+   dct_load(row1, 1);
+   dct_load(row2, 2);
+   dct_load(row3, 3);
+   dct_load(row4, 4);
+   dct_load(row5, 5);
+   dct_load(row6, 6);
+   dct_load(row7, 7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16-bit 8x8 transpose
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack with saturation, which is the clamp to 0..255
+      __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1..b7
+      __m128i p1 = _mm_packus_epi16(row2, row3);
+      __m128i p2 = _mm_packus_epi16(row4, row5);
+      __m128i p3 = _mm_packus_epi16(row6, row7);
+
+      // 8-bit 8x8 transpose
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+   }
+
+   #undef dct_const
+   #undef dct_rot
+   #undef dct_widen
+   #undef dct_wadd
+   #undef dct_wsub
+   #undef dct_bfly32o
+   #undef dct_interleave8
+   #undef dct_interleave16
+   #undef dct_pass
+   #undef dct_load
+}
+#elif !STBI_SIMD
 // .344 seconds on 3*anemones.jpg
 static void idct_block(uint8 *out, int out_stride, short data[64], uint8 *dequantize)
 {
@@ -1037,9 +1249,9 @@ static int parse_entropy_coded_data(jpeg *z)
          for (i=0; i < w; ++i) {
             if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
             #if STBI_SIMD
-            stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
+            stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*(j*8 % z->img_comp[n].h2)+i*8, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
             #else
-            idct_block(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
+            idct_block(z->img_comp[n].data+z->img_comp[n].w2*(j*8 % z->img_comp[n].h2)+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
             #endif
             // every data block is an MCU, so countdown the restart interval
             if (--z->todo <= 0) {
@@ -1050,6 +1262,8 @@ static int parse_entropy_coded_data(jpeg *z)
                reset(z);
             }
          }
+         // hand out the rows which no longer depend on undecoded blocks
+         if (z->ring && !stream_jpeg_rows(z, j * 8)) return 0;
       }
    } else { // interleaved!
       int i,j,k,x,y;
@@ -1064,7 +1278,7 @@ static int parse_entropy_coded_data(jpeg *z)
                for (y=0; y < z->img_comp[n].v; ++y) {
                   for (x=0; x < z->img_comp[n].h; ++x) {
                      int x2 = (i*z->img_comp[n].h + x)*8;
-                     int y2 = (j*z->img_comp[n].v + y)*8;
+                     int y2 = (j*z->img_comp[n].v + y)*8 % z->img_comp[n].h2;
                      if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
                      #if STBI_SIMD
                      stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
@@ -1084,6 +1298,7 @@ static int parse_entropy_coded_data(jpeg *z)
                reset(z);
             }
          }
+         if (z->ring && !stream_jpeg_rows(z, j * z->img_mcu_h)) return 0;
       }
    }
    return 1;
@@ -1183,6 +1398,39 @@ static int process_scan_header(jpeg *z)
    return 1;
 }
 
+// allocates the component buffers of w2 x h2 samples
+static int alloc_jpeg_components(jpeg *z)
+{
+   int i;
+   for (i=0; i < z->s.img_n; ++i) {
+      z->img_comp[i].raw_data = malloc(z->img_comp[i].w2 * z->img_comp[i].h2+15);
+      if (z->img_comp[i].raw_data == NULL) {
+         for(--i; i >= 0; --i) {
+            free(z->img_comp[i].raw_data);
+            z->img_comp[i].data = NULL;
+         }
+         return e("outofmem", "Out of memory");
+      }
+      // align blocks for installable-idct using mmx/sse
+      z->img_comp[i].data = (uint8*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
+   }
+   return 1;
+}
+
+// gives up streaming while decoding, for scans which do not contain all
+// components; the rows are handed out after the last scan instead
+static int unring_jpeg_components(jpeg *z)
+{
+   int i;
+   for (i=0; i < z->s.img_n; ++i) {
+      free(z->img_comp[i].raw_data);
+      z->img_comp[i].data = NULL;
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+   }
+   z->ring = 0;
+   return alloc_jpeg_components(z);
+}
+
 static int process_frame_header(jpeg *z, int scan)
 {
    stbi *s = &z->s;
@@ -1228,6 +1476,7 @@ static int process_frame_header(jpeg *z, int scan)
    z->img_mcu_h = v_max * 8;
    z->img_mcu_x = (s->img_x + z->img_mcu_w-1) / z->img_mcu_w;
    z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
+   z->ring = z->stream && z->img_mcu_y > JPEG_STREAM_MCU_ROWS;
 
    for (i=0; i < s->img_n; ++i) {
       // number of effective pixels (e.g. for non-interleaved MCU)
@@ -1239,20 +1488,13 @@ static int process_frame_header(jpeg *z, int scan)
       // discard the extra data until colorspace conversion
       z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
       z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
-      z->img_comp[i].raw_data = malloc(z->img_comp[i].w2 * z->img_comp[i].h2+15);
-      if (z->img_comp[i].raw_data == NULL) {
-         for(--i; i >= 0; --i) {
-            free(z->img_comp[i].raw_data);
-            z->img_comp[i].data = NULL;
-         }
-         return e("outofmem", "Out of memory");
-      }
-      // align blocks for installable-idct using mmx/sse
-      z->img_comp[i].data = (uint8*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
-      z->img_comp[i].linebuf = NULL;
+      // the rows of an MCU row are resampled with the last row of the MCU
+      // row above and the first one of the MCU row below
+      if (z->ring)
+         z->img_comp[i].h2 = JPEG_STREAM_MCU_ROWS * z->img_comp[i].v * 8;
    }
 
-   return 1;
+   return alloc_jpeg_components(z);
 }
 
 // use comparisons since in some cases we handle more than one case (e.g. SOF)
@@ -1285,13 +1527,19 @@ static int decode_jpeg_header(jpeg *z, int scan)
 
 static int decode_jpeg_image(jpeg *j)
 {
-   int m;
+   int m, scans=0;
    j->restart_interval = 0;
    if (!decode_jpeg_header(j, SCAN_load)) return 0;
    m = get_marker(j);
    while (!EOI(m)) {
       if (SOS(m)) {
          if (!process_scan_header(j)) return 0;
+         if (j->ring) {
+            // rows handed out while decoding cannot be changed anymore
+            if (scans > 0) return e("multiple scans","JPEG format not supported: multiple scans");
+            if (j->scan_n != j->s.img_n && !unring_jpeg_components(j)) return 0;
+         }
+         ++scans;
          if (!parse_entropy_coded_data(j)) return 0;
       } else {
          if (!process_marker(j, m)) return 0;
@@ -1380,12 +1628,150 @@ static uint8 *resample_row_generic(uint8 *out, uint8 *in_near, uint8 *in_far, in
 
 #define float2fixed(x)  ((int) ((x) * 65536 + 0.5))
 
+#ifdef STBI_SSE2
+// The SIMD conversions compute exactly what the scalar loop below computes.
+// Constants above 1.0 are split into a shift by 16 and a remainder which fits
+// into 16 bits, so the products can be formed with pmaddwd:
+//    r = ((y+cr)   << 16) + cr*26345                + 32768
+//    g = ((y-cr)   << 16) + cr*18734   - cb*22554   + 32768
+//    b = ((y+2*cb) << 16)              - cb*14942   + 32768
+#define YCC_R_CR   (float2fixed(1.40200f) - 65536)
+#define YCC_G_CR   (65536 - float2fixed(0.71414f))
+#define YCC_G_CB   (-float2fixed(0.34414f))
+#define YCC_B_CB   (float2fixed(1.77200f) - 131072)
+
+// writes pixels given as RGBX words with 'step' bytes each
+static void store_pixels(uint8 *out, uint8 const *rgbx, int count, int step)
+{
+   int i;
+   if (step == 4) {
+      memcpy(out, rgbx, count*4);
+   } else {
+      for (i=0; i < count; ++i, out += 3, rgbx += 4) {
+         out[0] = rgbx[0];
+         out[1] = rgbx[1];
+         out[2] = rgbx[2];
+      }
+   }
+}
+
+// converts blocks of 8 pixels, returns the number of pixels converted
+static int YCbCr_to_RGB_sse2(uint8 *out, uint8 const *y, uint8 const *pcb, uint8 const *pcr, int count, int step)
+{
+   int i;
+   __m128i zero = _mm_setzero_si128();
+   __m128i c128 = _mm_set1_epi16(128);
+   __m128i alpha = _mm_set1_epi16(255);
+   __m128i round = _mm_set1_epi32(32768);
+   __m128i kr = _mm_setr_epi16(YCC_R_CR, 0, YCC_R_CR, 0, YCC_R_CR, 0, YCC_R_CR, 0);
+   __m128i kg = _mm_setr_epi16(YCC_G_CR, YCC_G_CB, YCC_G_CR, YCC_G_CB, YCC_G_CR, YCC_G_CB, YCC_G_CR, YCC_G_CB);
+   __m128i kb = _mm_setr_epi16(0, YCC_B_CB, 0, YCC_B_CB, 0, YCC_B_CB, 0, YCC_B_CB);
+   union { __m128i v[2]; uint8 b[32]; } px;
+
+   for (i=0; i+8 <= count; i += 8) {
+      __m128i yw = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (y+i)), zero);
+      __m128i cb = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (pcb+i)), zero), c128);
+      __m128i cr = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (pcr+i)), zero), c128);
+
+      // the 16.16 integer parts
+      __m128i yr = _mm_add_epi16(yw, cr);
+      __m128i yg = _mm_sub_epi16(yw, cr);
+      __m128i yb = _mm_add_epi16(yw, _mm_add_epi16(cb, cb));
+
+      __m128i crcb_l = _mm_unpacklo_epi16(cr, cb);
+      __m128i crcb_h = _mm_unpackhi_epi16(cr, cb);
+
+      #define ycc_channel(yc, k) \
+         _mm_packs_epi32( \
+            _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi16(zero, yc), _mm_madd_epi16(crcb_l, k)), round), 16), \
+            _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_unpackhi_epi16(zero, yc), _mm_madd_epi16(crcb_h, k)), round), 16))
+      __m128i rw = ycc_channel(yr, kr);
+      __m128i gw = ycc_channel(yg, kg);
+      __m128i bw = ycc_channel(yb, kb);
+      #undef ycc_channel
+
+      // back to bytes with saturation, then interleave to RGBX
+      __m128i rb = _mm_packus_epi16(rw, bw);
+      __m128i ga = _mm_packus_epi16(gw, alpha);
+      __m128i t0 = _mm_unpacklo_epi8(rb, ga);
+      __m128i t1 = _mm_unpackhi_epi8(rb, ga);
+      px.v[0] = _mm_unpacklo_epi16(t0, t1);
+      px.v[1] = _mm_unpackhi_epi16(t0, t1);
+      store_pixels(out, px.b, 8, step);
+      out += 8*step;
+   }
+   return i;
+}
+
+#ifdef STBI_AVX2
+// the same as YCbCr_to_RGB_sse2 on blocks of 16 pixels
+__attribute__((target("avx2")))
+static int YCbCr_to_RGB_avx2(uint8 *out, uint8 const *y, uint8 const *pcb, uint8 const *pcr, int count, int step)
+{
+   int i;
+   __m256i zero = _mm256_setzero_si256();
+   __m256i c128 = _mm256_set1_epi16(128);
+   __m256i alpha = _mm256_set1_epi16(255);
+   __m256i round = _mm256_set1_epi32(32768);
+   __m256i kr = _mm256_set1_epi32((int) (YCC_R_CR & 0xffff));
+   __m256i kg = _mm256_set1_epi32((int) ((YCC_G_CR & 0xffff) | ((unsigned) YCC_G_CB << 16)));
+   __m256i kb = _mm256_set1_epi32((int) (((unsigned) YCC_B_CB & 0xffff) << 16));
+   union { __m256i v[2]; uint8 b[64]; } px;
+
+   for (i=0; i+16 <= count; i += 16) {
+      __m256i yw = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (y+i)));
+      __m256i cb = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (pcb+i))), c128);
+      __m256i cr = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (pcr+i))), c128);
+
+      __m256i yr = _mm256_add_epi16(yw, cr);
+      __m256i yg = _mm256_sub_epi16(yw, cr);
+      __m256i yb = _mm256_add_epi16(yw, _mm256_add_epi16(cb, cb));
+
+      // unpacking works within 128-bit lanes, the packs below undo the shuffle
+      __m256i crcb_l = _mm256_unpacklo_epi16(cr, cb);
+      __m256i crcb_h = _mm256_unpackhi_epi16(cr, cb);
+
+      #define ycc_channel(yc, k) \
+         _mm256_packs_epi32( \
+            _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(zero, yc), _mm256_madd_epi16(crcb_l, k)), round), 16), \
+            _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(zero, yc), _mm256_madd_epi16(crcb_h, k)), round), 16))
+      __m256i rw = ycc_channel(yr, kr);
+      __m256i gw = ycc_channel(yg, kg);
+      __m256i bw = ycc_channel(yb, kb);
+      #undef ycc_channel
+
+      // lane 0 holds pixels 0-7, lane 1 pixels 8-15
+      __m256i rb = _mm256_packus_epi16(rw, bw);
+      __m256i ga = _mm256_packus_epi16(gw, alpha);
+      __m256i t0 = _mm256_unpacklo_epi8(rb, ga);
+      __m256i t1 = _mm256_unpackhi_epi8(rb, ga);
+      __m256i o0 = _mm256_unpacklo_epi16(t0, t1); // pixels 0-3, 8-11
+      __m256i o1 = _mm256_unpackhi_epi16(t0, t1); // pixels 4-7, 12-15
+      px.v[0] = _mm256_permute2x128_si256(o0, o1, 0x20);
+      px.v[1] = _mm256_permute2x128_si256(o0, o1, 0x31);
+      store_pixels(out, px.b, 16, step);
+      out += 16*step;
+   }
+   return i;
+}
+#endif // STBI_AVX2
+#endif // STBI_SSE2
+
 // 0.38 seconds on 3*anemones.jpg   (0.25 with processor = Pro)
 // VC6 without processor=Pro is generating multiple LEAs per multiply!
 static void YCbCr_to_RGB_row(uint8 *out, uint8 *y, uint8 *pcb, uint8 *pcr, int count, int step)
 {
-   int i;
-   for (i=0; i < count; ++i) {
+   int i = 0;
+   #ifdef STBI_SSE2
+   #ifdef STBI_AVX2
+   if (__builtin_cpu_supports("avx2"))
+      i = YCbCr_to_RGB_avx2(out, y, pcb, pcr, count, step);
+   else
+   #endif
+      i = YCbCr_to_RGB_sse2(out, y, pcb, pcr, count, step);
+   out += i*step;
+   #endif
+   for (; i < count; ++i) {
       int y_fixed = (y[i] << 16) + 32768; // rounding
       int r,g,b;
       int cr = pcr[i] - 128;
@@ -1443,104 +1829,179 @@ typedef struct
    int ypos;    // which pre-expansion row we're on
 } stbi_resample;
 
+// prepares the resampling of the first decode_n components
+static int start_resample(jpeg *z, stbi_resample *res_comp, int decode_n)
+{
+   int k;
+   for (k=0; k < decode_n; ++k) {
+      stbi_resample *r = &res_comp[k];
+
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (uint8 *) malloc(z->s.img_x + 3);
+      if (!z->img_comp[k].linebuf) return e("outofmem", "Out of memory");
+
+      r->hs      = z->img_h_max / z->img_comp[k].h;
+      r->vs      = z->img_v_max / z->img_comp[k].v;
+      r->ystep   = r->vs >> 1;
+      r->w_lores = (z->s.img_x + r->hs-1) / r->hs;
+      r->ypos    = 0;
+      r->line0   = r->line1 = z->img_comp[k].data;
+
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = resample_row_hv_2;
+      else                               r->resample = resample_row_generic;
+   }
+   return 1;
+}
+
+// resamples and color-converts the next row into 'out' with n components
+static void jpeg_output_row(jpeg *z, stbi_resample *res_comp, int decode_n, uint8 *out, int n)
+{
+   int k;
+   uint i;
+   uint8 *coutput[4];
+   for (k=0; k < decode_n; ++k) {
+      stbi_resample *r = &res_comp[k];
+      int y_bot = r->ystep >= (r->vs >> 1);
+      coutput[k] = r->resample(z->img_comp[k].linebuf,
+                               y_bot ? r->line1 : r->line0,
+                               y_bot ? r->line0 : r->line1,
+                               r->w_lores, r->hs);
+      if (++r->ystep >= r->vs) {
+         r->ystep = 0;
+         r->line0 = r->line1;
+         if (++r->ypos < z->img_comp[k].y) {
+            r->line1 += z->img_comp[k].w2;
+            // streaming wraps around the buffer
+            if (r->line1 == z->img_comp[k].data + z->img_comp[k].w2 * z->img_comp[k].h2)
+               r->line1 = z->img_comp[k].data;
+         }
+      }
+   }
+   if (n >= 3) {
+      uint8 *y = coutput[0];
+      if (z->s.img_n == 3) {
+         #if STBI_SIMD
+         stbi_YCbCr_installed(out, y, coutput[1], coutput[2], z->s.img_x, n);
+         #else
+         YCbCr_to_RGB_row(out, y, coutput[1], coutput[2], z->s.img_x, n);
+         #endif
+      } else
+         for (i=0; i < z->s.img_x; ++i) {
+            out[0] = out[1] = out[2] = y[i];
+            out[3] = 255; // not used if n==3
+            out += n;
+         }
+   } else {
+      uint8 *y = coutput[0];
+      if (n == 1)
+         for (i=0; i < z->s.img_x; ++i) out[i] = y[i];
+      else
+         for (i=0; i < z->s.img_x; ++i) *out++ = y[i], *out++ = 255;
+   }
+}
+
+// components to generate for req_comp, and how many of them to decode
+static void jpeg_output_components(jpeg *z, int req_comp, int *n, int *decode_n)
+{
+   *n = req_comp ? req_comp : z->s.img_n;
+   if (z->s.img_n == 3 && *n < 3)
+      *decode_n = 1;
+   else
+      *decode_n = z->s.img_n;
+}
+
 static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
    int n, decode_n;
+   uint j;
+   uint8 *output;
+   stbi_resample res_comp[4];
+
    // validate req_comp
    if (req_comp < 0 || req_comp > 4) return epuc("bad req_comp", "Internal error");
    z->s.img_n = 0;
+   z->stream = NULL;
 
    // load a jpeg image from whichever source
    if (!decode_jpeg_image(z)) { cleanup_jpeg(z); return NULL; }
 
    // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s.img_n;
-
-   if (z->s.img_n == 3 && n < 3)
-      decode_n = 1;
-   else
-      decode_n = z->s.img_n;
+   jpeg_output_components(z, req_comp, &n, &decode_n);
 
    // resample and color-convert
-   {
-      int k;
-      uint i,j;
-      uint8 *output;
-      uint8 *coutput[4];
-
-      stbi_resample res_comp[4];
-
-      for (k=0; k < decode_n; ++k) {
-         stbi_resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (uint8 *) malloc(z->s.img_x + 3);
-         if (!z->img_comp[k].linebuf) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s.img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = resample_row_hv_2;
-         else                               r->resample = resample_row_generic;
-      }
+   if (!start_resample(z, res_comp, decode_n)) { cleanup_jpeg(z); return NULL; }
 
-      // can't error after this so, this is safe
-      output = (uint8 *) malloc(n * z->s.img_x * z->s.img_y + 1);
-      if (!output) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s.img_y; ++j) {
-         uint8 *out = output + n * z->s.img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi_resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            uint8 *y = coutput[0];
-            if (z->s.img_n == 3) {
-               #if STBI_SIMD
-               stbi_YCbCr_installed(out, y, coutput[1], coutput[2], z->s.img_x, n);
-               #else
-               YCbCr_to_RGB_row(out, y, coutput[1], coutput[2], z->s.img_x, n);
-               #endif
-            } else
-               for (i=0; i < z->s.img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            uint8 *y = coutput[0];
-            if (n == 1)
-               for (i=0; i < z->s.img_x; ++i) out[i] = y[i];
-            else
-               for (i=0; i < z->s.img_x; ++i) *out++ = y[i], *out++ = 255;
-         }
-      }
-      cleanup_jpeg(z);
-      *out_x = z->s.img_x;
-      *out_y = z->s.img_y;
-      if (comp) *comp  = z->s.img_n; // report original components, not output
-      return output;
+   // can't error after this so, this is safe
+   output = (uint8 *) malloc(n * z->s.img_x * z->s.img_y + 1);
+   if (!output) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
+
+   // now go ahead and resample
+   for (j=0; j < z->s.img_y; ++j)
+      jpeg_output_row(z, res_comp, decode_n, output + n * z->s.img_x * j, n);
+
+   cleanup_jpeg(z);
+   *out_x = z->s.img_x;
+   *out_y = z->s.img_y;
+   if (comp) *comp  = z->s.img_n; // report original components, not output
+   return output;
+}
+
+typedef struct jpeg_stream
+{
+   stbi_row_callbacks const *cb;
+   void *user;
+   int req_comp, n, decode_n;
+   stbi_resample res_comp[4];
+   uint32 y;       // next row to hand out
+   uint8 *batch;   // one MCU row of output, NULL until the first rows
+} jpeg_stream;
+
+// hands out the rows above y_end which were not handed out yet
+static int stream_jpeg_rows(jpeg *z, uint32 y_end)
+{
+   jpeg_stream *st = z->stream;
+   uint32 i, count, stride;
+   if (st->batch == NULL) {
+      jpeg_output_components(z, st->req_comp, &st->n, &st->decode_n);
+      if (!st->cb->begin(st->user, z->s.img_x, z->s.img_y, st->n)) return e("stopped","Decoding stopped");
+      if (!start_resample(z, st->res_comp, st->decode_n)) return 0;
+      // like the output of load_jpeg_image, YCbCr_to_RGB_row may write one byte beyond
+      st->batch = (uint8 *) malloc(st->n * z->s.img_x * z->img_mcu_h + 1);
+      if (st->batch == NULL) return e("outofmem", "Out of memory");
    }
+   stride = st->n * z->s.img_x;
+   if (y_end > z->s.img_y) y_end = z->s.img_y;
+   while (st->y < y_end) {
+      count = y_end - st->y;
+      if (count > (uint32) z->img_mcu_h) count = z->img_mcu_h;
+      for (i=0; i < count; ++i)
+         jpeg_output_row(z, st->res_comp, st->decode_n, st->batch + stride * i, st->n);
+      if (!st->cb->rows(st->user, st->y, count, st->batch)) return e("stopped","Decoding stopped");
+      st->y += count;
+   }
+   return 1;
+}
+
+static int stream_jpeg(jpeg *z, int req_comp, stbi_row_callbacks const *cb, void *user)
+{
+   jpeg_stream st;
+   int r;
+   st.cb = cb;
+   st.user = user;
+   st.req_comp = req_comp;
+   st.y = 0;
+   st.batch = NULL;
+   z->s.img_n = 0;
+   z->stream = &st;
+   // with ring buffers, most rows are handed out while decoding
+   r = decode_jpeg_image(z) && stream_jpeg_rows(z, z->s.img_y);
+   cleanup_jpeg(z);
+   free(st.batch);
+   return r;
 }
 
 #ifndef STBI_NO_STDIO
@@ -1604,7 +2065,7 @@ extern int      stbi_jpeg_info_from_memory(stbi_uc const *buffer, int len, int *
 //      - fast huffman
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define ZFAST_BITS  9 // accelerate all cases in default tables
+#define ZFAST_BITS  10 // accelerate all cases in default tables
 #define ZFAST_MASK  ((1 << ZFAST_BITS) - 1)
 
 // zlib-style huffman encoding
@@ -1687,42 +2148,94 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
 //    we require PNG read all the IDATs and combine them into a single
 //    memory buffer
 
-typedef struct
+typedef unsigned long long uint64;
+
+// Lookup tables for the literal/length and distance codes of a block which
+// resolve everything that fits into ZFAST_BITS at once: up to two literals,
+// or a length or distance including its extra bits. Entries are
+//    bits  0- 7  number of bits to consume
+//    bits  8- 9  kind (ZENTRY_*)
+//    bit     10  a second literal follows the first one
+//    bits 16-31  literal(s), length, distance or symbol
+#define ZENTRY_MISS      0  // code is longer than ZFAST_BITS, decode the slow way
+#define ZENTRY_LITERALS  1
+#define ZENTRY_VALUE     2  // length or distance with extra bits applied
+#define ZENTRY_SYMBOL    3  // symbol whose extra bits must still be read
+#define ZENTRY_PAIR      (1 << 10)
+#define zentry(bits,kind,value)  ((uint32) (bits) | ((kind) << 8) | ((uint32) (value) << 16))
+#define zentry_bits(e)           ((int) ((e) & 255))
+#define zentry_kind(e)           ((int) ((e) >> 8) & 3)
+#define zentry_value(e)          ((int) ((e) >> 16))
+
+typedef struct zbuf
 {
    uint8 *zbuffer, *zbuffer_end;
    int num_bits;
-   uint32 code_buffer;
+   uint64 code_buffer;
 
    char *zout;
    char *zout_start;
    char *zout_end;
    int   z_expandable;
 
+   // with a sink, the output is handed on whenever the buffer is full (see
+   // zflush) and the buffer only grows if the sink keeps too much of it
+   int (*sink)(void *user, uint8 *data, int len);
+   void *sink_user;
+   char *zout_pending; // first byte not consumed by the sink
+
+   // called for more input once zbuffer is exhausted, returns 0 at the end
+   int (*refill)(struct zbuf *z);
+   uint8 *zinput_end;
+
    zhuffman z_length, z_distance;
+   uint32 fast_length[1 << ZFAST_BITS];
+   uint32 fast_distance[1 << ZFAST_BITS];
 } zbuf;
 
 __forceinline static int zget8(zbuf *z)
 {
-   if (z->zbuffer >= z->zbuffer_end) return 0;
+   if (z->zbuffer >= z->zbuffer_end && !(z->refill && z->refill(z))) return 0;
    return *z->zbuffer++;
 }
 
+__forceinline static uint64 zload64(const uint8 *p)
+{
+   // compilers turn this into a single load on little endian machines
+   return  (uint64) p[0]        | ((uint64) p[1] <<  8) | ((uint64) p[2] << 16) | ((uint64) p[3] << 24)
+        | ((uint64) p[4] << 32) | ((uint64) p[5] << 40) | ((uint64) p[6] << 48) | ((uint64) p[7] << 56);
+}
+
+// tops the bit buffer up to at least 56 bits; past the end of the input
+// zeros are shifted in
 static void fill_bits(zbuf *z)
 {
-   do {
-      assert(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= zget8(z) << z->num_bits;
-      z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      int n = (63 - z->num_bits) >> 3;
+      uint64 word = zload64(z->zbuffer) & (((uint64) 1 << (n*8)) - 1);
+      z->code_buffer |= word << z->num_bits;
+      z->zbuffer += n;
+      z->num_bits += n*8;
+   } else {
+      do {
+         z->code_buffer |= (uint64) zget8(z) << z->num_bits;
+         z->num_bits += 8;
+      } while (z->num_bits <= 56);
+   }
+}
+
+__forceinline static void zconsume(zbuf *z, int n)
+{
+   z->code_buffer >>= n;
+   z->num_bits -= n;
 }
 
 __forceinline static unsigned int zreceive(zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
-   z->code_buffer >>= n;
-   z->num_bits -= n;
+   k = (unsigned int) z->code_buffer & ((1 << n) - 1);
+   zconsume(z, n);
    return k;
 }
 
@@ -1733,14 +2246,13 @@ __forceinline static int zhuffman_decode(zbuf *a, zhuffman *z)
    b = z->fast[a->code_buffer & ZFAST_MASK];
    if (b < 0xffff) {
       s = z->size[b];
-      a->code_buffer >>= s;
-      a->num_bits -= s;
+      zconsume(a, s);
       return z->value[b];
    }
 
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = bit_reverse(a->code_buffer, 16);
+   k = bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -1748,16 +2260,40 @@ __forceinline static int zhuffman_decode(zbuf *a, zhuffman *z)
    // code size is s, so:
    b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
    assert(z->size[b] == s);
-   a->code_buffer >>= s;
-   a->num_bits -= s;
+   zconsume(a, s);
    return z->value[b];
 }
 
+// passes the pending output to the sink, which returns how many bytes it
+// consumed or -1 to fail; then drops everything that is neither pending nor
+// part of the 32K window distances may refer to
+static int zflush(zbuf *z)
+{
+   int cur, keep;
+   int used = z->sink(z->sink_user, (uint8 *) z->zout_pending, (int) (z->zout - z->zout_pending));
+   if (used < 0) return 0;
+   z->zout_pending += used;
+   cur  = (int) (z->zout - z->zout_start);
+   keep = (int) (z->zout - z->zout_pending);
+   if (keep < 32768) keep = cur < 32768 ? cur : 32768;
+   if (keep < cur) {
+      memmove(z->zout_start, z->zout - keep, keep);
+      z->zout_pending -= cur - keep;
+      z->zout = z->zout_start + keep;
+   }
+   return 1;
+}
+
 static int expand(zbuf *z, int n)  // need to make room for n bytes
 {
    char *q;
-   int cur, limit;
+   int cur, limit, pending=0;
    if (!z->z_expandable) return e("output buffer limit","Corrupt PNG");
+   if (z->sink) {
+      if (!zflush(z)) return 0;
+      if (z->zout + n <= z->zout_end) return 1;
+      pending = (int) (z->zout_pending - z->zout_start);
+   }
    cur   = (int) (z->zout     - z->zout_start);
    limit = (int) (z->zout_end - z->zout_start);
    while (cur + n > limit)
@@ -1767,6 +2303,7 @@ static int expand(zbuf *z, int n)  // need to make room for n bytes
    z->zout_start = q;
    z->zout       = q + cur;
    z->zout_end   = q + limit;
+   if (z->sink) z->zout_pending = q + pending;
    return 1;
 }
 
@@ -1784,30 +2321,137 @@ static int dist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
 static int dist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+// fills the fast tables of the current block from its huffman codes
+static void zbuild_fast(zbuf *a)
+{
+   int i;
+   for (i=0; i < (1 << ZFAST_BITS); ++i) {
+      uint32 entry = ZENTRY_MISS;
+      int c = a->z_length.fast[i];
+      if (c < 0xffff) {
+         int s = a->z_length.size[c];
+         int z = a->z_length.value[c];
+         if (z < 256) {
+            // a second literal fits if its code is in the remaining bits
+            int c2 = a->z_length.fast[i >> s];
+            entry = zentry(s, ZENTRY_LITERALS, z);
+            if (c2 < 0xffff && s + a->z_length.size[c2] <= ZFAST_BITS && a->z_length.value[c2] < 256)
+               entry = zentry(s + a->z_length.size[c2], ZENTRY_LITERALS, z | (a->z_length.value[c2] << 8)) | ZENTRY_PAIR;
+         } else if (z > 256 && z < 286 && s + length_extra[z-257] <= ZFAST_BITS) {
+            int extra = length_extra[z-257];
+            entry = zentry(s + extra, ZENTRY_VALUE, length_base[z-257] + ((i >> s) & ((1 << extra) - 1)));
+         } else {
+            entry = zentry(s, ZENTRY_SYMBOL, z);
+         }
+      }
+      a->fast_length[i] = entry;
+
+      entry = ZENTRY_MISS;
+      c = a->z_distance.fast[i];
+      if (c < 0xffff) {
+         int s = a->z_distance.size[c];
+         int z = a->z_distance.value[c];
+         if (z < 30 && s + dist_extra[z] <= ZFAST_BITS)
+            entry = zentry(s + dist_extra[z], ZENTRY_VALUE, dist_base[z] + ((i >> s) & ((1 << dist_extra[z]) - 1)));
+         else
+            entry = zentry(s, ZENTRY_SYMBOL, z);
+      }
+      a->fast_distance[i] = entry;
+   }
+}
+
 static int parse_huffman_block(zbuf *a)
 {
+   char *zout = a->zout;
+   zbuild_fast(a);
    for(;;) {
-      int z = zhuffman_decode(a, &a->z_length);
-      if (z < 256) {
-         if (z < 0) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
-         if (a->zout >= a->zout_end) if (!expand(a, 1)) return 0;
-         *a->zout++ = (char) z;
+      uint32 entry;
+      int z,len,dist;
+      char *p;
+      // enough bits for the longest length and distance with extra bits
+      if (a->num_bits < 48) fill_bits(a);
+      entry = a->fast_length[a->code_buffer & ZFAST_MASK];
+      if (zentry_kind(entry) == ZENTRY_LITERALS) {
+         int n = entry & ZENTRY_PAIR ? 2 : 1;
+         zconsume(a, zentry_bits(entry));
+         if (zout + n > a->zout_end) {
+            a->zout = zout;
+            if (!expand(a, n)) return 0;
+            zout = a->zout;
+         }
+         *zout++ = (char) zentry_value(entry);
+         if (n == 2) *zout++ = (char) (zentry_value(entry) >> 8);
+         continue;
+      }
+
+      if (zentry_kind(entry) == ZENTRY_VALUE) {
+         zconsume(a, zentry_bits(entry));
+         len = zentry_value(entry);
       } else {
-         uint8 *p;
-         int len,dist;
-         if (z == 256) return 1;
+         if (zentry_kind(entry) == ZENTRY_SYMBOL) {
+            zconsume(a, zentry_bits(entry));
+            z = zentry_value(entry);
+         } else {
+            z = zhuffman_decode(a, &a->z_length);
+            if (z < 0) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
+         }
+         if (z < 256) {
+            if (zout >= a->zout_end) {
+               a->zout = zout;
+               if (!expand(a, 1)) return 0;
+               zout = a->zout;
+            }
+            *zout++ = (char) z;
+            continue;
+         }
+         if (z == 256) {
+            a->zout = zout;
+            return 1;
+         }
          z -= 257;
+         if (z >= 29) return e("bad huffman code","Corrupt PNG");
          len = length_base[z];
          if (length_extra[z]) len += zreceive(a, length_extra[z]);
-         z = zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return e("bad huffman code","Corrupt PNG");
+      }
+
+      entry = a->fast_distance[a->code_buffer & ZFAST_MASK];
+      if (zentry_kind(entry) == ZENTRY_VALUE) {
+         zconsume(a, zentry_bits(entry));
+         dist = zentry_value(entry);
+      } else {
+         if (zentry_kind(entry) == ZENTRY_SYMBOL) {
+            zconsume(a, zentry_bits(entry));
+            z = zentry_value(entry);
+         } else {
+            z = zhuffman_decode(a, &a->z_distance);
+         }
+         if (z < 0 || z >= 30) return e("bad huffman code","Corrupt PNG");
          dist = dist_base[z];
          if (dist_extra[z]) dist += zreceive(a, dist_extra[z]);
-         if (a->zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
-         if (a->zout + len > a->zout_end) if (!expand(a, len)) return 0;
-         p = (uint8 *) (a->zout - dist);
+      }
+
+      if (zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
+      if (zout + len > a->zout_end) {
+         a->zout = zout;
+         if (!expand(a, len)) return 0;
+         zout = a->zout;
+      }
+      p = zout - dist;
+      if (dist == 1) {
+         memset(zout, *p, len);
+         zout += len;
+      } else if (dist >= 8 && zout + len + 8 <= a->zout_end) {
+         // copy in words, the source is always far enough behind
+         char *end = zout + len;
+         do {
+            memcpy(zout, p, 8);
+            zout += 8;
+            p += 8;
+         } while (zout < end);
+         zout = end;
+      } else {
          while (len--)
-            *a->zout++ = *p++;
+            *zout++ = *p++;
       }
    }
 }
@@ -1815,7 +2459,7 @@ static int parse_huffman_block(zbuf *a)
 static int compute_huffman_codes(zbuf *a)
 {
    static uint8 length_dezigzag[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
-   static zhuffman z_codelength; // static just to save stack space
+   zhuffman z_codelength; // not static, concurrent decodes would share it
    uint8 lencodes[286+32+137];//padding for maximum single op
    uint8 codelength_sizes[19];
    int i,n;
@@ -1866,24 +2510,36 @@ static int parse_uncompressed_block(zbuf *a)
       zreceive(a, a->num_bits & 7); // discard
    // drain the bit-packed data into header
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (uint8) (a->code_buffer & 255); // wtf this warns?
-      a->code_buffer >>= 8;
-      a->num_bits -= 8;
+      zconsume(a, 8);
    }
-   assert(a->num_bits == 0);
    // now fill header the normal way
    while (k < 4)
       header[k++] = (uint8) zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return e("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return e("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!expand(a, len)) return 0;
-   memcpy(a->zout, a->zbuffer, len);
-   a->zbuffer += len;
-   a->zout += len;
+   // the bit buffer may still hold the first bytes of the data
+   while (a->num_bits > 0 && len > 0) {
+      *a->zout++ = (char) (a->code_buffer & 255);
+      zconsume(a, 8);
+      --len;
+   }
+   while (len > 0) {
+      int n = (int) (a->zbuffer_end - a->zbuffer);
+      if (n == 0) {
+         if (!(a->refill && a->refill(a))) return e("read past buffer","Corrupt PNG");
+         continue;
+      }
+      if (n > len) n = len;
+      memcpy(a->zout, a->zbuffer, n);
+      a->zbuffer += n;
+      a->zout += n;
+      len -= n;
+   }
    return 1;
 }
 
@@ -1900,18 +2556,23 @@ static int parse_zlib_header(zbuf *a)
    return 1;
 }
 
-// @TODO: should statically initialize these for optimal thread safety
-static uint8 default_length[288], default_distance[32];
-static void init_defaults(void)
+// statically initialized, so concurrent decodes never build them
+static uint8 default_length[288] =
 {
-   int i;   // use <= to match clearly with spec
-   for (i=0; i <= 143; ++i)     default_length[i]   = 8;
-   for (   ; i <= 255; ++i)     default_length[i]   = 9;
-   for (   ; i <= 279; ++i)     default_length[i]   = 7;
-   for (   ; i <= 287; ++i)     default_length[i]   = 8;
-
-   for (i=0; i <=  31; ++i)     default_distance[i] = 5;
-}
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,   //   0..31
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,   //  32..63
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,   //  64..95
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,   //  96..127
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,   // 128..159
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,   // 160..191
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,   // 192..223
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,   // 224..255
+   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,8,8,8,8,8,8,8,8    // 256..287
+};
+static uint8 default_distance[32] =
+{
+   5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5
+};
 
 static int parse_zlib(zbuf *a, int parse_header)
 {
@@ -1930,7 +2591,6 @@ static int parse_zlib(zbuf *a, int parse_header)
       } else {
          if (type == 1) {
             // use fixed code lengths
-            if (!default_distance[31]) init_defaults();
             if (!zbuild_huffman(&a->z_length  , default_length  , 288)) return 0;
             if (!zbuild_huffman(&a->z_distance, default_distance,  32)) return 0;
          } else {
@@ -1948,6 +2608,8 @@ static int do_zlib(zbuf *a, char *obuf, int olen, int exp, int parse_header)
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->sink = NULL;
+   a->refill = NULL;
 
    return parse_zlib(a, parse_header);
 }
@@ -2051,6 +2713,9 @@ typedef struct
 {
    stbi s;
    uint8 *idata, *expanded, *out;
+   // set to hand out rows instead of decoding into 'out'
+   stbi_row_callbacks const *rows_cb;
+   void *rows_user;
 } png;
 
 
@@ -2075,12 +2740,211 @@ static int paeth(int a, int b, int c)
    return c;
 }
 
+#ifdef STBI_SSE2
+// Unfiltering of whole scanlines with 'bpp' bytes per pixel. Sub and Up work
+// on 16 bytes at once, Sub with a prefix sum over the pixels in a register.
+// Average and Paeth depend on the pixel just decoded, so they work on one
+// pixel per step, but without branches. Pixels are loaded as 4 bytes; for
+// less than 4 bytes per pixel the surplus lanes carry garbage which is never
+// stored beyond the current pixel, and the last pixels of a row are finished
+// by scalar code so nothing outside the row is touched.
+
+__forceinline static __m128i load_px(uint8 const *p)
+{
+   int v;
+   memcpy(&v, p, 4);
+   return _mm_cvtsi32_si128(v);
+}
+
+__forceinline static void store_px(uint8 *p, __m128i v)
+{
+   int x = _mm_cvtsi128_si32(v);
+   memcpy(p, &x, 4);
+}
+
+static void unfilter_sub_sse2(uint8 *cur, uint8 const *raw, int n, int bpp)
+{
+   int x = 0;
+   int step = bpp == 3 ? 12 : 16; // whole pixels per register
+   __m128i carry = _mm_setzero_si128();
+   for (; x + 16 <= n; x += step) {
+      __m128i v = _mm_loadu_si128((const __m128i *) (raw + x));
+      // prefix sum over the pixels, then add the last pixel of the previous step
+      switch (bpp) {
+         case 1: v = _mm_add_epi8(v, _mm_slli_si128(v, 1)); // fall through
+         case 2: v = _mm_add_epi8(v, _mm_slli_si128(v, 2)); // fall through
+         case 4: v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+                 v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+                 break;
+         case 3: v = _mm_add_epi8(v, _mm_slli_si128(v, 3));
+                 v = _mm_add_epi8(v, _mm_slli_si128(v, 6));
+                 break;
+      }
+      v = _mm_add_epi8(v, carry);
+      _mm_storeu_si128((__m128i *) (cur + x), v);
+
+      // broadcast the last pixel
+      switch (bpp) {
+         case 1: carry = _mm_unpackhi_epi8(v, v);
+                 carry = _mm_shufflehi_epi16(carry, 0xff);
+                 carry = _mm_unpackhi_epi64(carry, carry);
+                 break;
+         case 2: carry = _mm_shufflehi_epi16(v, 0xff);
+                 carry = _mm_unpackhi_epi64(carry, carry);
+                 break;
+         case 3: carry = _mm_and_si128(_mm_srli_si128(v, 9), _mm_cvtsi32_si128(0xffffff));
+                 carry = _mm_or_si128(carry, _mm_slli_si128(carry, 3));
+                 carry = _mm_or_si128(carry, _mm_slli_si128(carry, 6));
+                 break;
+         case 4: carry = _mm_shuffle_epi32(v, 0xff);
+                 break;
+      }
+   }
+   for (; x < n; ++x)
+      cur[x] = raw[x] + (x >= bpp ? cur[x-bpp] : 0);
+}
+
+static void unfilter_up_sse2(uint8 *cur, uint8 const *prior, uint8 const *raw, int n)
+{
+   int x = 0;
+   for (; x + 16 <= n; x += 16) {
+      __m128i v = _mm_add_epi8(_mm_loadu_si128((const __m128i *) (raw + x)),
+                               _mm_loadu_si128((const __m128i *) (prior + x)));
+      _mm_storeu_si128((__m128i *) (cur + x), v);
+   }
+   for (; x < n; ++x)
+      cur[x] = raw[x] + prior[x];
+}
+
+static void unfilter_avg_sse2(uint8 *cur, uint8 const *prior, uint8 const *raw, int n, int bpp)
+{
+   int x = 0;
+   __m128i one = _mm_set1_epi8(1);
+   __m128i a = _mm_setzero_si128(); // left
+   for (; x + 4 <= n; x += bpp) {
+      __m128i b = load_px(prior + x);
+      // pavgb rounds up, the filter rounds down
+      __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+      a = _mm_add_epi8(avg, load_px(raw + x));
+      store_px(cur + x, a);
+   }
+   for (; x < n; ++x)
+      cur[x] = raw[x] + (((x >= bpp ? cur[x-bpp] : 0) + prior[x]) >> 1);
+}
+
+static void unfilter_paeth_sse2(uint8 *cur, uint8 const *prior, uint8 const *raw, int n, int bpp)
+{
+   int x = 0;
+   __m128i zero = _mm_setzero_si128();
+
+   __m128i a = zero, c = zero; // left and upper left, as 16-bit
+   for (; x + 4 <= n; x += bpp) {
+      __m128i b = _mm_unpacklo_epi8(load_px(prior + x), zero);
+      // p = a+b-c, so p-a = b-c, p-b = a-c and p-c = (b-c)+(a-c)
+      __m128i pas = _mm_sub_epi16(b, c);
+      __m128i pbs = _mm_sub_epi16(a, c);
+      __m128i pcs = _mm_add_epi16(pas, pbs);
+      __m128i pa = _mm_max_epi16(pas, _mm_sub_epi16(zero, pas));
+      __m128i pb = _mm_max_epi16(pbs, _mm_sub_epi16(zero, pbs));
+      __m128i pc = _mm_max_epi16(pcs, _mm_sub_epi16(zero, pcs));
+      __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+      // the ties are resolved in the order a, b, c like in paeth()
+      __m128i use_a = _mm_cmpeq_epi16(pa, smallest);
+      __m128i use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(pb, smallest));
+      __m128i use_c = _mm_andnot_si128(_mm_or_si128(use_a, use_b), _mm_cmpeq_epi16(zero, zero));
+      __m128i pred = _mm_or_si128(_mm_or_si128(_mm_and_si128(use_a, a), _mm_and_si128(use_b, b)),
+                                  _mm_and_si128(use_c, c));
+      __m128i v = _mm_add_epi8(_mm_packus_epi16(pred, pred), load_px(raw + x));
+      store_px(cur + x, v);
+      a = _mm_unpacklo_epi8(v, zero);
+      c = b;
+   }
+   for (; x < n; ++x)
+      cur[x] = (uint8) (raw[x] + paeth(x >= bpp ? cur[x-bpp] : 0, prior[x], x >= bpp ? prior[x-bpp] : 0));
+}
+
+// unfilters a scanline which has a prior scanline and no added alpha channel
+static void unfilter_row_sse2(int filter, uint8 *cur, uint8 const *prior, uint8 const *raw, int n, int bpp)
+{
+   switch (filter) {
+      case F_none : memcpy(cur, raw, n); break;
+      case F_sub  : unfilter_sub_sse2(cur, raw, n, bpp); break;
+      case F_up   : unfilter_up_sse2(cur, prior, raw, n); break;
+      case F_avg  : unfilter_avg_sse2(cur, prior, raw, n, bpp); break;
+      case F_paeth: unfilter_paeth_sse2(cur, prior, raw, n, bpp); break;
+   }
+}
+#endif // STBI_SSE2
+
+// unfilters one scanline; 'filter' is already mapped with first_row_filter
+// for the first row, which has no prior row
+static void create_png_row(uint8 *cur, uint8 const *prior, uint8 const *raw, int filter, uint32 x, int img_n, int out_n)
+{
+   uint32 i;
+   int k;
+   #ifdef STBI_SSE2
+   // with less than 3 bytes per pixel the scalar Paeth filter is faster
+   if (img_n == out_n && prior && (img_n >= 3 || filter != F_paeth)) {
+      unfilter_row_sse2(filter, cur, prior, raw, x * img_n, img_n);
+      return;
+   }
+   #endif
+   // handle first pixel explicitly
+   for (k=0; k < img_n; ++k) {
+      switch(filter) {
+         case F_none       : cur[k] = raw[k]; break;
+         case F_sub        : cur[k] = raw[k]; break;
+         case F_up         : cur[k] = raw[k] + prior[k]; break;
+         case F_avg        : cur[k] = raw[k] + (prior[k]>>1); break;
+         case F_paeth      : cur[k] = (uint8) (raw[k] + paeth(0,prior[k],0)); break;
+         case F_avg_first  : cur[k] = raw[k]; break;
+         case F_paeth_first: cur[k] = raw[k]; break;
+      }
+   }
+   if (img_n != out_n) cur[img_n] = 255;
+   raw += img_n;
+   cur += out_n;
+   prior += out_n;
+   // this is a little gross, so that we don't switch per-pixel or per-component
+   if (img_n == out_n) {
+      #define CASE(f) \
+          case f:     \
+             for (i=x-1; i >= 1; --i, raw+=img_n,cur+=img_n,prior+=img_n) \
+                for (k=0; k < img_n; ++k)
+      switch(filter) {
+         CASE(F_none)  cur[k] = raw[k]; break;
+         CASE(F_sub)   cur[k] = raw[k] + cur[k-img_n]; break;
+         CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
+         CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-img_n])>>1); break;
+         CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],prior[k],prior[k-img_n])); break;
+         CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-img_n] >> 1); break;
+         CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],0,0)); break;
+      }
+      #undef CASE
+   } else {
+      assert(img_n+1 == out_n);
+      #define CASE(f) \
+          case f:     \
+             for (i=x-1; i >= 1; --i, cur[img_n]=255,raw+=img_n,cur+=out_n,prior+=out_n) \
+                for (k=0; k < img_n; ++k)
+      switch(filter) {
+         CASE(F_none)  cur[k] = raw[k]; break;
+         CASE(F_sub)   cur[k] = raw[k] + cur[k-out_n]; break;
+         CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
+         CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-out_n])>>1); break;
+         CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],prior[k],prior[k-out_n])); break;
+         CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-out_n] >> 1); break;
+         CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],0,0)); break;
+      }
+      #undef CASE
+   }
+}
+
 // create the png data from post-deflated data
 static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n)
 {
    stbi *s = &a->s;
-   uint32 i,j,stride = s->img_x*out_n;
-   int k;
+   uint32 j,stride = s->img_x*out_n;
    int img_n = s->img_n; // copy it into a local for later
    assert(out_n == s->img_n || out_n == s->img_n+1);
    a->out = (uint8 *) malloc(s->img_x * s->img_y * out_n);
@@ -2088,69 +2952,19 @@ static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n)
    if (raw_len != (img_n * s->img_x + 1) * s->img_y) return e("not enough pixels","Corrupt PNG");
    for (j=0; j < s->img_y; ++j) {
       uint8 *cur = a->out + stride*j;
-      uint8 *prior = cur - stride;
       int filter = *raw++;
       if (filter > 4) return e("invalid filter","Corrupt PNG");
       // if first row, use special filter that doesn't sample previous row
       if (j == 0) filter = first_row_filter[filter];
-      // handle first pixel explicitly
-      for (k=0; k < img_n; ++k) {
-         switch(filter) {
-            case F_none       : cur[k] = raw[k]; break;
-            case F_sub        : cur[k] = raw[k]; break;
-            case F_up         : cur[k] = raw[k] + prior[k]; break;
-            case F_avg        : cur[k] = raw[k] + (prior[k]>>1); break;
-            case F_paeth      : cur[k] = (uint8) (raw[k] + paeth(0,prior[k],0)); break;
-            case F_avg_first  : cur[k] = raw[k]; break;
-            case F_paeth_first: cur[k] = raw[k]; break;
-         }
-      }
-      if (img_n != out_n) cur[img_n] = 255;
-      raw += img_n;
-      cur += out_n;
-      prior += out_n;
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (img_n == out_n) {
-         #define CASE(f) \
-             case f:     \
-                for (i=s->img_x-1; i >= 1; --i, raw+=img_n,cur+=img_n,prior+=img_n) \
-                   for (k=0; k < img_n; ++k)
-         switch(filter) {
-            CASE(F_none)  cur[k] = raw[k]; break;
-            CASE(F_sub)   cur[k] = raw[k] + cur[k-img_n]; break;
-            CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
-            CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-img_n])>>1); break;
-            CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],prior[k],prior[k-img_n])); break;
-            CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-img_n] >> 1); break;
-            CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],0,0)); break;
-         }
-         #undef CASE
-      } else {
-         assert(img_n+1 == out_n);
-         #define CASE(f) \
-             case f:     \
-                for (i=s->img_x-1; i >= 1; --i, cur[img_n]=255,raw+=img_n,cur+=out_n,prior+=out_n) \
-                   for (k=0; k < img_n; ++k)
-         switch(filter) {
-            CASE(F_none)  cur[k] = raw[k]; break;
-            CASE(F_sub)   cur[k] = raw[k] + cur[k-out_n]; break;
-            CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
-            CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-out_n])>>1); break;
-            CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],prior[k],prior[k-out_n])); break;
-            CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-out_n] >> 1); break;
-            CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],0,0)); break;
-         }
-         #undef CASE
-      }
+      create_png_row(cur, j ? cur - stride : NULL, raw, filter, s->img_x, img_n, out_n);
+      raw += s->img_x * img_n;
    }
    return 1;
 }
 
-static int compute_transparency(png *z, uint8 tc[3], int out_n)
+static void compute_transparency(uint8 *p, uint32 pixel_count, uint8 tc[3], int out_n)
 {
-   stbi *s = &z->s;
-   uint32 i, pixel_count = s->img_x * s->img_y;
-   uint8 *p = z->out;
+   uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
@@ -2168,20 +2982,11 @@ static int compute_transparency(png *z, uint8 tc[3], int out_n)
          p += 4;
       }
    }
-   return 1;
 }
 
-static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
+static void expand_palette_rows(uint8 *p, uint8 const *orig, uint32 pixel_count, uint8 const *palette, int pal_img_n)
 {
-   uint32 i, pixel_count = a->s.img_x * a->s.img_y;
-   uint8 *p, *temp_out, *orig = a->out;
-
-   p = (uint8 *) malloc(pixel_count * pal_img_n);
-   if (p == NULL) return e("outofmem", "Out of memory");
-
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
-
+   uint32 i;
    if (pal_img_n == 3) {
       for (i=0; i < pixel_count; ++i) {
          int n = orig[i]*4;
@@ -2200,17 +3005,154 @@ static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
          p += 4;
       }
    }
+}
+
+static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
+{
+   uint32 pixel_count = a->s.img_x * a->s.img_y;
+   uint8 *p = (uint8 *) malloc(pixel_count * pal_img_n);
+   if (p == NULL) return e("outofmem", "Out of memory");
+   expand_palette_rows(p, a->out, pixel_count, palette, pal_img_n);
    free(a->out);
-   a->out = temp_out;
+   a->out = p;
    return 1;
 }
 
+// rows handed out per callback by the streaming PNG decoder
+#define PNG_STREAM_ROWS  16
+
+typedef struct
+{
+   stbi_row_callbacks const *cb;
+   void *user;
+   uint32 x, y_max;
+   uint32 y;             // next row to unfilter
+   int img_n, out_n;     // components in the file and after unfiltering
+   int pal_n, comp;      // components after depalettizing and delivered
+   uint8 *palette, *tc;  // tc is NULL without tRNS
+   uint8 *cur, *prior, *depal, *batch;
+   uint32 batch_rows;
+} png_stream;
+
+// zlib sink: unfilters and converts all complete scanlines of 'data'
+static int png_stream_rows(void *user, uint8 *data, int len)
+{
+   png_stream *ps = (png_stream *) user;
+   int raw_len = ps->img_n * ps->x + 1, used = 0;
+   for (; len - used >= raw_len; used += raw_len) {
+      uint8 *raw = data + used, *px, *t;
+      int filter = raw[0], n;
+      if (ps->y == ps->y_max) { e("not enough pixels","Corrupt PNG"); return -1; }
+      if (filter > 4) { e("invalid filter","Corrupt PNG"); return -1; }
+      if (ps->y == 0) filter = first_row_filter[filter];
+      create_png_row(ps->cur, ps->y ? ps->prior : NULL, raw+1, filter, ps->x, ps->img_n, ps->out_n);
+      if (ps->tc) compute_transparency(ps->cur, ps->x, ps->tc, ps->out_n);
+      px = ps->cur;
+      n = ps->out_n;
+      if (ps->pal_n) {
+         expand_palette_rows(ps->depal, ps->cur, ps->x, ps->palette, ps->pal_n);
+         px = ps->depal;
+         n = ps->pal_n;
+      }
+      if (n == ps->comp)
+         memcpy(ps->batch + ps->batch_rows * ps->x * ps->comp, px, ps->x * n);
+      else
+         convert_rows(ps->batch + ps->batch_rows * ps->x * ps->comp, px, n, ps->comp, ps->x, 1);
+      t = ps->prior; ps->prior = ps->cur; ps->cur = t;
+      ++ps->y;
+      if (++ps->batch_rows == PNG_STREAM_ROWS || ps->y == ps->y_max) {
+         if (!ps->cb->rows(ps->user, ps->y - ps->batch_rows, ps->batch_rows, ps->batch)) {
+            e("stopped","Decoding stopped");
+            return -1;
+         }
+         ps->batch_rows = 0;
+      }
+   }
+   return used;
+}
+
+// continues the zlib stream of a streamed PNG with the next IDAT chunk
+static int png_next_idat(zbuf *a)
+{
+   uint8 *p = a->zbuffer_end;
+   // skip the CRC of the chunk, then the header of the next one
+   while (a->zinput_end - p >= 12 && p[8] == 'I' && p[9] == 'D' && p[10] == 'A' && p[11] == 'T') {
+      uint32 len = ((uint32) p[4] << 24) + (p[5] << 16) + (p[6] << 8) + p[7];
+      p += 12;
+      if (len > (uint32) (a->zinput_end - p)) return 0;
+      a->zbuffer = p;
+      a->zbuffer_end = p + len;
+      if (len > 0) return 1;
+   }
+   return 0;
+}
+
+// inflates the IDAT chunks starting with the current one of length 'len'
+// straight from memory and hands out the rows while they are unfiltered;
+// the stream is left at the end of the last IDAT chunk read
+static int stream_png_image(png *z, uint32 len, uint8 *palette, int pal_img_n, uint8 *tc, int req_comp,
+                            stbi_row_callbacks const *cb, void *user)
+{
+   stbi *s = &z->s;
+   png_stream ps;
+   zbuf a;
+   uint32 raw_len = s->img_n * s->img_x + 1;
+   int window = 65536 + 2 * raw_len, ok;
+   uint8 *rows;
+
+   if (len > (uint32) (s->img_buffer_end - s->img_buffer)) return e("outofdata","Corrupt PNG");
+   ps.cb = cb;
+   ps.user = user;
+   ps.x = s->img_x;
+   ps.y_max = s->img_y;
+   ps.y = 0;
+   ps.img_n = s->img_n;
+   ps.out_n = s->img_out_n;
+   ps.pal_n = pal_img_n ? (req_comp >= 3 ? req_comp : pal_img_n) : 0;
+   ps.comp = req_comp ? req_comp : pal_img_n ? pal_img_n : s->img_out_n;
+   ps.palette = palette;
+   ps.tc = tc;
+   ps.batch_rows = 0;
+   if (!cb->begin(user, s->img_x, s->img_y, ps.comp)) return e("stopped","Decoding stopped");
+
+   rows = (uint8 *) malloc(s->img_x * (2 * ps.out_n + ps.pal_n + PNG_STREAM_ROWS * ps.comp));
+   if (rows == NULL) return e("outofmem", "Out of memory");
+   ps.cur = rows;
+   ps.prior = ps.cur + s->img_x * ps.out_n;
+   ps.depal = ps.prior + s->img_x * ps.out_n;
+   ps.batch = ps.depal + s->img_x * ps.pal_n;
+
+   a.zbuffer = s->img_buffer;
+   a.zbuffer_end = s->img_buffer + len;
+   a.zinput_end = s->img_buffer_end;
+   a.refill = png_next_idat;
+   a.zout_start = a.zout = a.zout_pending = (char *) malloc(window);
+   a.zout_end = a.zout_start + window;
+   a.z_expandable = 1;
+   a.sink = png_stream_rows;
+   a.sink_user = &ps;
+   ok = a.zout_start != NULL ? parse_zlib(&a, 1) && zflush(&a) : e("outofmem", "Out of memory");
+   if (ok && (ps.y != ps.y_max || a.zout != a.zout_pending)) ok = e("not enough pixels","Corrupt PNG");
+   s->img_buffer = a.zbuffer_end;
+   free(a.zout_start);
+   free(rows);
+   return ok;
+}
+
+// components after unfiltering, before depalettizing
+static int png_out_n(stbi *s, int req_comp, int pal_img_n, int has_trans)
+{
+   if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
+      return s->img_n+1;
+   return s->img_n;
+}
+
 static int parse_png_file(png *z, int scan, int req_comp)
 {
    uint8 palette[1024], pal_img_n=0;
    uint8 has_trans=0, tc[3];
    uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k;
+   int first=1,k,streamed=0;
    stbi *s = &z->s;
 
    if (!check_png_header(s)) return 0;
@@ -2263,7 +3205,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
          }
 
          case PNG_TYPE('t','R','N','S'): {
-            if (z->idata) return e("tRNS after IDAT","Corrupt PNG");
+            if (z->idata || streamed) return e("tRNS after IDAT","Corrupt PNG");
             if (pal_img_n) {
                if (scan == SCAN_header) { s->img_n = 4; return 1; }
                if (pal_len == 0) return e("tRNS before PLTE","Corrupt PNG");
@@ -2284,6 +3226,19 @@ static int parse_png_file(png *z, int scan, int req_comp)
          case PNG_TYPE('I','D','A','T'): {
             if (pal_img_n && !pal_len) return e("no PLTE","Corrupt PNG");
             if (scan == SCAN_header) { s->img_n = pal_img_n; return 1; }
+            if (z->rows_cb) {
+               // the first IDAT chunk starts decoding, which reads the
+               // following ones as well
+               if (streamed) {
+                  skip(s, c.length);
+               } else {
+                  s->img_out_n = png_out_n(s, req_comp, pal_img_n, has_trans);
+                  if (!stream_png_image(z, c.length, palette, pal_img_n, has_trans ? tc : NULL, req_comp, z->rows_cb, z->rows_user))
+                     return 0;
+                  streamed = 1;
+               }
+               break;
+            }
             if (ioff + c.length > idata_limit) {
                uint8 *p;
                if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
@@ -2300,6 +3255,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
             else
             #endif
             {
+               if (c.length > (uint32) (s->img_buffer_end - s->img_buffer)) return e("outofdata","Corrupt PNG");
                memcpy(z->idata+ioff, s->img_buffer, c.length);
                s->img_buffer += c.length;
             }
@@ -2310,17 +3266,17 @@ static int parse_png_file(png *z, int scan, int req_comp)
          case PNG_TYPE('I','E','N','D'): {
             uint32 raw_len;
             if (scan != SCAN_load) return 1;
+            if (streamed) return 1;
             if (z->idata == NULL) return e("no IDAT","Corrupt PNG");
-            z->expanded = (uint8 *) stbi_zlib_decode_malloc((char *) z->idata, ioff, (int *) &raw_len);
+            s->img_out_n = png_out_n(s, req_comp, pal_img_n, has_trans);
+            // the size of the filtered image is known, so the output never grows
+            raw_len = (s->img_n * s->img_x + 1) * s->img_y;
+            z->expanded = (uint8 *) stbi_zlib_decode_malloc_guesssize((char *) z->idata, ioff, raw_len, (int *) &raw_len);
             if (z->expanded == NULL) return 0; // zlib should set error
             free(z->idata); z->idata = NULL;
-            if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
-               s->img_out_n = s->img_n+1;
-            else
-               s->img_out_n = s->img_n;
             if (!create_png_image(z, z->expanded, raw_len, s->img_out_n)) return 0;
             if (has_trans)
-               if (!compute_transparency(z, tc, s->img_out_n)) return 0;
+               compute_transparency(z->out, s->img_x * s->img_y, tc, s->img_out_n);
             if (pal_img_n) {
                // pal_img_n == 3 or 4
                s->img_n = pal_img_n; // record the actual colors we had
@@ -2338,7 +3294,8 @@ static int parse_png_file(png *z, int scan, int req_comp)
             if ((c.type & (1 << 29)) == 0) {
                #ifndef STBI_NO_FAILURE_STRINGS
                // not threadsafe
-               static char invalid_chunk[] = "XXXX chunk not known";
+               // the failure reason points here, so every thread needs its own
+               static STBI_THREAD_LOCAL char invalid_chunk[] = "XXXX chunk not known";
                invalid_chunk[0] = (uint8) (c.type >> 24);
                invalid_chunk[1] = (uint8) (c.type >> 16);
                invalid_chunk[2] = (uint8) (c.type >>  8);
@@ -2360,6 +3317,7 @@ static unsigned char *do_png(png *p, int *x, int *y, int *n, int req_comp)
    p->expanded = NULL;
    p->idata = NULL;
    p->out = NULL;
+   p->rows_cb = NULL;
    if (req_comp < 0 || req_comp > 4) return epuc("bad req_comp", "Internal error");
    if (parse_png_file(p, SCAN_load, req_comp)) {
       result = p->out;
@@ -2380,6 +3338,19 @@ static unsigned char *do_png(png *p, int *x, int *y, int *n, int req_comp)
    return result;
 }
 
+static int stream_png(png *p, int req_comp, stbi_row_callbacks const *cb, void *user)
+{
+   int r;
+   p->expanded = NULL;
+   p->idata = NULL;
+   p->out = NULL;
+   p->rows_cb = cb;
+   p->rows_user = user;
+   r = parse_png_file(p, SCAN_load, req_comp);
+   free(p->idata); p->idata = NULL;
+   return r;
+}
+
 #ifndef STBI_NO_STDIO
 unsigned char *stbi_png_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
@@ -2433,6 +3404,31 @@ extern int      stbi_png_info_from_file   (FILE *f,                  int *x, int
 #endif
 extern int      stbi_png_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 
+// streaming decode, PNG and JPEG hand out rows while decoding
+int stbi_load_rows_from_memory(stbi_uc const *buffer, int len, int req_comp, stbi_row_callbacks const *cb, void *user)
+{
+   int x, y, comp, r;
+   stbi_uc *data;
+   if (req_comp < 0 || req_comp > 4) return e("bad req_comp", "Internal error");
+   if (stbi_jpeg_test_memory(buffer,len)) {
+      jpeg j;
+      start_mem(&j.s, buffer,len);
+      return stream_jpeg(&j, req_comp, cb, user);
+   }
+   if (stbi_png_test_memory(buffer,len)) {
+      png p;
+      start_mem(&p.s, buffer,len);
+      return stream_png(&p, req_comp, cb, user);
+   }
+   // everything else is decoded at once
+   data = stbi_load_from_memory(buffer, len, &x, &y, &comp, req_comp);
+   if (data == NULL) return 0;
+   if (req_comp) comp = req_comp;
+   r = cb->begin(user, x, y, comp) && cb->rows(user, 0, y, data);
+   free(data);
+   return r ? 1 : e("stopped","Decoding stopped");
+}
+
 // Microsoft/Windows BMP image
 
 static int bmp_test(stbi *s)
@@ -71,7 +71,7 @@
 // Limitations:
 //    - no progressive/interlaced support (jpeg, png)
 //    - 8-bit samples only (jpeg, png)
-//    - not threadsafe
+//    - the decoders are threadsafe, the setters (gamma, IDCT, ...) are not
 //    - channel subsampling of at most 2 in each dimension (jpeg)
 //    - no delayed line count (jpeg) -- IJG doesn't support either
 //
@@ -111,7 +111,7 @@
 // If image loading fails for any reason, the return value will be NULL,
 // and *x, *y, *comp will be unchanged. The function stbi_failure_reason()
 // can be queried for an extremely brief, end-user unfriendly explanation
-// of why the load failed. Define STBI_NO_FAILURE_STRINGS to avoid
+// of why the load failed on the calling thread. Define STBI_NO_FAILURE_STRINGS to avoid
 // compiling these strings at all, and STBI_FAILURE_USERMSG to get slightly
 // more user-friendly ones.
 //
@@ -172,6 +172,20 @@ enum
 
 typedef unsigned char stbi_uc;
 
+// per-thread state (the failure reason) uses this storage class; define it
+// before including this file for compilers not listed here
+#ifndef STBI_THREAD_LOCAL
+   #if defined(__cplusplus) && __cplusplus >= 201103L
+      #define STBI_THREAD_LOCAL thread_local
+   #elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+      #define STBI_THREAD_LOCAL _Thread_local
+   #elif defined(__GNUC__)
+      #define STBI_THREAD_LOCAL __thread
+   #elif defined(_MSC_VER)
+      #define STBI_THREAD_LOCAL __declspec(thread)
+   #endif
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -197,6 +211,26 @@ extern int      stbi_info_from_file  (FILE *f,                  int *x, int *y,
 extern stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
 // for stbi_load_from_file, file pointer is left pointing immediately after image
 
+// STREAMING API - decodes an image from memory a few rows at a time
+//
+// 'begin' is called once with the size of the image and the number of
+// components of the rows, which is req_comp if it is non-zero. Then 'rows'
+// is called with consecutive batches of 'count' tightly packed rows starting
+// at row 'y', until all rows were delivered. The pixels are only valid during
+// the call. Either callback may return 0 to stop decoding.
+//
+// Non-interlaced PNG and baseline JPEG images with all components in a
+// single scan are decoded with a working set of a few rows, other images
+// are decoded at once and delivered in a single batch. Returns 1 on success, 0 on failure or if a callback
+// stopped decoding; see stbi_failure_reason() for the reason.
+typedef struct
+{
+   int (*begin)(void *user, int x, int y, int comp);
+   int (*rows) (void *user, int y, int count, stbi_uc const *pixels);
+} stbi_row_callbacks;
+
+extern int      stbi_load_rows_from_memory(stbi_uc const *buffer, int len, int req_comp, stbi_row_callbacks const *cb, void *user);
+
 #ifndef STBI_NO_HDR
 #ifndef STBI_NO_STDIO
 extern float *stbi_loadf            (char const *filename,     int *x, int *y, int *comp, int req_comp);
@@ -0,0 +1,504 @@
+#include "batchreader.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#ifdef _WIN32
+#  include <fstream>
+#else
+#  include <fcntl.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+#ifdef __linux__
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#endif
+
+#define UTL_LOGGER resources
+#include <utl/logging.h>
+
+using std::size_t;
+using std::string;
+using std::system_error;
+
+constexpr unsigned BatchReader::DEPTH;
+constexpr size_t BatchReader::FALLBACK_THREADS;
+
+#ifdef __linux__
+/**
+ * @brief The submission and completion queues of an io_uring instance.
+ *
+ * There is no liburing on most systems, so the rings are set up and mapped
+ * with the raw system calls.
+ */
+struct BatchReader::Ring
+{
+	Ring(unsigned depth);
+	~Ring();
+
+	Ring(const Ring&) = delete;
+	Ring &operator=(const Ring&) = delete;
+
+	io_uring_sqe &push();
+	void discard(unsigned count);
+	int enter(unsigned submit, unsigned wait);
+	bool pop(io_uring_cqe &cqe);
+	void release();
+
+	int fd;
+	unsigned entries;
+	void *sq;
+	void *cq;
+	size_t sqSize;
+	size_t cqSize;
+	io_uring_sqe *sqes;
+	size_t sqesSize;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	io_uring_cqe *cqes;
+};
+
+/**
+ * @throws std::system_error If io_uring is not available.
+ */
+BatchReader::Ring::Ring(unsigned depth) :
+	fd(-1),
+	sq(MAP_FAILED),
+	cq(MAP_FAILED),
+	sqes(static_cast<io_uring_sqe*>(MAP_FAILED))
+{
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	fd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+	if (fd < 0)
+		throw system_error(errno, std::generic_category(), "io_uring_setup");
+	entries = params.sq_entries;
+
+	sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	// newer kernels map both rings at once
+	const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single)
+		sqSize = cqSize = std::max(sqSize, cqSize);
+	sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+	sq = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq != MAP_FAILED && !single)
+		cq = mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	else
+		cq = sq;
+	if (cq != MAP_FAILED)
+		sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+		int error = errno;
+		release();
+		throw system_error(error, std::generic_category(), "io_uring mmap");
+	}
+
+	unsigned char *s = static_cast<unsigned char*>(sq);
+	unsigned char *c = static_cast<unsigned char*>(cq);
+	sqTail = reinterpret_cast<unsigned*>(s + params.sq_off.tail);
+	sqMask = reinterpret_cast<unsigned*>(s + params.sq_off.ring_mask);
+	sqArray = reinterpret_cast<unsigned*>(s + params.sq_off.array);
+	cqHead = reinterpret_cast<unsigned*>(c + params.cq_off.head);
+	cqTail = reinterpret_cast<unsigned*>(c + params.cq_off.tail);
+	cqMask = reinterpret_cast<unsigned*>(c + params.cq_off.ring_mask);
+	cqes = reinterpret_cast<io_uring_cqe*>(c + params.cq_off.cqes);
+}
+
+BatchReader::Ring::~Ring()
+{
+	release();
+}
+
+void BatchReader::Ring::release()
+{
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqesSize);
+	if (cq != MAP_FAILED && cq != sq)
+		munmap(cq, cqSize);
+	if (sq != MAP_FAILED)
+		munmap(sq, sqSize);
+	if (fd >= 0)
+		close(fd);
+	sq = cq = MAP_FAILED;
+	sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	fd = -1;
+}
+
+/**
+ * @brief Appends an entry to the submission queue.
+ *
+ * The caller must not queue more entries than fit into the ring.
+ */
+io_uring_sqe &BatchReader::Ring::push()
+{
+	// only this thread writes the tail, the kernel reads it
+	unsigned tail = *sqTail;
+	unsigned index = tail & *sqMask;
+	std::memset(&sqes[index], 0, sizeof(io_uring_sqe));
+	sqArray[index] = index;
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+	return sqes[index];
+}
+
+/**
+ * @brief Removes the last entries appended but not submitted yet.
+ */
+void BatchReader::Ring::discard(unsigned count)
+{
+	__atomic_store_n(sqTail, *sqTail - count, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Submits queued entries and waits for completions.
+ *
+ * @return The number of entries submitted, or -1 with errno set.
+ */
+int BatchReader::Ring::enter(unsigned submit, unsigned wait)
+{
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, wait,
+			wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+}
+
+bool BatchReader::Ring::pop(io_uring_cqe &cqe)
+{
+	unsigned head = *cqHead;
+	if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+		return false;
+	cqe = cqes[head & *cqMask];
+	__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+#else
+struct BatchReader::Ring
+{
+};
+#endif
+
+#ifndef _WIN32
+static int openFile(const string &path, size_t &size)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw system_error(errno, std::generic_category(), path);
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int error = errno;
+		::close(fd);
+		throw system_error(error, std::generic_category(), path);
+	}
+	size = st.st_size;
+	return fd;
+}
+
+/**
+ * @brief Reads the rest of a file with pread.
+ *
+ * @return The number of bytes read in total, less than size if the file
+ *         shrank in the meantime.
+ */
+static size_t readRest(int fd, unsigned char *buffer, size_t done, size_t size, const string &path)
+{
+	while (done < size) {
+		ssize_t n = pread(fd, buffer + done, size - done, done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			throw system_error(errno, std::generic_category(), path);
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+#endif
+
+static std::shared_ptr<unsigned char> allocate(size_t size)
+{
+	return std::shared_ptr<unsigned char>(new unsigned char[size], std::default_delete<unsigned char[]>());
+}
+
+/**
+ * @brief Reads a whole file on the calling thread.
+ *
+ * Unlike a mapping, the buffer stays valid if the file is truncated while it
+ * is read, the content is cut short instead.
+ *
+ * @throws std::system_error If the file could not be read.
+ */
+ResourceView BatchReader::readFile(const string &path)
+{
+#ifdef _WIN32
+	std::ifstream f(path, std::ios::binary | std::ios::ate);
+	if (!f.good())
+		throw system_error(ENOENT, std::generic_category(), path);
+	size_t size = static_cast<size_t>(f.tellg());
+	std::shared_ptr<unsigned char> buffer = allocate(size);
+	f.seekg(0);
+	f.read(reinterpret_cast<char*>(buffer.get()), size);
+	if (!f.good())
+		throw system_error(EIO, std::generic_category(), path);
+#else
+	size_t size;
+	int fd = openFile(path, size);
+	std::shared_ptr<unsigned char> buffer = allocate(size);
+	try {
+		size = readRest(fd, buffer.get(), 0, size, path);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+#endif
+	return ResourceView(buffer, buffer.get(), size);
+}
+
+/**
+ * @brief Sets up io_uring, or the fallback threads if it is not available.
+ */
+BatchReader::BatchReader() :
+	mStop(false)
+{
+#ifdef __linux__
+	try {
+		mRing.reset(new Ring(DEPTH));
+		mThread = std::thread(&BatchReader::run, this);
+		return;
+	} catch (system_error &e) {
+		utl::info("io_uring not available (%s), reading with %zu threads", e.what(), FALLBACK_THREADS);
+	}
+#endif
+	mPool.reset(new ThreadPool(FALLBACK_THREADS));
+}
+
+/**
+ * @brief Finishes all pending reads.
+ */
+BatchReader::~BatchReader()
+{
+	if (mThread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mStop = true;
+		}
+		mCondition.notify_all();
+		mThread.join();
+	}
+}
+
+/**
+ * @brief Starts reading files into memory.
+ *
+ * Each file is read into a buffer of its size, allocated before reading. May
+ * be called from any thread.
+ *
+ * @param paths The paths of the files.
+ * @return A future per file, holding its content or the std::system_error
+ *         thrown if it could not be read.
+ */
+std::vector<std::shared_future<ResourceView>> BatchReader::read(const std::vector<string> &paths)
+{
+	std::vector<std::shared_future<ResourceView>> results;
+	results.reserve(paths.size());
+	if (mPool) {
+		for (const string &path : paths)
+			results.push_back(mPool->submit([path](){ return readFile(path); }).share());
+		return results;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		for (const string &path : paths) {
+			Request request;
+			request.path = path;
+			results.push_back(request.result.get_future().share());
+			mRequests.push_back(std::move(request));
+		}
+	}
+	mCondition.notify_one();
+	return results;
+}
+
+void BatchReader::run()
+{
+	for (;;) {
+		std::deque<Request> requests;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mCondition.wait(lock, [this](){ return mStop || !mRequests.empty(); });
+			if (mRequests.empty())
+				return;
+			requests.swap(mRequests);
+		}
+		readAll(requests);
+	}
+}
+
+/**
+ * @brief Reads the requested files with up to DEPTH reads in flight.
+ *
+ * Files are opened right before their first read is queued, so no more than
+ * DEPTH files are open at once. Reads returning less than requested are
+ * queued again for the rest. If the ring fails, it is closed and the files
+ * are read on this thread from then on.
+ */
+void BatchReader::readAll(std::deque<Request> &requests)
+{
+#ifdef __linux__
+	if (mRing->fd < 0) {
+		for (Request &request : requests) {
+			try {
+				request.result.set_value(readFile(request.path));
+			} catch (system_error&) {
+				request.result.set_exception(std::current_exception());
+			}
+		}
+		return;
+	}
+
+	struct File {
+		int fd;
+		std::shared_ptr<unsigned char> buffer;
+		size_t size;
+		size_t done;
+		bool inFlight; // the kernel may write into the buffer
+	};
+	std::vector<File> files(requests.size(), File{-1, nullptr, 0, 0, false});
+
+	auto complete = [&](size_t i) {
+		::close(files[i].fd);
+		requests[i].result.set_value(ResourceView(files[i].buffer, files[i].buffer.get(), files[i].done));
+		files[i].buffer.reset();
+	};
+	auto fail = [&](size_t i, int error) {
+		if (files[i].fd >= 0)
+			::close(files[i].fd);
+		requests[i].result.set_exception(std::make_exception_ptr(
+				system_error(error, std::generic_category(), requests[i].path)));
+		files[i].buffer.reset();
+	};
+
+	size_t next = 0;
+	std::vector<size_t> resubmit;
+	// in the order they were queued
+	std::vector<size_t> unsubmitted;
+	unsigned queued = 0, inFlight = 0;
+	while (next < requests.size() || !resubmit.empty() || queued + inFlight > 0) {
+		while (queued + inFlight < mRing->entries && (!resubmit.empty() || next < requests.size())) {
+			size_t i;
+			if (!resubmit.empty()) {
+				i = resubmit.back();
+				resubmit.pop_back();
+			} else {
+				i = next++;
+				try {
+					files[i].fd = openFile(requests[i].path, files[i].size);
+					files[i].buffer = allocate(files[i].size);
+				} catch (system_error &e) {
+					fail(i, e.code().value());
+					continue;
+				}
+				if (files[i].size == 0) {
+					complete(i);
+					continue;
+				}
+			}
+			io_uring_sqe &sqe = mRing->push();
+			sqe.opcode = IORING_OP_READ;
+			sqe.fd = files[i].fd;
+			sqe.addr = reinterpret_cast<std::uintptr_t>(files[i].buffer.get() + files[i].done);
+			sqe.len = static_cast<unsigned>(std::min<size_t>(files[i].size - files[i].done, 1u << 30));
+			sqe.off = files[i].done;
+			sqe.user_data = i;
+			files[i].inFlight = true;
+			unsubmitted.push_back(i);
+			++queued;
+		}
+		if (queued + inFlight == 0)
+			continue;
+
+		int submitted = mRing->enter(queued, 1);
+		if (submitted < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			// the ring is unusable, the reads in flight have to end before their buffers are freed
+			int error = errno;
+			mRing->discard(queued);
+			for (size_t i : unsubmitted)
+				files[i].inFlight = false;
+			io_uring_cqe cqe;
+			while (inFlight > 0) {
+				if (mRing->pop(cqe)) {
+					files[static_cast<size_t>(cqe.user_data)].inFlight = false;
+					--inFlight;
+				} else if (mRing->enter(0, 1) < 0 && errno != EINTR) {
+					break;
+				}
+			}
+			// closing the ring cancels the reads still in flight, their buffers are kept
+			for (File &file : files) {
+				if (file.inFlight)
+					mAbandoned.push_back(file.buffer);
+			}
+			mRing->release();
+			utl::warning("io_uring failed (%s), reading on one thread", std::strerror(error));
+			for (size_t i = 0; i < next; ++i) {
+				if (files[i].buffer)
+					fail(i, error);
+			}
+			for (size_t i = next; i < requests.size(); ++i)
+				fail(i, error);
+			return;
+		}
+		queued -= submitted;
+		inFlight += submitted;
+		unsubmitted.erase(unsubmitted.begin(), unsubmitted.begin() + submitted);
+
+		io_uring_cqe cqe;
+		while (mRing->pop(cqe)) {
+			--inFlight;
+			size_t i = static_cast<size_t>(cqe.user_data);
+			File &file = files[i];
+			file.inFlight = false;
+			if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+				resubmit.push_back(i);
+			} else if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+				// kernels before 5.6 do not know IORING_OP_READ
+				try {
+					file.done = readRest(file.fd, file.buffer.get(), file.done, file.size, requests[i].path);
+					complete(i);
+				} catch (system_error &e) {
+					fail(i, e.code().value());
+				}
+			} else if (cqe.res < 0) {
+				fail(i, -cqe.res);
+			} else {
+				file.done += cqe.res;
+				// a file shrinking while it is read ends early
+				if (cqe.res == 0 || file.done == file.size)
+					complete(i);
+				else
+					resubmit.push_back(i);
+			}
+		}
+	}
+#else
+	(void) requests;
+#endif
+}
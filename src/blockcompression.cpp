@@ -0,0 +1,238 @@
+#include "blockcompression.h"
+
+#include <cstdint>
+#include <cstring>
+
+using std::size_t;
+using std::uint32_t;
+
+// a match is at least this long
+static const size_t MIN_MATCH = 4;
+// the last bytes of a block are always literals
+static const size_t LAST_LITERALS = 5;
+// no match starts within this distance to the end of a block
+static const size_t MATCH_LIMIT = 12;
+static const size_t MAX_OFFSET = 65535;
+static const int HASH_BITS = 14;
+
+
+static uint32_t read32(const unsigned char *p)
+{
+	uint32_t value;
+	std::memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static uint32_t hash4(uint32_t sequence)
+{
+	return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/**
+ * @brief Counts the equal bytes at two positions, eight at a time.
+ */
+static size_t countMatch(const unsigned char *src, size_t pos, size_t ref, size_t end)
+{
+	size_t length = MIN_MATCH;
+	while (pos + length + 8 <= end) {
+		std::uint64_t a, b;
+		std::memcpy(&a, src + pos + length, 8);
+		std::memcpy(&b, src + ref + length, 8);
+		if (a != b) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return length + (__builtin_ctzll(a ^ b) >> 3);
+#else
+			break;
+#endif
+		}
+		length += 8;
+	}
+	while (pos + length < end && src[pos + length] == src[ref + length])
+		++length;
+	return length;
+}
+
+/**
+ * @brief Writes a length exceeding the 4 bits of the token, 255 per byte.
+ */
+static bool writeLength(unsigned char *&op, const unsigned char *end, size_t length)
+{
+	for (; length >= 255; length -= 255) {
+		if (op == end)
+			return false;
+		*op++ = 255;
+	}
+	if (op == end)
+		return false;
+	*op++ = static_cast<unsigned char>(length);
+	return true;
+}
+
+/**
+ * @brief Writes literals followed by a match, or only literals at the end.
+ */
+static bool writeSequence(unsigned char *&op, const unsigned char *end,
+			const unsigned char *literals, size_t literalLength, size_t offset, size_t matchLength)
+{
+	if (op == end)
+		return false;
+	unsigned char &token = *op++;
+	token = static_cast<unsigned char>((literalLength < 15 ? literalLength : 15) << 4);
+	if (literalLength >= 15 && !writeLength(op, end, literalLength - 15))
+		return false;
+	if (literalLength > static_cast<size_t>(end - op))
+		return false;
+	std::memcpy(op, literals, literalLength);
+	op += literalLength;
+	if (matchLength == 0)
+		return true;
+
+	if (end - op < 2)
+		return false;
+	*op++ = static_cast<unsigned char>(offset);
+	*op++ = static_cast<unsigned char>(offset >> 8);
+	matchLength -= MIN_MATCH;
+	token |= static_cast<unsigned char>(matchLength < 15 ? matchLength : 15);
+	return matchLength < 15 || writeLength(op, end, matchLength - 15);
+}
+
+/**
+ * @brief Compresses a block in the LZ4 block format.
+ *
+ * Matches are found greedily with a hash table of the last position of each
+ * four byte sequence, like the fast mode of LZ4. The block must not be larger
+ * than 64 KiB, so all offsets can be encoded.
+ *
+ * @param capacity The size of dst.
+ * @return The compressed size, or 0 if it would exceed the capacity.
+ */
+size_t compressBlock(const unsigned char *src, size_t size, unsigned char *dst, size_t capacity)
+{
+	unsigned char *op = dst;
+	const unsigned char *end = dst + capacity;
+	size_t anchor = 0;
+
+	if (size > MATCH_LIMIT) {
+		// positions plus one, zero is empty
+		uint32_t table[1 << HASH_BITS] = {};
+		const size_t matchEnd = size - LAST_LITERALS;
+		size_t pos = 0;
+		while (pos < size - MATCH_LIMIT) {
+			const uint32_t sequence = read32(src + pos);
+			const uint32_t h = hash4(sequence);
+			size_t ref = table[h];
+			table[h] = static_cast<uint32_t>(pos + 1);
+			if (ref == 0 || pos - (ref - 1) > MAX_OFFSET || read32(src + ref - 1) != sequence) {
+				// skip faster through data which does not compress
+				pos += 1 + ((pos - anchor) >> 6);
+				continue;
+			}
+			--ref;
+
+			while (pos > anchor && ref > 0 && src[pos - 1] == src[ref - 1]) {
+				--pos;
+				--ref;
+			}
+			size_t length = countMatch(src, pos, ref, matchEnd);
+
+			if (!writeSequence(op, end, src + anchor, pos - anchor, pos - ref, length))
+				return 0;
+			pos += length;
+			anchor = pos;
+		}
+	}
+
+	if (!writeSequence(op, end, src + anchor, size - anchor, 0, 0))
+		return 0;
+	return op - dst;
+}
+
+/**
+ * @brief Reads a length exceeding the 4 bits of the token.
+ */
+static bool readLength(const unsigned char *&ip, const unsigned char *end, size_t &length)
+{
+	unsigned char byte;
+	do {
+		if (ip == end)
+			return false;
+		byte = *ip++;
+		length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+/**
+ * @brief Decompresses a block compressed by compressBlock.
+ *
+ * Never reads or writes outside of the buffers, even if the data is corrupt.
+ *
+ * @param dstSize The size of the block before compression.
+ * @return <code>false</code> if the data is corrupt or does not decompress
+ *         to exactly dstSize bytes.
+ */
+bool decompressBlock(const unsigned char *src, size_t size, unsigned char *dst, size_t dstSize)
+{
+	const unsigned char *ip = src;
+	const unsigned char *inEnd = src + size;
+	unsigned char *op = dst;
+	unsigned char *outEnd = dst + dstSize;
+
+	for (;;) {
+		if (ip == inEnd)
+			return false;
+		const unsigned char token = *ip++;
+
+		size_t literalLength = token >> 4;
+		if (literalLength == 15 && !readLength(ip, inEnd, literalLength))
+			return false;
+		if (literalLength > static_cast<size_t>(inEnd - ip) || literalLength > static_cast<size_t>(outEnd - op))
+			return false;
+		if (literalLength <= 16 && inEnd - ip >= 16 && outEnd - op >= 16) {
+			// copying a fixed size is much faster, the excess is overwritten later
+			std::memcpy(op, ip, 16);
+		} else {
+			std::memcpy(op, ip, literalLength);
+		}
+		ip += literalLength;
+		op += literalLength;
+		// the last sequence has no match
+		if (ip == inEnd)
+			return op == outEnd;
+
+		if (inEnd - ip < 2)
+			return false;
+		const size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > static_cast<size_t>(op - dst))
+			return false;
+
+		size_t matchLength = token & 15;
+		if (matchLength == 15 && !readLength(ip, inEnd, matchLength))
+			return false;
+		matchLength += MIN_MATCH;
+		if (matchLength > static_cast<size_t>(outEnd - op))
+			return false;
+
+		const unsigned char *match = op - offset;
+		if (offset >= 16 && static_cast<size_t>(outEnd - op) >= matchLength + 16) {
+			for (size_t i = 0; i < matchLength; i += 16)
+				std::memcpy(op + i, match + i, 16);
+			op += matchLength;
+			continue;
+		}
+		if (offset >= matchLength) {
+			std::memcpy(op, match, matchLength);
+			op += matchLength;
+			continue;
+		}
+		if (offset >= 8) {
+			// chunks of eight bytes never overlap the bytes they read
+			for (; matchLength >= 8; matchLength -= 8, op += 8, match += 8)
+				std::memcpy(op, match, 8);
+		}
+		// shorter offsets repeat the bytes being written
+		while (matchLength-- > 0)
+			*op++ = *match++;
+	}
+}
@@ -7,7 +7,6 @@
 #include <string>
 
 #include <GL/glew.h>
-#include <GLFW/glfw3.h>
 
 #ifdef __GNUG__
 #include <cxxabi.h>
@@ -39,9 +38,27 @@ bool GLTools::isExtensionMissing()
 	return existMissingExtensions;
 }
 
+/**
+ * @brief Asks the current context for an extension.
+ *
+ * Unlike glfwExtensionSupported, this works with contexts not created by
+ * GLFW as well.
+ */
+static bool isSupported(const char *name)
+{
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; ++i) {
+		const GLubyte *extension = glGetStringi(GL_EXTENSIONS, i);
+		if (extension != nullptr && std::strcmp(reinterpret_cast<const char*>(extension), name) == 0)
+			return true;
+	}
+	return false;
+}
+
 void GLTools::checkExtension(const char *name, bool required)
 {
-	bool supported = (glfwExtensionSupported(name) == GL_TRUE);
+	bool supported = isSupported(name);
 
 	const char *s;
 	if (supported) {
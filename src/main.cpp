@@ -1,4 +1,6 @@
 #include <cstdlib>
+#include <memory>
+#include <string>
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -17,6 +19,7 @@
 #include "config.h"
 #include "defines.h"
 #include "gltools.h"
+#include "profiler.h"
 #include "resourceloader.h"
 #include "utils.h"
 
@@ -77,6 +80,11 @@ int main(int argc, char *argv[])
 	GLTools::checkExtension(GLTools::GL_ARB_DEBUG_OUTPUT, false);
 	GLTools::checkExtension("GL_ARB_direct_state_access", true);
 	GLTools::checkExtension("GL_ARB_separate_shader_objects", true);
+	GLTools::checkExtension("GL_ARB_get_program_binary", false);
+	GLTools::checkExtension("GL_ARB_buffer_storage", false);
+	GLTools::checkExtension("GL_EXT_texture_compression_s3tc", false);
+	GLTools::checkExtension("GL_KHR_parallel_shader_compile", false);
+	GLTools::checkExtension("GL_ARB_parallel_shader_compile", false);
 
 	if (GLTools::isExtensionMissing()) {
 		utl::severe("Required OpenGL extensions are missing.");
@@ -84,137 +92,198 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 	GLTools::registerErrorHandler();
+	if (GLTools::isAvailable("GL_KHR_parallel_shader_compile"))
+		glMaxShaderCompilerThreadsKHR(0xFFFFFFFF); // let the driver decide
+	else if (GLTools::isAvailable("GL_ARB_parallel_shader_compile"))
+		glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
 
-	utl::info("Load and initialize resources ...");
-	// create resource loader
-	ResourceLoader resources(RESOURCE_DIR);
-
-	// initialize shaders
-	gtl::ogl::Program program = resources.loadShaderProgram("shader/example.prog");
-
-	// load textures
-	gtl::ogl::Texture texture = resources.loadTexture("texture/test_rect.png");
-
-	// initialize vertex buffer object
-	GLuint vbo;
-	glGenBuffers(1, &vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-
-	// initialize vertex array object
-	GLuint vao;
-	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
-
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glEnableVertexAttribArray(POS_ATTRIB);
-	glVertexAttribPointer(POS_ATTRIB, 3, GL_FLOAT, GL_FALSE,
-				8 * sizeof(GLfloat), 0);
-	glEnableVertexAttribArray(COLOR_ATTRIB);
-	glVertexAttribPointer(COLOR_ATTRIB, 3, GL_FLOAT, GL_FALSE,
-				8 * sizeof(GLfloat), reinterpret_cast<void*>(3 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(TEXCORD_ATTRIB);
-	glVertexAttribPointer(TEXCORD_ATTRIB, 2, GL_FLOAT, GL_FALSE,
-				8 * sizeof(GLfloat), reinterpret_cast<void*>(6 * sizeof(GLfloat)));
-
-	// get uniform locations
-	GLint modelUniLoc = program.getUniformLocation("model");
-	GLint viewUniLoc = program.getUniformLocation("view");
-
-	// transformations
-	glm::mat4 model;
-	glm::mat4 view;
-
-	// time of last update
-	double lastUpdate = glfwGetTime();
-	// cursor position at the last update
-	double cursorX, cursorY;
-	glfwGetCursorPos(window, &cursorX, &cursorY);
-
-	// set projection matrix
-	float aspect = static_cast<float>(WINDOW_WIDTH) / WINDOW_HEIGHT;
-	glm::mat4 proj = glm::perspective(0.8f, aspect, 0.1f, 1000.0f);
-	program.setUniform(program.getUniformLocation("proj"), proj);
-
-	// set bindings for samplers
-	program.setUniform(program.getUniformLocation("tex"), 1);
-
-	utl::info("Setup complete.");
-	// repeat this loop until the user closes the window
-	while (!glfwWindowShouldClose(window))
+	// everything using the OpenGL context is destroyed before the context
 	{
-		// clear the color buffer
-		glClear(GL_COLOR_BUFFER_BIT);
-
-		// render something with OpenGL
-		program.use(); // select shaders
-		texture.bind(1);
+		utl::info("Load and initialize resources ...");
+		// create resource loader (the resources may be given as directory or archive)
+		ResourceLoader resources(argc > 1 ? argv[1] : RESOURCE_DIR);
+		resources.setTextureCacheBudget(TEXTURE_CACHE_BUDGET);
+		resources.setProgramCacheBudget(PROGRAM_CACHE_BUDGET);
+		resources.setTextureStreamingThreshold(TEXTURE_STREAMING_THRESHOLD);
+		resources.enableUploadRing(UPLOAD_RING_SIZE, UPLOAD_RING_SLOTS);
+		resources.enableTextureDedup();
+		resources.setProgramBinaryCache(CACHE_DIR);
+		resources.setCookedTextures(COOKED_DIR);
+		resources.startAccessTrace(std::string(CACHE_DIR) + "/" + ACCESS_TRACE);
+	#ifndef NDEBUG
+		resources.enableHotReload();
+	#endif
+
+		// start reading the resources needed at startup all at once
+		resources.prefetch({"shader/example.prog", "texture/test_rect.png"});
+
+		// initialize shaders (shared with the cache, so they can be reloaded)
+		std::shared_ptr<const gtl::ogl::Program> program = resources.getShaderProgram("shader/example.prog");
+
+		// load textures
+		std::shared_ptr<const gtl::ogl::Texture> texture = resources.getTexture("texture/test_rect.png");
+
+		// initialize vertex buffer object
+		GLuint vbo;
+		glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+
+		// initialize vertex array object
+		GLuint vao;
+		glGenVertexArrays(1, &vao);
 		glBindVertexArray(vao);
-		glUniformMatrix4fv(modelUniLoc, 1, GL_FALSE, glm::value_ptr(model));
-		glUniformMatrix4fv(viewUniLoc, 1, GL_FALSE, glm::value_ptr(view));
-		glDrawArrays(GL_TRIANGLES, 0, 3);
-
-		// poll events (I do it before swapping buffers to get more fps)
-		glfwPollEvents();
-
-		// compute delta time `dt` (time elapsed since last frame)
-		double dt = lastUpdate;
-		lastUpdate = glfwGetTime();
-		dt = lastUpdate - dt;
-
-		// rotate triangle
-		glm::vec3 up = glm::vec3(0.0f, 0.1f, 0.0f);
-		model = glm::rotate(model, static_cast<float>(dt), up);
-
-		// move cam
-		// --- update cam position
-		glm::vec3 movement(0.0f, 0.0f, 0.0f);
-		if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
-			movement.z -= 1.0f;
-		}
-		if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) {
-			movement.z += 1.0f;
-		}
-		if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) {
-			movement.x -= 1.0f;
-		}
-		if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) {
-			movement.x += 1.0f;
-		}
-		if (glfwGetKey(window, GLFW_KEY_LEFT_CONTROL) == GLFW_PRESS) {
-			movement.y -= 1.0f;
-		}
-		if (glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS) {
-			movement.y += 1.0f;
-		}
-		if (glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS) {
-			movement *= 2;
-		}
-		view = glm::translate(glm::mat4(), - movement * static_cast<float>(dt)) * view;
-		// --- update cam rotation
-		glm::vec3 rotation(0.0f, 0.0f, 0.0f);
-		if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_1) == GLFW_PRESS
-				|| glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_2) == GLFW_PRESS) {
-			double newX, newY;
-			glfwGetCursorPos(window, &newX, &newY);
-			glfwSetCursorPos(window, cursorX, cursorY);
-			rotation.x = -0.001 * ( newY - cursorY ); // rotation about x axis
-			rotation.y = -0.001 * ( newX - cursorX ); // rotation about y axis
-		} else {
-			glfwGetCursorPos(window, &cursorX, &cursorY);
+
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glEnableVertexAttribArray(POS_ATTRIB);
+		glVertexAttribPointer(POS_ATTRIB, 3, GL_FLOAT, GL_FALSE,
+					8 * sizeof(GLfloat), 0);
+		glEnableVertexAttribArray(COLOR_ATTRIB);
+		glVertexAttribPointer(COLOR_ATTRIB, 3, GL_FLOAT, GL_FALSE,
+					8 * sizeof(GLfloat), reinterpret_cast<void*>(3 * sizeof(GLfloat)));
+		glEnableVertexAttribArray(TEXCORD_ATTRIB);
+		glVertexAttribPointer(TEXCORD_ATTRIB, 2, GL_FLOAT, GL_FALSE,
+					8 * sizeof(GLfloat), reinterpret_cast<void*>(6 * sizeof(GLfloat)));
+
+		// transformations
+		glm::mat4 model;
+		glm::mat4 view;
+
+		// time of last update
+		double lastUpdate = glfwGetTime();
+		// cursor position at the last update
+		double cursorX, cursorY;
+		glfwGetCursorPos(window, &cursorX, &cursorY);
+
+		// projection matrix
+		float aspect = static_cast<float>(WINDOW_WIDTH) / WINDOW_HEIGHT;
+		glm::mat4 proj = glm::perspective(0.8f, aspect, 0.1f, 1000.0f);
+
+		// measure where the frame time goes
+		Profiler profiler;
+		double lastTitleUpdate = lastUpdate;
+
+		resources.finishAccessTrace();
+		utl::info("Setup complete.");
+		// repeat this loop until the user closes the window
+		while (!glfwWindowShouldClose(window))
+		{
+			profiler.beginFrame();
+
+			// clear the color buffer
+			{
+				Profiler::Zone zone(profiler, "clear");
+				glClear(GL_COLOR_BUFFER_BIT);
+			}
+
+			// render something with OpenGL
+			{
+				Profiler::Zone zone(profiler, "draw");
+				program->use(); // select shaders
+				texture->bind(1);
+				glBindVertexArray(vao);
+				// set all uniforms every frame, a reloaded program starts without them
+				glUniformMatrix4fv(program->getUniformLocation("model"), 1, GL_FALSE, glm::value_ptr(model));
+				glUniformMatrix4fv(program->getUniformLocation("view"), 1, GL_FALSE, glm::value_ptr(view));
+				glUniformMatrix4fv(program->getUniformLocation("proj"), 1, GL_FALSE, glm::value_ptr(proj));
+				glUniform1i(program->getUniformLocation("tex"), 1); // binding of the sampler
+				glDrawArrays(GL_TRIANGLES, 0, 3);
+			}
+
+			// poll events (I do it before swapping buffers to get more fps)
+			{
+				Profiler::Zone zone(profiler, "poll events");
+				glfwPollEvents();
+			}
+
+			{
+				Profiler::Zone zone(profiler, "resources");
+				// upload textures which have been loaded in background
+				resources.processUploads(RESOURCE_UPLOAD_BUDGET);
+				// replace resources which have been modified
+				resources.reloadChanged();
+			}
+
+			// compute delta time `dt` (time elapsed since last frame)
+			double dt = lastUpdate;
+			lastUpdate = glfwGetTime();
+			dt = lastUpdate - dt;
+
+			// rotate triangle
+			glm::vec3 up = glm::vec3(0.0f, 0.1f, 0.0f);
+			model = glm::rotate(model, static_cast<float>(dt), up);
+
+			// move cam
+			// --- update cam position
+			glm::vec3 movement(0.0f, 0.0f, 0.0f);
+			if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
+				movement.z -= 1.0f;
+			}
+			if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) {
+				movement.z += 1.0f;
+			}
+			if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) {
+				movement.x -= 1.0f;
+			}
+			if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) {
+				movement.x += 1.0f;
+			}
+			if (glfwGetKey(window, GLFW_KEY_LEFT_CONTROL) == GLFW_PRESS) {
+				movement.y -= 1.0f;
+			}
+			if (glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS) {
+				movement.y += 1.0f;
+			}
+			if (glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS) {
+				movement *= 2;
+			}
+			view = glm::translate(glm::mat4(), - movement * static_cast<float>(dt)) * view;
+			// --- update cam rotation
+			glm::vec3 rotation(0.0f, 0.0f, 0.0f);
+			if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_1) == GLFW_PRESS
+					|| glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_2) == GLFW_PRESS) {
+				double newX, newY;
+				glfwGetCursorPos(window, &newX, &newY);
+				glfwSetCursorPos(window, cursorX, cursorY);
+				rotation.x = -0.001 * ( newY - cursorY ); // rotation about x axis
+				rotation.y = -0.001 * ( newX - cursorX ); // rotation about y axis
+			} else {
+				glfwGetCursorPos(window, &cursorX, &cursorY);
+			}
+			view = glm::rotate(glm::mat4(), - rotation.x, glm::vec3(1.0f, 0.0f, 0.0f)) * view;
+			view = glm::rotate(glm::mat4(), - rotation.y, glm::vec3(0.0f, 1.0f, 0.0f)) * view;
+			//view = glm::rotate(glm::mat4(), - rotation.y, glm::vec3(0.0f, 0.0f, 1.0f)) * view;
+
+			// show the frame times in the title once per second
+			if (lastUpdate - lastTitleUpdate >= 1.0) {
+				lastTitleUpdate = lastUpdate;
+				std::string title = WINDOW_TITLE " - " + profiler.getSummary();
+				glfwSetWindowTitle(window, title.c_str());
+			}
+
+			// swap front and back buffers
+			{
+				Profiler::Zone zone(profiler, "swap");
+				glfwSwapBuffers(window);
+			}
+
+			profiler.endFrame();
 		}
-		view = glm::rotate(glm::mat4(), - rotation.x, glm::vec3(1.0f, 0.0f, 0.0f)) * view;
-		view = glm::rotate(glm::mat4(), - rotation.y, glm::vec3(0.0f, 1.0f, 0.0f)) * view;
-		//view = glm::rotate(glm::mat4(), - rotation.y, glm::vec3(0.0f, 0.0f, 1.0f)) * view;
 
-		// swap front and back buffers
-		glfwSwapBuffers(window);
-	}
+		if (profiler.writeReport(PROFILE_REPORT))
+			utl::info("Frame times written to %s", PROFILE_REPORT);
+		else
+			utl::warning("Could not write %s", PROFILE_REPORT);
+
+		DedupStats dedup = resources.getTextureDedupStats();
+		utl::info("%zu of %zu textures shared by content, saving %.1f MiB", dedup.hits,
+				dedup.hits + dedup.misses, dedup.savedSize / 1048576.0);
 
-	utl::info("Clean up resources ...");
-	// free resources from OpenGL
-	glDeleteVertexArrays(1, &vao);
-	glDeleteBuffers(1, &vbo);
+		utl::info("Clean up resources ...");
+		// free resources from OpenGL
+		glDeleteVertexArrays(1, &vao);
+		glDeleteBuffers(1, &vbo);
+	}
 	// exit program
 	glfwTerminate();
 	return EXIT_SUCCESS;
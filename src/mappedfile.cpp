@@ -0,0 +1,80 @@
+#include "mappedfile.h"
+
+#include <cerrno>
+#include <string>
+#include <system_error>
+
+#ifdef _WIN32
+#  include <fstream>
+#  include <iterator>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+using std::string;
+using std::system_error;
+
+
+/**
+ * @brief Maps a file read-only into memory.
+ *
+ * On POSIX systems the content is not copied, pages are read on demand from
+ * the page cache. On other systems the file is read into a buffer.
+ *
+ * @param path The path of the file.
+ * @throws std::system_error If the file could not be opened or mapped.
+ */
+MappedFile::MappedFile(const string &path) :
+	mData(nullptr),
+	mSize(0)
+{
+#ifdef _WIN32
+	std::ifstream f(path, std::ios::binary);
+	if (!f.good())
+		throw system_error(ENOENT, std::generic_category(), path);
+	mBuffer.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	mData = mBuffer.data();
+	mSize = mBuffer.size();
+#else
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw system_error(errno, std::generic_category(), path);
+
+	struct stat st;
+	int error = 0;
+	if (fstat(fd, &st) != 0)
+		error = errno;
+	else if (!S_ISREG(st.st_mode))
+		error = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+	if (error) {
+		::close(fd);
+		throw system_error(error, std::generic_category(), path);
+	}
+
+	mSize = static_cast<std::size_t>(st.st_size);
+	if (mSize > 0) {
+		void *addr = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr == MAP_FAILED) {
+			error = errno;
+			::close(fd);
+			throw system_error(error, std::generic_category(), path);
+		}
+		// decoders read resources front to back
+		madvise(addr, mSize, MADV_SEQUENTIAL);
+		mData = static_cast<const unsigned char*>(addr);
+	}
+	// the mapping stays valid after closing the descriptor
+	::close(fd);
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+	if (mData != nullptr)
+		munmap(const_cast<unsigned char*>(mData), mSize);
+#endif
+}
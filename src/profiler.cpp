@@ -0,0 +1,222 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+
+using std::size_t;
+using std::string;
+
+
+constexpr size_t Profiler::HISTORY;
+
+/**
+ * @brief Creates a profiler.
+ *
+ * @param gpu Whether to measure GPU times. Requires a current OpenGL context
+ *        during the whole lifetime of the profiler.
+ */
+Profiler::Profiler(bool gpu) :
+	mGpu(gpu),
+	mFrame(0),
+	mFrameZone(0)
+{
+}
+
+Profiler::~Profiler()
+{
+	if (mGpu) {
+		for (ZoneData &zone : mZones)
+			glDeleteQueries(4, &zone.queries[0][0]);
+	}
+}
+
+/**
+ * @brief Starts a new frame, which is measured as zone "frame".
+ */
+void Profiler::beginFrame()
+{
+	++mFrame;
+	mFrameZone = begin("frame");
+}
+
+void Profiler::endFrame()
+{
+	end(mFrameZone);
+}
+
+/**
+ * @brief Enters a zone.
+ *
+ * Prefer Profiler::Zone over calling this function directly.
+ *
+ * @param name The name of the zone.
+ * @return The index of the zone to pass to Profiler::end.
+ */
+size_t Profiler::begin(const char *name)
+{
+	size_t index = 0;
+	while (index < mZones.size() && mZones[index].name != name)
+		++index;
+
+	if (index == mZones.size()) {
+		mZones.emplace_back();
+		ZoneData &zone = mZones.back();
+		zone.name = name;
+		zone.pending[0] = zone.pending[1] = false;
+		if (mGpu)
+			glGenQueries(4, &zone.queries[0][0]);
+	}
+
+	ZoneData &zone = mZones[index];
+	if (mGpu) {
+		size_t slot = mFrame % 2;
+		collect(zone, slot);
+		glQueryCounter(zone.queries[slot][0], GL_TIMESTAMP);
+	}
+	zone.start = Clock::now();
+	return index;
+}
+
+/**
+ * @brief Leaves a zone.
+ *
+ * @param index The index returned by Profiler::begin.
+ */
+void Profiler::end(size_t index)
+{
+	ZoneData &zone = mZones[index];
+	zone.cpu.add(std::chrono::duration<float,std::milli>(Clock::now() - zone.start).count());
+	if (mGpu) {
+		size_t slot = mFrame % 2;
+		glQueryCounter(zone.queries[slot][1], GL_TIMESTAMP);
+		zone.pending[slot] = true;
+	}
+}
+
+/**
+ * @brief Reads the GPU time of a zone measured two frames ago, if available.
+ */
+void Profiler::collect(ZoneData &zone, size_t slot)
+{
+	if (!zone.pending[slot])
+		return;
+	zone.pending[slot] = false;
+
+	GLint available = GL_FALSE;
+	glGetQueryObjectiv(zone.queries[slot][1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available)
+		return; // drop the sample instead of stalling
+
+	GLuint64 start, end;
+	glGetQueryObjectui64v(zone.queries[slot][0], GL_QUERY_RESULT, &start);
+	glGetQueryObjectui64v(zone.queries[slot][1], GL_QUERY_RESULT, &end);
+	zone.gpu.add(static_cast<float>(end - start) / 1e6f);
+}
+
+const Profiler::ZoneData *Profiler::find(const string &name) const
+{
+	for (const ZoneData &zone : mZones) {
+		if (zone.name == name)
+			return &zone;
+	}
+	return nullptr;
+}
+
+/**
+ * @brief Gets percentiles of the CPU time of a zone in milliseconds.
+ */
+Profiler::Percentiles Profiler::getCpuTimes(const string &name) const
+{
+	const ZoneData *zone = find(name);
+	return zone ? zone->cpu.getPercentiles() : Samples().getPercentiles();
+}
+
+/**
+ * @brief Gets percentiles of the GPU time of a zone in milliseconds.
+ */
+Profiler::Percentiles Profiler::getGpuTimes(const string &name) const
+{
+	const ZoneData *zone = find(name);
+	return zone ? zone->gpu.getPercentiles() : Samples().getPercentiles();
+}
+
+/**
+ * @brief Gets a one-line summary of the frame times, e.g. for the window title.
+ */
+string Profiler::getSummary() const
+{
+	Percentiles cpu = getCpuTimes("frame");
+	Percentiles gpu = getGpuTimes("frame");
+
+	char buffer[128];
+	std::snprintf(buffer, sizeof(buffer), "frame %.2f ms (p99 %.2f ms), GPU %.2f ms",
+				cpu.p50, cpu.p99, gpu.p50);
+	return buffer;
+}
+
+/**
+ * @brief Writes the percentiles of all zones to a file.
+ *
+ * @param path The path of the file.
+ * @return <code>true</code> on success, <code>false</code> otherwise.
+ */
+bool Profiler::writeReport(const string &path) const
+{
+	std::ofstream out(path);
+	char line[256];
+
+	std::snprintf(line, sizeof(line), "%-16s %8s %9s %9s %9s %8s %9s %9s %9s\n",
+				"zone [ms]", "cpu n", "p50", "p95", "p99", "gpu n", "p50", "p95", "p99");
+	out << line;
+	for (const ZoneData &zone : mZones) {
+		Percentiles cpu = zone.cpu.getPercentiles();
+		Percentiles gpu = zone.gpu.getPercentiles();
+		std::snprintf(line, sizeof(line), "%-16s %8zu %9.3f %9.3f %9.3f %8zu %9.3f %9.3f %9.3f\n",
+					zone.name.c_str(),
+					cpu.samples, cpu.p50, cpu.p95, cpu.p99,
+					gpu.samples, gpu.p50, gpu.p95, gpu.p99);
+		out << line;
+	}
+	return out.good();
+}
+
+Profiler::Samples::Samples() :
+	mNext(0)
+{
+}
+
+void Profiler::Samples::add(float ms)
+{
+	if (mValues.size() < HISTORY) {
+		mValues.push_back(ms);
+	} else {
+		mValues[mNext] = ms;
+		mNext = (mNext + 1) % HISTORY;
+	}
+}
+
+Profiler::Percentiles Profiler::Samples::getPercentiles() const
+{
+	Percentiles p = {mValues.size(), 0.0, 0.0, 0.0};
+	if (mValues.empty())
+		return p;
+
+	std::vector<float> sorted(mValues);
+	std::sort(sorted.begin(), sorted.end());
+	// nearest-rank percentiles
+	auto rank = [&sorted](double q) {
+		size_t i = static_cast<size_t>(std::ceil(q * sorted.size()));
+		return static_cast<double>(sorted[std::max<size_t>(i, 1) - 1]);
+	};
+	p.p50 = rank(0.50);
+	p.p95 = rank(0.95);
+	p.p99 = rank(0.99);
+	return p;
+}
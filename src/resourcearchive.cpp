@@ -0,0 +1,446 @@
+#include "resourcearchive.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "blockcompression.h"
+#include "mappedfile.h"
+#include "resourceview.h"
+#include "threadpool.h"
+#include "utils.h"
+
+using std::pair;
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::uint32_t;
+using std::uint64_t;
+using std::vector;
+
+
+constexpr uint32_t ResourceArchive::VERSION;
+constexpr size_t ResourceArchive::ALIGNMENT;
+constexpr size_t ResourceArchive::BLOCK_SIZE;
+constexpr uint32_t ResourceArchive::RAW_BLOCK;
+constexpr size_t ResourceArchive::PARALLEL_BLOCKS;
+
+static const char MAGIC[4] = {'S', 'S', 'A', 'R'};
+
+/**
+ * @brief Opens an archive.
+ *
+ * The archive is mapped into memory and the index is validated, looking up
+ * entries does not need any further system calls.
+ *
+ * @param path The path of the archive.
+ * @throws std::system_error If the archive could not be opened.
+ * @throws std::runtime_error If the file is not a valid archive.
+ */
+ResourceArchive::ResourceArchive(const string &path) :
+	mFile(std::make_shared<MappedFile>(path)),
+	mIndex(nullptr),
+	mNames(nullptr),
+	mCount(0),
+	mPool(nullptr)
+{
+	const unsigned char *data = mFile->data();
+	const uint64_t size = mFile->size();
+
+	Header header;
+	if (size < sizeof(header))
+		throw runtime_error(path + ": not a resource archive");
+	std::memcpy(&header, data, sizeof(header));
+	if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+		throw runtime_error(path + ": not a resource archive");
+	if (header.version != VERSION)
+		throw runtime_error(path + ": unsupported archive version " + std::to_string(header.version));
+
+	if (header.indexOffset % alignof(Entry) != 0
+			|| header.indexOffset > size
+			|| header.count > (size - header.indexOffset) / sizeof(Entry)
+			|| header.namesOffset > size)
+		throw runtime_error(path + ": corrupt archive index");
+
+	mIndex = reinterpret_cast<const Entry*>(data + header.indexOffset);
+	mNames = reinterpret_cast<const char*>(data + header.namesOffset);
+	mCount = header.count;
+
+	const uint64_t namesSize = size - header.namesOffset;
+	for (size_t i = 0; i < mCount; ++i) {
+		const Entry &e = mIndex[i];
+		if (e.nameOffset > namesSize || e.nameLength > namesSize - e.nameOffset
+				|| e.offset > size || e.storedSize > size - e.offset || e.storedSize > e.size
+				|| (i > 0 && mIndex[i - 1].hash > e.hash))
+			throw runtime_error(path + ": corrupt archive index");
+	}
+}
+
+/**
+ * @brief Checks whether the archive contains a resource.
+ *
+ * @param name The name of the resource.
+ * @return <code>true</code> if the resource exists, <code>false</code> otherwise.
+ */
+bool ResourceArchive::contains(const string &name) const
+{
+	return lookup(name) != nullptr;
+}
+
+/**
+ * @brief Gets the content of a resource.
+ *
+ * @param name The name of the resource.
+ * @param view Receives a view of the content if the resource exists. The view
+ *        keeps the archive mapped.
+ * @return <code>true</code> if the resource exists, <code>false</code> otherwise.
+ */
+bool ResourceArchive::find(const string &name, ResourceView &view) const
+{
+	const Entry *e = lookup(name);
+	if (e == nullptr)
+		return false;
+	if (e->storedSize == e->size) {
+		view = ResourceView(mFile, mFile->data() + e->offset, e->size);
+		return true;
+	}
+
+	std::shared_ptr<unsigned char> buffer(new unsigned char[e->size], std::default_delete<unsigned char[]>());
+	extract(*e, 0, buffer.get(), e->size, false);
+	view = ResourceView(buffer, buffer.get(), e->size);
+	return true;
+}
+
+/**
+ * @brief Gets the content of a resource as stored in the archive.
+ *
+ * @param name The name of the resource.
+ * @param view Receives a view of the stored content, compressed or not, if
+ *        the resource exists. The view keeps the archive mapped.
+ * @return <code>true</code> if the resource exists, <code>false</code> otherwise.
+ */
+bool ResourceArchive::findStored(const string &name, ResourceView &view) const
+{
+	const Entry *e = lookup(name);
+	if (e == nullptr)
+		return false;
+	view = ResourceView(mFile, mFile->data() + e->offset, e->storedSize);
+	return true;
+}
+
+/**
+ * @brief Gets the size of a resource and whether it is compressed.
+ *
+ * @return <code>true</code> if the resource exists, <code>false</code> otherwise.
+ */
+bool ResourceArchive::stat(const string &name, uint64_t &size, bool &compressed) const
+{
+	const Entry *e = lookup(name);
+	if (e == nullptr)
+		return false;
+	size = e->size;
+	compressed = e->storedSize != e->size;
+	return true;
+}
+
+/**
+ * @brief Copies a part of the content of a resource into a buffer.
+ *
+ * Only the blocks containing the part are decompressed, the blocks completely
+ * inside of it straight into the buffer unless it is write combined.
+ *
+ * @param name The name of the resource.
+ * @param offset The start of the part in the content.
+ * @param dst Receives the part.
+ * @param size The size of the part.
+ * @param writeCombined Whether dst is write combined memory, e.g. a mapped
+ *        OpenGL buffer. The decompressor reads back what it wrote, so blocks
+ *        are decompressed into cached memory and copied from there.
+ * @throws std::runtime_error If the resource does not exist, the part exceeds
+ *         its content or the content is corrupt.
+ */
+void ResourceArchive::read(const string &name, uint64_t offset, void *dst, uint64_t size,
+			bool writeCombined) const
+{
+	const Entry *e = lookup(name);
+	if (e == nullptr)
+		throw runtime_error(name + ": not in archive");
+	if (offset > e->size || size > e->size - offset)
+		throw runtime_error(name + ": read past the end of the resource");
+	extract(*e, offset, static_cast<unsigned char*>(dst), size, writeCombined);
+}
+
+/**
+ * @brief Ranges of blocks decompressed by the caller and the workers of a pool.
+ *
+ * Whoever runs first takes the next range, so the caller never waits for a
+ * job still queued behind others. Jobs starting after all ranges are taken
+ * return right away, they only keep this state alive.
+ */
+struct BlockRanges {
+	std::function<void(uint64_t,uint64_t)> decompress;
+	uint64_t first;
+	uint64_t last;
+	size_t count;
+	std::atomic<size_t> next;
+	std::mutex mutex;
+	std::condition_variable finished;
+	size_t done;
+	std::exception_ptr error;
+
+	void run() {
+		for (size_t r; (r = next++) < count; ) {
+			try {
+				decompress(first + (last - first) * r / count, first + (last - first) * (r + 1) / count);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+					error = std::current_exception();
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			if (++done == count)
+				finished.notify_all();
+		}
+	}
+};
+
+/**
+ * @brief Decompresses a part of an entry.
+ *
+ * Entries with at least PARALLEL_BLOCKS blocks to decompress are split into
+ * ranges of blocks, which the workers of the pool help decompressing. On a
+ * worker of the pool, or without a pool, they are decompressed by the
+ * calling thread only.
+ *
+ * @throws std::runtime_error If the content is corrupt.
+ */
+void ResourceArchive::extract(const Entry &e, uint64_t offset, unsigned char *dst, uint64_t size,
+			bool writeCombined) const
+{
+	const unsigned char *data = mFile->data() + e.offset;
+	if (e.storedSize == e.size) {
+		std::memcpy(dst, data + offset, size);
+		return;
+	}
+	if (size == 0)
+		return;
+
+	const uint64_t blocks = (e.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (blocks > e.storedSize / sizeof(uint32_t))
+		throw runtime_error("corrupt archive entry");
+	vector<uint32_t> sizes(blocks);
+	std::memcpy(sizes.data(), data, blocks * sizeof(uint32_t));
+	vector<uint64_t> starts(blocks + 1);
+	starts[0] = blocks * sizeof(uint32_t);
+	for (uint64_t i = 0; i < blocks; ++i) {
+		starts[i + 1] = starts[i] + (sizes[i] & ~RAW_BLOCK);
+		if (starts[i + 1] > e.storedSize)
+			throw runtime_error("corrupt archive entry");
+	}
+
+	const uint64_t end = offset + size;
+	auto decompress = [&](uint64_t first, uint64_t last) {
+		vector<unsigned char> scratch;
+		if (writeCombined)
+			scratch.resize(BLOCK_SIZE);
+		for (uint64_t i = first; i < last; ++i) {
+			const uint64_t blockStart = i * BLOCK_SIZE;
+			const uint64_t blockSize = std::min<uint64_t>(BLOCK_SIZE, e.size - blockStart);
+			const uint64_t copyStart = std::max(offset, blockStart);
+			const uint64_t copyEnd = std::min(end, blockStart + blockSize);
+			const unsigned char *src = data + starts[i];
+			const uint64_t stored = starts[i + 1] - starts[i];
+
+			if (sizes[i] & RAW_BLOCK) {
+				if (stored != blockSize)
+					throw runtime_error("corrupt archive entry");
+				std::memcpy(dst + (copyStart - offset), src + (copyStart - blockStart), copyEnd - copyStart);
+			} else if (!writeCombined && copyStart == blockStart && copyEnd == blockStart + blockSize) {
+				if (!decompressBlock(src, stored, dst + (blockStart - offset), blockSize))
+					throw runtime_error("corrupt archive entry");
+			} else {
+				scratch.resize(blockSize);
+				if (!decompressBlock(src, stored, scratch.data(), blockSize))
+					throw runtime_error("corrupt archive entry");
+				std::memcpy(dst + (copyStart - offset), scratch.data() + (copyStart - blockStart), copyEnd - copyStart);
+			}
+		}
+	};
+
+	const uint64_t first = offset / BLOCK_SIZE;
+	const uint64_t last = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (last - first < PARALLEL_BLOCKS || mPool == nullptr || mPool->isWorker()) {
+		decompress(first, last);
+		return;
+	}
+
+	auto ranges = std::make_shared<BlockRanges>();
+	ranges->decompress = decompress;
+	ranges->first = first;
+	ranges->last = last;
+	ranges->count = std::min<uint64_t>(mPool->size() + 1, (last - first) / (PARALLEL_BLOCKS / 2));
+	ranges->next = 0;
+	ranges->done = 0;
+	try {
+		for (size_t t = 1; t < ranges->count; ++t)
+			mPool->submit([ranges](){ ranges->run(); });
+	} catch (std::exception&) {
+		// the calling thread takes the ranges not submitted
+	}
+	ranges->run();
+
+	std::unique_lock<std::mutex> lock(ranges->mutex);
+	ranges->finished.wait(lock, [&ranges](){ return ranges->done == ranges->count; });
+	if (ranges->error)
+		std::rethrow_exception(ranges->error);
+}
+
+/**
+ * @brief Compresses the content of an entry block by block.
+ *
+ * @return The block sizes followed by the blocks.
+ */
+static vector<unsigned char> compressEntry(const unsigned char *data, uint64_t size)
+{
+	const uint64_t blocks = (size + ResourceArchive::BLOCK_SIZE - 1) / ResourceArchive::BLOCK_SIZE;
+	vector<unsigned char> out(blocks * sizeof(uint32_t));
+	vector<unsigned char> block(ResourceArchive::BLOCK_SIZE);
+	for (uint64_t i = 0; i < blocks; ++i) {
+		const unsigned char *src = data + i * ResourceArchive::BLOCK_SIZE;
+		const size_t blockSize = std::min<uint64_t>(ResourceArchive::BLOCK_SIZE, size - i * ResourceArchive::BLOCK_SIZE);
+		// blocks which do not get smaller are stored raw
+		const size_t packed = compressBlock(src, blockSize, block.data(), blockSize - 1);
+		uint32_t stored;
+		if (packed > 0) {
+			stored = static_cast<uint32_t>(packed);
+			out.insert(out.end(), block.data(), block.data() + packed);
+		} else {
+			stored = static_cast<uint32_t>(blockSize) | ResourceArchive::RAW_BLOCK;
+			out.insert(out.end(), src, src + blockSize);
+		}
+		std::memcpy(out.data() + i * sizeof(uint32_t), &stored, sizeof(stored));
+	}
+	return out;
+}
+
+/**
+ * @brief Creates an archive.
+ *
+ * Each file is compressed if that makes it at least an eighth smaller,
+ * otherwise it is stored as is.
+ *
+ * @param path The path of the archive to create.
+ * @param files Pairs of resource names and the paths of the files to store.
+ *        The names must be unique.
+ * @throws std::system_error If a file could not be read or written.
+ * @throws std::runtime_error If a name is used twice.
+ */
+void ResourceArchive::write(const string &path, const vector<pair<string,string>> &files)
+{
+	vector<Entry> index(files.size());
+	vector<size_t> order(files.size());
+	for (size_t i = 0; i < files.size(); ++i) {
+		order[i] = i;
+		index[i].hash = hash(files[i].first);
+	}
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return index[a].hash != index[b].hash
+				? index[a].hash < index[b].hash
+				: files[a].first < files[b].first;
+	});
+
+	Header header;
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.count = static_cast<uint32_t>(files.size());
+	header.reserved = 0;
+	header.indexOffset = sizeof(Header);
+	header.namesOffset = header.indexOffset + files.size() * sizeof(Entry);
+
+	string names;
+	vector<Entry> sorted;
+	sorted.reserve(files.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		const string &name = files[order[i]].first;
+		if (i > 0 && name == files[order[i - 1]].first)
+			throw runtime_error(path + ": duplicate resource name " + name);
+		Entry e = index[order[i]];
+		e.nameOffset = static_cast<uint32_t>(names.size());
+		e.nameLength = static_cast<uint32_t>(name.size());
+		names += name;
+		sorted.push_back(e);
+	}
+
+	vector<std::unique_ptr<MappedFile>> contents;
+	vector<vector<unsigned char>> compressed(sorted.size());
+	contents.reserve(sorted.size());
+	uint64_t offset = header.namesOffset + names.size();
+	for (size_t i = 0; i < sorted.size(); ++i) {
+		contents.emplace_back(new MappedFile(files[order[i]].second));
+		offset = (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+		sorted[i].offset = offset;
+		sorted[i].size = contents.back()->size();
+		sorted[i].storedSize = sorted[i].size;
+		// decompressing is only worth it if it saves at least an eighth
+		compressed[i] = compressEntry(contents.back()->data(), sorted[i].size);
+		if (compressed[i].size() <= sorted[i].size - sorted[i].size / 8 && sorted[i].size > 0)
+			sorted[i].storedSize = compressed[i].size();
+		else
+			compressed[i] = vector<unsigned char>();
+		offset += sorted[i].storedSize;
+	}
+
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out.good())
+		throw std::system_error(errno, std::generic_category(), path);
+	out.exceptions(std::ofstream::badbit | std::ofstream::failbit);
+
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(sorted.data()), sorted.size() * sizeof(Entry));
+	out.write(names.data(), names.size());
+
+	static const char padding[ALIGNMENT] = {};
+	uint64_t pos = header.namesOffset + names.size();
+	for (size_t i = 0; i < sorted.size(); ++i) {
+		out.write(padding, sorted[i].offset - pos);
+		const unsigned char *content = sorted[i].storedSize == sorted[i].size
+				? contents[i]->data() : compressed[i].data();
+		out.write(reinterpret_cast<const char*>(content), sorted[i].storedSize);
+		pos = sorted[i].offset + sorted[i].storedSize;
+	}
+}
+
+/**
+ * @brief Hashes a resource name (64 bit FNV-1a).
+ */
+uint64_t ResourceArchive::hash(const string &name)
+{
+	return fnv1a(name.data(), name.size());
+}
+
+const ResourceArchive::Entry *ResourceArchive::lookup(const string &name) const
+{
+	const uint64_t h = hash(name);
+	const Entry *end = mIndex + mCount;
+	const Entry *e = std::lower_bound(mIndex, end, h, [](const Entry &e, uint64_t h) {
+		return e.hash < h;
+	});
+	for (; e != end && e->hash == h; ++e) {
+		if (e->nameLength == name.size()
+				&& name.compare(0, string::npos, mNames + e->nameOffset, e->nameLength) == 0)
+			return e;
+	}
+	return nullptr;
+}
@@ -1,15 +1,29 @@
 #include "resourceloader.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <fstream>
+#include <future>
 #include <istream>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <regex>
 #include <sstream>
+#include <stdexcept>
 #include <string>
-
-// TODO remove
-#include <iostream>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <gtl/ogl/program.h>
 #include <gtl/ogl/shader.h>
@@ -17,7 +31,22 @@
 #include <gtl/ogl/texture.h>
 
 #include <SOIL.h>
+#include <image_helper.h>
+extern "C" {
+#include <image_DXT.h>
+}
+
+#include <sys/stat.h>
+#ifndef _WIN32
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
 
+#define UTL_LOGGER resources
+#include <utl/logging.h>
+
+#include "gltools.h"
+#include "mappedfile.h"
 #include "utils.h"
 
 using gtl::ogl::Program;
@@ -25,22 +54,43 @@ using gtl::ogl::Shader;
 using gtl::ogl::ShaderException;
 using gtl::ogl::Texture;
 using std::getline;
-using std::ifstream;
 using std::istream;
 using std::regex;
 using std::regex_match;
 using std::shared_ptr;
 using std::size_t;
 using std::string;
-using std::stringstream;
 using std::unique_ptr;
 
 
+/**
+ * @brief Creates a loader for the resources at the given location.
+ *
+ * @param searchpath Either the directory containing the resources or a
+ *        resource archive created by ssapack.
+ * @throws InvalidResourceException If the searchpath is not a valid archive.
+ */
 ResourceLoader::ResourceLoader(const string &searchpath) :
 	mSearchpath(searchpath),
+	mTracing(false),
+	mCookedTextures(false),
+	mStreamingThreshold(0),
 	textureCache(this),
+	arrayTextureCache(this),
+	shaderCache(this),
 	programCache(this)
 {
+	struct stat st;
+	if (stat(searchpath.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+		try {
+			mArchive.reset(new ResourceArchive(searchpath));
+			mArchive->setThreadPool(&mWorkers);
+		} catch (std::exception &e) {
+			throw InvalidResourceException(searchpath, e.what());
+		}
+	} else {
+		mReader.reset(new BatchReader());
+	}
 }
 
 ResourceLoader::~ResourceLoader()
@@ -55,214 +105,2107 @@ ResourceLoader::~ResourceLoader()
  */
 bool ResourceLoader::exists(const string &name) const
 {
-	ifstream f(mSearchpath + "/" + name);
-	return f.good();
+	if (mArchive)
+		return mArchive->contains(name);
+
+	struct stat st;
+	return stat((mSearchpath + "/" + name).c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/**
+ * @brief Maps a resource into memory.
+ *
+ * The content is not copied. The returned view keeps the mapping alive, so it
+ * can be passed to other threads and outlive this loader. If the loader reads
+ * from an archive, the view points into the mapping of the archive, unless
+ * the resource is compressed. Then it is decompressed into a new buffer.
+ *
+ * @param name The name of the resource.
+ * @return A read-only view of the content of the resource.
+ * @throws ResourceNotFoundException If the resource does not exist or could not be opened.
+ * @throws InvalidResourceException If the compressed resource is corrupt.
+ */
+ResourceView ResourceLoader::map(const string &name) const
+{
+	const ResourceWatcher::Clock::time_point start = ResourceWatcher::Clock::now();
+	ResourceView view;
+	if (mArchive) {
+		bool found;
+		try {
+			found = mArchive->find(name, view);
+		} catch (std::runtime_error &e) {
+			throw InvalidResourceException(name, e.what());
+		}
+		if (!found)
+			throw ResourceNotFoundException(name, "not in archive");
+	} else {
+		try {
+			view = readFile(mSearchpath + "/" + name);
+		} catch (std::system_error &e) {
+			throw ResourceNotFoundException(name, e.code().message());
+		}
+	}
+	recordAccess(false, name, view.size(), start);
+	return view;
+}
+
+/**
+ * @brief Asks the kernel to read ahead the pages of a mapped view.
+ */
+static void adviseWillNeed(const ResourceView &view)
+{
+#ifndef _WIN32
+	static const std::uintptr_t page = sysconf(_SC_PAGESIZE);
+	std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(view.data()) & ~(page - 1);
+	std::uintptr_t end = reinterpret_cast<std::uintptr_t>(view.data()) + view.size();
+	posix_madvise(reinterpret_cast<void*>(begin), end - begin, POSIX_MADV_WILLNEED);
+#else
+	(void) view;
+#endif
+}
+
+/**
+ * @brief Starts reading resources into memory in the background.
+ *
+ * All reads are submitted at once, so loading many small files from a cold
+ * cache is limited by the bandwidth of the disk instead of the latency of
+ * each read. A prefetched resource is handed out by the next
+ * ResourceLoader::map of it, including those from the workers decoding
+ * textures for ResourceLoader::loadTextureAsync, and not kept afterwards.
+ * Resources not mapped until ResourceLoader::finishAccessTrace are dropped.
+ * For images, their cooked textures are read instead if they are used.
+ *
+ * If the loader reads from an archive, the kernel is asked to read ahead the
+ * resources in the mapping of the archive instead.
+ *
+ * @param names The names of the resources. Missing resources are reported
+ *        when they are mapped.
+ */
+void ResourceLoader::prefetch(const std::vector<string> &names)
+{
+	if (mArchive) {
+		for (const string &name : names) {
+			ResourceView view;
+			// compressed resources are read ahead as they are stored
+			if (mArchive->findStored(name, view))
+				adviseWillNeed(view);
+			if (mCookedTextures && mArchive->findStored(name + ".dds", view))
+				adviseWillNeed(view);
+		}
+		return;
+	}
+
+	std::vector<string> paths;
+	{
+		std::lock_guard<std::mutex> lock(mPrefetchMutex);
+		for (const string &name : names) {
+			string path = getCookedPath(name);
+			if (path.empty())
+				path = mSearchpath + "/" + name;
+			if (mPrefetched.find(path) == mPrefetched.end())
+				paths.push_back(path);
+		}
+	}
+	if (paths.empty())
+		return;
+
+	std::vector<std::shared_future<ResourceView>> results = mReader->read(paths);
+	std::lock_guard<std::mutex> lock(mPrefetchMutex);
+	for (size_t i = 0; i < paths.size(); ++i)
+		mPrefetched.emplace(paths[i], std::move(results[i]));
+}
+
+// set on the threads decoding textures of a replayed trace
+static thread_local bool replaying = false;
+
+/**
+ * @brief Keeps the accesses of a replay out of the trace.
+ */
+struct ReplayScope {
+	ReplayScope() {
+		replaying = true;
+	}
+	~ReplayScope() {
+		replaying = false;
+	}
+};
+
+/**
+ * @brief Records and replays the resources accessed at startup.
+ *
+ * The names, sizes and load times of the resources mapped and the textures
+ * decoded are recorded from now on, in the order of their first access. If
+ * the file holds the trace of a previous run, its resources are prefetched
+ * and its textures decoded on the workers right away, in the same order, so
+ * they are ready when they are loaded. Call ResourceLoader::finishAccessTrace
+ * once startup is done.
+ *
+ * @param file The file holding the trace, written by the last run.
+ */
+void ResourceLoader::startAccessTrace(const string &file)
+{
+	std::vector<TraceEntry> replayed;
+	std::ifstream f(file);
+	string line;
+	while (getline(f, line)) {
+		std::istringstream in(line);
+		string kind;
+		TraceEntry entry;
+		in >> kind >> entry.size >> entry.start >> entry.duration;
+		in.ignore(1);
+		getline(in, entry.name);
+		if (!in || (kind != "file" && kind != "texture") || entry.name.empty()) {
+			utl::warning("Ignoring invalid access trace %s", file.c_str());
+			replayed.clear();
+			break;
+		}
+		entry.texture = kind == "texture";
+		replayed.push_back(entry);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mTraceMutex);
+		mTraceFile = file;
+		mTracing = true;
+		mTraceStart = ResourceWatcher::Clock::now();
+		mTrace.clear();
+		mReplayed = replayed;
+	}
+	if (replayed.empty())
+		return;
+
+	utl::info("Replaying %zu resource accesses from %s", replayed.size(), file.c_str());
+	std::vector<string> names;
+	for (const TraceEntry &entry : replayed)
+		names.push_back(entry.name);
+	prefetch(names);
+
+	std::lock_guard<std::mutex> lock(mTraceMutex);
+	for (const TraceEntry &entry : replayed) {
+		if (!entry.texture || mPredecoded.count(entry.name) > 0)
+			continue;
+		const string name = entry.name;
+		mPredecoded.emplace(name, mWorkers.submit([this,name](){
+			ReplayScope scope;
+			return decodeTexture(name);
+		}));
+	}
+}
+
+static string getTraceKey(bool texture, const string &name)
+{
+	return (texture ? "texture " : "file ") + name;
+}
+
+/**
+ * @brief Writes the trace started by ResourceLoader::startAccessTrace.
+ *
+ * Reports how much of the time spent loading resources in the replayed run
+ * was hidden behind prefetching and decoding ahead. Textures decoded ahead
+ * and resources prefetched but not loaded are dropped, even if no trace is
+ * recorded.
+ */
+void ResourceLoader::finishAccessTrace()
+{
+	size_t unread;
+	{
+		std::lock_guard<std::mutex> lock(mPrefetchMutex);
+		unread = mPrefetched.size();
+		mPrefetched.clear();
+	}
+
+	std::vector<TraceEntry> trace;
+	std::vector<TraceEntry> replayed;
+	size_t unused;
+	{
+		std::lock_guard<std::mutex> lock(mTraceMutex);
+		if (!mTracing)
+			return;
+		mTracing = false;
+		trace.swap(mTrace);
+		replayed.swap(mReplayed);
+		unused = mPredecoded.size();
+		mPredecoded.clear();
+	}
+
+	// only the first access of a resource is kept, in the order they started
+	std::stable_sort(trace.begin(), trace.end(),
+			[](const TraceEntry &a, const TraceEntry &b){ return a.start < b.start; });
+	std::unordered_set<string> seen;
+	std::vector<TraceEntry> entries;
+	for (const TraceEntry &entry : trace) {
+		if (seen.insert(getTraceKey(entry.texture, entry.name)).second)
+			entries.push_back(entry);
+	}
+
+	if (!replayed.empty()) {
+		std::unordered_map<string,double> previous;
+		for (const TraceEntry &entry : replayed)
+			previous.emplace(getTraceKey(entry.texture, entry.name), entry.duration);
+		// indexed by TraceEntry::texture
+		size_t count[2] = {0, 0}, hits[2] = {0, 0};
+		double before[2] = {0, 0}, hidden[2] = {0, 0};
+		for (const TraceEntry &entry : entries) {
+			++count[entry.texture];
+			auto it = previous.find(getTraceKey(entry.texture, entry.name));
+			if (it == previous.end())
+				continue;
+			++hits[entry.texture];
+			before[entry.texture] += it->second;
+			hidden[entry.texture] += std::max(0.0, it->second - entry.duration);
+		}
+		utl::info("Access trace covered %zu of %zu files and %zu of %zu textures, %zu read and %zu decoded unused",
+				hits[0], count[0], hits[1], count[1], unread, unused);
+		utl::info("Prefetching hid %.1f of %.1f ms reading and %.1f of %.1f ms decoding",
+				hidden[0], before[0], hidden[1], before[1]);
+	}
+
+	std::ofstream f(mTraceFile);
+	for (const TraceEntry &entry : entries) {
+		char times[64];
+		std::snprintf(times, sizeof(times), "%.3f %.3f", entry.start, entry.duration);
+		f << (entry.texture ? "texture " : "file ") << entry.size << ' ' << times << ' ' << entry.name << '\n';
+	}
+	if (!f.good())
+		utl::warning("Could not write %s", mTraceFile.c_str());
+}
+
+/**
+ * @brief Adds an access to the trace, if one is recorded.
+ *
+ * @param texture Whether an image was decoded, otherwise a file was read.
+ * @param start When the access started.
+ */
+void ResourceLoader::recordAccess(bool texture, const string &name, size_t size,
+			ResourceWatcher::Clock::time_point start) const
+{
+	if (replaying)
+		return;
+	const ResourceWatcher::Clock::time_point end = ResourceWatcher::Clock::now();
+	std::lock_guard<std::mutex> lock(mTraceMutex);
+	if (!mTracing)
+		return;
+	typedef std::chrono::duration<double,std::milli> Milliseconds;
+	mTrace.push_back(TraceEntry{texture, name, size,
+			Milliseconds(start - mTraceStart).count(), Milliseconds(end - start).count()});
+}
+
+/**
+ * @brief Gets the content of a file, prefetched, mapped or read with hot reload.
+ *
+ * @throws std::system_error If the file could not be read.
+ */
+ResourceView ResourceLoader::readFile(const string &path) const
+{
+	std::shared_future<ResourceView> prefetched;
+	{
+		std::lock_guard<std::mutex> lock(mPrefetchMutex);
+		auto it = mPrefetched.find(path);
+		if (it != mPrefetched.end()) {
+			prefetched = std::move(it->second);
+			mPrefetched.erase(it);
+		}
+	}
+	if (prefetched.valid()) {
+		try {
+			return prefetched.get();
+		} catch (std::system_error&) {
+			// reading it again reports the error, unless the prefetch failed for another reason
+		}
+	}
+	// editors may truncate a file while it is decoded, which kills a mapping with SIGBUS
+	if (mWatcher)
+		return BatchReader::readFile(path);
+
+	shared_ptr<MappedFile> file = std::make_shared<MappedFile>(path);
+	return ResourceView(file, file->data(), file->size());
 }
 
 /**
  * @brief Gets an imput stream of a resource.
  *
- * This function opens a resource and renturns it's input stream. The badbid of
- * the exception mask is set. Use ResourceLoader::load to get the content of the
- * resource.
+ * This function maps a resource and renturns an input stream reading from the
+ * mapping. The badbid of the exception mask is set. Use ResourceLoader::load
+ * to get the content of the resource.
  *
  * @see ResourceLoader::load
+ * @see ResourceLoader::map
  * @param name The name of the resource to open.
  * @return The input stream for the given resource name.
  * @throws ResourceNotFoundException If the resource does not exist or could not be opened.
  */
 unique_ptr<istream> ResourceLoader::open(const string &name) const
 {
-	unique_ptr<ifstream> f(new ifstream(mSearchpath + "/" + name, std::ios::binary));
-	errno = 0;
-	if (f->good()) {
-		f->exceptions(ifstream::badbit);
-		return f;
-	} else {
-		std::string msg;
-		if (errno)
-			msg = strerror(errno);
-		throw ResourceNotFoundException(name, msg);
-	}
+	unique_ptr<istream> f(new ResourceViewStream(map(name)));
+	f->exceptions(istream::badbit);
+	return f;
 }
 
 /**
  * @brief Reads a resource and returnes the content.
  *
- * @see ResourceLoader::open
+ * @see ResourceLoader::map
  * @param name The name of the resource.
  * @return The content of the resource.
  * @throws ResourceNotFoundException If the resource does not exist or could not be opened.
- * @throws std::ios_base::failure If an error occurred while reading the resource.
  */
 string ResourceLoader::load(const string &name) const
 {
-	unique_ptr<istream> f = open(name);
-	stringstream buffer;
-	buffer << f->rdbuf();
-	return buffer.str();
+	ResourceView data = map(name);
+	return string(reinterpret_cast<const char*>(data.data()), data.size());
 }
 
-Texture ResourceLoader::loadTexture(const string &name) const
+/**
+ * @brief Maps the texture cooked by ssacook for an image.
+ *
+ * Archives contain the cooked textures next to their images. In a directory,
+ * a cooked texture older than its image is ignored, so modified images are
+ * used before the next cooker run.
+ *
+ * @param name The name of the image.
+ * @return The DDS file, or an empty view if there is no usable cooked texture.
+ */
+ResourceView ResourceLoader::mapCookedTexture(const string &name) const
 {
-	string data = load(name);
+	ResourceView view;
+	if (!mCookedTextures)
+		return view;
+	if (mArchive) {
+		try {
+			mArchive->find(name + ".dds", view);
+		} catch (std::runtime_error &e) {
+			utl::warning("Could not decompress %s.dds: %s", name.c_str(), e.what());
+		}
+		return view;
+	}
 
-	int width, height, channels;
-	auto img = SOIL_load_image_from_memory(
-			reinterpret_cast<const unsigned char*>(data.data()), data.size(),
-			&width, &height, &channels,
-			SOIL_LOAD_AUTO);
+	string path = getCookedPath(name);
+	if (path.empty())
+		return view;
 
-	if (img == nullptr) {
-		throw InvalidResourceException(name, SOIL_last_result());
-	} else {
-		Texture t(Texture::Target::T_2D);
+	try {
+		view = readFile(path);
+	} catch (std::system_error &e) {
+		utl::warning("Could not open %s: %s", path.c_str(), e.code().message().c_str());
+	}
+	return view;
+}
 
-		GLenum format;
-		GLenum internalFormat;
-		switch (channels) {
-		case 1:
-			format = GL_RED;
-			internalFormat = GL_R8;
-		{
-			GLint swizzleMask[] = {GL_RED, GL_RED, GL_RED, GL_ONE};
-			t.setParameter(GL_TEXTURE_SWIZZLE_RGBA, swizzleMask);
-		}
-			break;
-		case 2:
-			format = GL_RG;
-			internalFormat = GL_RG8;
-		{
-			GLint swizzleMask[] = {GL_RED, GL_RED, GL_RED, GL_GREEN};
-			t.setParameter(GL_TEXTURE_SWIZZLE_RGBA, swizzleMask);
-		}
-			break;
-		case 3:
-			format = GL_RGB;
-			internalFormat = GL_RGB8;
-			break;
-		case 4:
-			format = GL_RGBA;
-			internalFormat = GL_RGBA8;
-			break;
-		default:
-			assert(false);
-		}
+/**
+ * @brief Gets the path of the usable texture cooked for an image.
+ *
+ * @param name The name of the image.
+ * @return The path of the DDS file, or an empty string if there is no usable
+ *         cooked texture in the cooked directory.
+ */
+string ResourceLoader::getCookedPath(const string &name) const
+{
+	if (!mCookedTextures || mArchive || mCookedDir.empty())
+		return string();
 
-		t.storage(1, internalFormat, width, height);
-		t.setSubImage(0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, img);
+	string path = mCookedDir + "/" + name + ".dds";
+	struct stat cooked, source;
+	if (stat(path.c_str(), &cooked) != 0
+			|| stat((mSearchpath + "/" + name).c_str(), &source) != 0
+			|| cooked.st_mtime < source.st_mtime)
+		return string();
+	return path;
+}
 
-		SOIL_free_image_data(img);
-		return t;
-	}
+/**
+ * @brief Computes the size of a DXT1 (3 channels) or DXT5 (4 channels) level.
+ */
+static size_t getCompressedSize(int width, int height, int channels)
+{
+	return static_cast<size_t>((width + 3) / 4) * ((height + 3) / 4) * (channels == 3 ? 8 : 16);
 }
 
-shared_ptr<const Texture> ResourceLoader::getTexture(const string &name)
+/**
+ * @brief Reads the header of a DDS file written by ssacook.
+ *
+ * @param size The size of the whole file.
+ * @return The image without pixels, which follow the header.
+ * @throws InvalidResourceException If the file is not a DXT1 or DXT5 texture.
+ */
+static Image parseCookedHeader(const string &name, const unsigned char *data, size_t size)
 {
-	return textureCache.get(name);
+	static const unsigned int DDS_MAGIC = ('D' << 0) | ('D' << 8) | ('S' << 16) | (' ' << 24);
+	static const unsigned int DXT1 = ('D' << 0) | ('X' << 8) | ('T' << 16) | ('1' << 24);
+	static const unsigned int DXT5 = ('D' << 0) | ('X' << 8) | ('T' << 16) | ('5' << 24);
+
+	DDS_header header;
+	if (size < sizeof(header))
+		throw InvalidResourceException(name, "truncated cooked texture");
+	std::memcpy(&header, data, sizeof(header));
+	if (header.dwMagic != DDS_MAGIC || header.dwSize != 124
+			|| !(header.sPixelFormat.dwFlags & DDPF_FOURCC)
+			|| (header.sPixelFormat.dwFourCC != DXT1 && header.sPixelFormat.dwFourCC != DXT5)
+			|| header.dwWidth < 1 || header.dwHeight < 1 || header.dwWidth > 16384 || header.dwHeight > 16384)
+		throw InvalidResourceException(name, "unsupported cooked texture");
+
+	Image image;
+	image.width = header.dwWidth;
+	image.height = header.dwHeight;
+	image.channels = header.sPixelFormat.dwFourCC == DXT1 ? 3 : 4;
+	image.levels = (header.dwFlags & DDSD_MIPMAPCOUNT) && header.dwMipMapCount > 0 ? header.dwMipMapCount : 1;
+	image.compressed = true;
+
+	size_t levels = 0;
+	for (int level = 0, w = image.width, h = image.height; level < image.levels; ++level) {
+		levels += getCompressedSize(w, h, image.channels);
+		if (w == 1 && h == 1 && level + 1 < image.levels)
+			throw InvalidResourceException(name, "too many levels in cooked texture");
+		w = std::max(w / 2, 1);
+		h = std::max(h / 2, 1);
+	}
+	if (size - sizeof(header) < levels)
+		throw InvalidResourceException(name, "truncated cooked texture");
+	return image;
 }
 
-Texture ResourceLoader::loadArrayTexture(const string names[], size_t len) const
+/**
+ * @brief Reads the compressed levels of a DDS file written by ssacook.
+ *
+ * @throws InvalidResourceException If the file is not a DXT1 or DXT5 texture.
+ */
+static Image parseCookedTexture(const string &name, const ResourceView &data)
 {
-	// TODO
-	return Texture();
+	Image image = parseCookedHeader(name, data.data(), data.size());
+	// the blocks are uploaded straight from the mapping
+	auto owner = std::make_shared<ResourceView>(data);
+	image.pixels = shared_ptr<unsigned char>(owner, const_cast<unsigned char*>(owner->data() + sizeof(DDS_header)));
+	return image;
 }
 
-shared_ptr<const Texture> ResourceLoader::getArrayTexture(const string names[], size_t len)
+/**
+ * @brief Reads and decodes an image resource.
+ *
+ * If there is a texture cooked by ssacook for the image (see
+ * ResourceLoader::setCookedTextures), its compressed levels are returned
+ * without decoding anything. This function does not use OpenGL and may be
+ * called from any thread.
+ *
+ * @see ResourceLoader::createTexture
+ * @param name The name of the resource.
+ * @return The decoded image.
+ * @throws ResourceNotFoundException If the resource does not exist or could not be opened.
+ * @throws InvalidResourceException If the resource could not be decoded.
+ */
+Image ResourceLoader::decodeTexture(const string &name) const
 {
-	// no cache implemented yet
-	return std::make_shared<Texture>(loadArrayTexture(names, len));
+	ResourceView cooked = mapCookedTexture(name);
+	if (!cooked.empty())
+		return parseCookedTexture(name + ".dds", cooked);
+	return decodeImage(name);
 }
 
-Shader ResourceLoader::loadShader(const string &name) const
+/**
+ * @brief Decodes an image resource, ignoring cooked textures.
+ *
+ * The mip levels are built right after the decoded pixels, so the image
+ * holds all levels in a single allocation.
+ */
+Image ResourceLoader::decodeImage(const string &name) const
 {
-	Shader::Type type;
-	string ext = name.substr(name.find_last_of('.'));
+	ResourceView data = map(name);
 
-	if (ext == ".vert")
-		type = Shader::Type::VERTEX;
-	else if (ext == ".frag")
-		type = Shader::Type::FRAGMENT;
-	else if (ext == ".geom")
-		type = Shader::Type::GEOMETRY;
-	else if (ext == ".tcs")
-		type = Shader::Type::TESS_CONTROL;
-	else if (ext == ".tes")
-		type = Shader::Type::TESS_EVALUATION;
+	Image image;
+	auto img = SOIL_load_image_from_memory(
+			data.data(), data.size(),
+			&image.width, &image.height, &image.channels,
+			SOIL_LOAD_AUTO);
 
-	std::string source = load(name);
-	Shader s(type, source);
-	try {
-		s.compile();
-	} catch (ShaderException &e) {
-		// TODO log error
-		std::cerr << s.getInfoLog() << std::flush;
-		throw;
+	if (img == nullptr)
+		throw InvalidResourceException(name, SOIL_last_result());
+
+	size_t size = static_cast<size_t>(image.width) * image.height * image.channels;
+	size_t chain = mipmap_chain_size(image.width, image.height, image.channels, &image.levels);
+	// SOIL allocates with malloc, growing the buffer rarely needs a copy
+	auto all = static_cast<unsigned char*>(std::realloc(img, size + chain));
+	if (all == nullptr) {
+		SOIL_free_image_data(img);
+		throw std::bad_alloc();
 	}
+	if (chain > 0)
+		mipmap_chain(all, image.width, image.height, image.channels, 0, all + size);
 
-#ifndef NDEBUG
-	// TODO check p.getInfoLog()
-#endif
+	image.pixels = shared_ptr<unsigned char>(all, SOIL_free_image_data);
+	return image;
+}
 
-	return s;
+/**
+ * @brief Selects the OpenGL formats for 8 bit images.
+ *
+ * @param channels The number of channels of the image.
+ * @param format Receives the pixel format of the image data.
+ * @param internalFormat Receives the format used to store the texture.
+ * @param swizzle Receives the swizzle mask to apply, or nullptr.
+ */
+static void getPixelFormat(int channels, GLenum &format, GLenum &internalFormat, const GLint *&swizzle)
+{
+	static const GLint swizzleR[] = {GL_RED, GL_RED, GL_RED, GL_ONE};
+	static const GLint swizzleRG[] = {GL_RED, GL_RED, GL_RED, GL_GREEN};
+
+	swizzle = nullptr;
+	switch (channels) {
+	case 1:
+		format = GL_RED;
+		internalFormat = GL_R8;
+		swizzle = swizzleR;
+		break;
+	case 2:
+		format = GL_RG;
+		internalFormat = GL_RG8;
+		swizzle = swizzleRG;
+		break;
+	case 3:
+		format = GL_RGB;
+		internalFormat = GL_RGB8;
+		break;
+	case 4:
+		format = GL_RGBA;
+		internalFormat = GL_RGBA8;
+		break;
+	default:
+		assert(false);
+	}
 }
 
-shared_ptr<const Shader> ResourceLoader::getShader(const string &name)
+/**
+ * @brief Sets the unpack alignment and restores the previous one when destroyed.
+ */
+struct UnpackAlignment {
+	GLint previous;
+
+	explicit UnpackAlignment(GLint alignment) {
+		glGetIntegerv(GL_UNPACK_ALIGNMENT, &previous);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+	}
+	~UnpackAlignment() {
+		glPixelStorei(GL_UNPACK_ALIGNMENT, previous);
+	}
+};
+
+/**
+ * @brief Computes the size of all stored levels of an image.
+ */
+static size_t getImageSize(const Image &image)
 {
-	// no cache implemented yet
-	return std::make_shared<Shader>(loadShader(name));
+	size_t size = 0;
+	int levels = image.generateMipmaps ? 1 : image.levels;
+	for (int level = 0, w = image.width, h = image.height; level < levels; ++level) {
+		size += image.compressed ? getCompressedSize(w, h, image.channels)
+				: static_cast<size_t>(w) * h * image.channels;
+		w = std::max(w / 2, 1);
+		h = std::max(h / 2, 1);
+	}
+	return size;
 }
 
-Program ResourceLoader::loadShaderProgram(const string &name) const
+/**
+ * @brief Uploads a decoded image into a new texture.
+ *
+ * All levels of the image are uploaded, compressed images as they are. Images
+ * in the upload ring (see ResourceLoader::enableUploadRing) are read by
+ * OpenGL straight from the ring without stalling. Must be called from the
+ * thread owning the OpenGL context.
+ *
+ * @param image The image returned by ResourceLoader::decodeTexture.
+ * @return The texture.
+ */
+Texture ResourceLoader::createTexture(const Image &image) const
 {
-	//using namespace std::regex_constants;
-	//static regex rgx_comment("", optimize);
+	Texture t(Texture::Target::T_2D);
+	t.setParameter(GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	// rows of small levels are not aligned to 4 bytes
+	UnpackAlignment alignment(1);
 
-	size_t lastSlash = name.find_last_of('/');
-	std::string dir = lastSlash == string::npos ? "" : name.substr(0, lastSlash + 1);
-	unique_ptr<istream> in = open(name);
+	// with the ring bound, the pixel pointers are offsets into it
+	const unsigned char *pixels = image.pixels.get();
+	const bool staged = mUploadRing && mUploadRing->contains(pixels);
+	if (staged) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mUploadRing->getBuffer());
+		pixels = reinterpret_cast<const unsigned char*>(mUploadRing->getOffset(pixels));
+	}
+	const int levels = image.generateMipmaps ? 1 : image.levels;
 
-	Program p(true);
-	std::string line;
-	while (getline(*in, line)) {
-		line = trim(line.substr(0, line.find('#')));
-		if (!line.empty()) {
+	if (image.compressed) {
+		GLenum internalFormat = image.channels == 3
+				? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		t.storage(image.levels, internalFormat, image.width, image.height);
 
-			if (line[0] == '/') {
-				line.erase(0, 1);
-			} else {
-				line = dir + line;
-			}
+		for (int level = 0, w = image.width, h = image.height; level < levels; ++level) {
+			GLsizei size = static_cast<GLsizei>(getCompressedSize(w, h, image.channels));
+			glCompressedTextureSubImage2D(t.getId(), level, 0, 0, w, h, internalFormat, size, pixels);
+			pixels += size;
+			w = std::max(w / 2, 1);
+			h = std::max(h / 2, 1);
+		}
+	} else {
+		GLenum format, internalFormat;
+		const GLint *swizzle;
+		getPixelFormat(image.channels, format, internalFormat, swizzle);
+		if (swizzle != nullptr)
+			t.setParameter(GL_TEXTURE_SWIZZLE_RGBA, swizzle);
 
-			try {
-				p.attachShader(loadShader(line));
-			} catch (ResourceNotFoundException &e) {
-				throw InvalidResourceException(name, string("Missing shader: ") + e.what());
-			}
+		t.storage(image.levels, internalFormat, image.width, image.height);
+		for (int level = 0, w = image.width, h = image.height; level < levels; ++level) {
+			t.setSubImage(level, 0, 0, w, h, format, GL_UNSIGNED_BYTE, pixels);
+			pixels += static_cast<size_t>(w) * h * image.channels;
+			w = std::max(w / 2, 1);
+			h = std::max(h / 2, 1);
 		}
 	}
+	if (image.generateMipmaps)
+		glGenerateTextureMipmap(t.getId());
 
-	try {
-		p.link();
-#ifndef NDEBUG
-		p.validate();
-#endif
-	} catch (ShaderException &e) {
-		// TODO log error
-		std::cerr << p.getInfoLog() << std::flush;
-		throw;
+	if (staged) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		mUploadRing->fence(image.pixels.get());
 	}
+	return t;
+}
 
-#ifndef NDEBUG
-	// TODO check p.getInfoLog()
-#endif
+/**
+ * @brief Loads a texture.
+ *
+ * Cooked textures are uploaded as they are. Other images are uploaded while
+ * they are decoded if streaming is enabled (see
+ * ResourceLoader::setTextureStreamingThreshold).
+ *
+ * @param name The name of the resource.
+ * @return The texture.
+ * @throws ResourceNotFoundException If the resource does not exist or could not be opened.
+ * @throws InvalidResourceException If the resource could not be decoded.
+ */
+Texture ResourceLoader::loadTexture(const string &name) const
+{
+	Image image;
+	if (takePredecoded(name, image, true))
+		return createTexture(image);
 
-	return p;
+	const ResourceWatcher::Clock::time_point start = ResourceWatcher::Clock::now();
+	ResourceView cooked = mapCookedTexture(name);
+	if (!cooked.empty()) {
+		image = parseCookedTexture(name + ".dds", cooked);
+	} else if (mStreamingThreshold > 0) {
+		// streamed while decoding, so there is nothing to decode ahead
+		return streamTexture(name);
+	} else {
+		image = decodeImage(name);
+	}
+	recordAccess(true, name, getImageSize(image), start);
+	return createTexture(image);
 }
 
-shared_ptr<const Program> ResourceLoader::getShaderProgram(const string &name)
+static int peekImage(void *user, int width, int height, int channels)
 {
-	return programCache.get(name);
+	*static_cast<size_t*>(user) = static_cast<size_t>(width) * height * channels;
+	// stop before anything is decoded
+	return 0;
+}
+
+static int skipRows(void *, int, int, const unsigned char *)
+{
+	return 0;
+}
+
+// seed of the second hash telling collisions from equal content
+static const std::uint64_t CHECK_SEED = 0x5bd1e9955bd1e995ull;
+
+/**
+ * @brief Gets the key textures with equal content share in the cache.
+ *
+ * Byte-identical files are found by the hash of the file. Otherwise the image
+ * is decoded and the hash of its pixels is used, so re-encoded copies are
+ * found too, and the decoded image is handed to the cache for the load.
+ * Images streamed while decoding are only found by the hash of their file.
+ * Each key is checked against the size and a second hash of its content, so
+ * different content with the same hash is not shared.
+ *
+ * @param load Receives the function uploading the decoded image.
+ * @return The key, or 0 if the file could not be read or the hash collides.
+ */
+std::uint64_t ResourceLoader::getTextureContentKey(const string &name, std::function<Texture()> &load) const
+{
+	ResourceView cooked = mapCookedTexture(name);
+	ResourceView data;
+	try {
+		data = cooked.empty() ? map(name) : cooked;
+	} catch (ResourceNotFoundException&) {
+		// reported by the load
+		return 0;
+	}
+	// cooked textures do not decode to the pixels of their image
+	const std::uint64_t fileSeed = cooked.empty() ? 1 : 2;
+	const std::uint64_t fileKey = contentHash(data.data(), data.size(), fileSeed);
+	const ContentId fileId = {data.size(), contentHash(data.data(), data.size(), fileSeed ^ CHECK_SEED)};
+	// false if the key was computed from other content before, call with mContentKeyMutex locked
+	auto registerId = [this](std::uint64_t key, const ContentId &id){
+		auto it = mContentIds.emplace(key, id).first;
+		return it->second.size == id.size && it->second.check == id.check;
+	};
+	bool fileCollides = false;
+	{
+		std::lock_guard<std::mutex> lock(mContentKeyMutex);
+		auto it = mContentKeys.find(fileKey);
+		if (it != mContentKeys.end()) {
+			if (it->second.first.size == fileId.size && it->second.first.check == fileId.check)
+				return it->second.second;
+			fileCollides = true;
+		}
+	}
+
+	if (cooked.empty() && mStreamingThreshold > 0) {
+		size_t size = 0;
+		SOIL_load_image_rows_from_memory(data.data(), data.size(), SOIL_LOAD_AUTO, &peekImage, &skipRows, &size);
+		if (size >= mStreamingThreshold) {
+			std::lock_guard<std::mutex> lock(mContentKeyMutex);
+			return !fileCollides && registerId(fileKey, fileId) ? fileKey : 0;
+		}
+	}
+
+	Image image;
+	if (!takePredecoded(name, image, true)) {
+		const ResourceWatcher::Clock::time_point start = ResourceWatcher::Clock::now();
+		image = cooked.empty() ? decodeImage(name) : parseCookedTexture(name + ".dds", cooked);
+		recordAccess(true, name, getImageSize(image), start);
+	}
+	// the mip levels follow from the first one
+	size_t size = image.compressed ? getCompressedSize(image.width, image.height, image.channels)
+			: static_cast<size_t>(image.width) * image.height * image.channels;
+	std::uint64_t seed = fnv1a(&image.width, sizeof(image.width));
+	seed = fnv1a(&image.height, sizeof(image.height), seed);
+	seed = fnv1a(&image.channels, sizeof(image.channels), seed);
+	seed = fnv1a(&image.compressed, sizeof(image.compressed), seed);
+	const std::uint64_t key = contentHash(image.pixels.get(), size, seed);
+	const ContentId id = {size, contentHash(image.pixels.get(), size, seed ^ CHECK_SEED)};
+	load = [this,image](){ return createTexture(image); };
+
+	std::lock_guard<std::mutex> lock(mContentKeyMutex);
+	if (!registerId(key, id)) {
+		utl::warning("Content hash of %s collides with another texture, not sharing it", name.c_str());
+		return 0;
+	}
+	if (!fileCollides && mContentKeys.emplace(fileKey, std::make_pair(fileId, key)).second)
+		mFileKeys.emplace(key, fileKey);
+	return key;
+}
+
+/**
+ * @brief Forgets a content key once no texture with its content is cached.
+ *
+ * Keeps the content keys from growing with every texture edited, evicted or
+ * reloaded during the run. Called by the texture cache with its lock held.
+ */
+void ResourceLoader::dropTextureContentKey(std::uint64_t key) const
+{
+	std::lock_guard<std::mutex> lock(mContentKeyMutex);
+	mContentIds.erase(key);
+	auto range = mFileKeys.equal_range(key);
+	for (auto it = range.first; it != range.second; ++it)
+		mContentKeys.erase(it->second);
+	mFileKeys.erase(range.first, range.second);
+}
+
+/**
+ * @brief Takes the image decoded ahead for a replayed access trace.
+ *
+ * @param wait Whether to wait for the decoding if it is not done yet. The
+ *        workers must not wait, the decoding may be queued behind them.
+ * @return <code>false</code> if the texture is not decoded ahead (yet).
+ */
+bool ResourceLoader::takePredecoded(const string &name, Image &image, bool wait) const
+{
+	std::future<Image> predecoded;
+	{
+		std::lock_guard<std::mutex> lock(mTraceMutex);
+		auto it = mPredecoded.find(name);
+		if (it == mPredecoded.end() || (!wait
+				&& it->second.wait_for(std::chrono::seconds(0)) != std::future_status::ready))
+			return false;
+		predecoded = std::move(it->second);
+		mPredecoded.erase(it);
+	}
+	const ResourceWatcher::Clock::time_point start = ResourceWatcher::Clock::now();
+	image = predecoded.get();
+	recordAccess(true, name, getImageSize(image), start);
+	return true;
+}
+
+/**
+ * @brief State of ResourceLoader::streamTexture shared with the decoder.
+ *
+ * The callbacks are called from C code, so they must not throw. Exceptions
+ * are stored instead and decoding is stopped.
+ */
+struct TextureStream {
+	size_t threshold;
+	Image image; // holds the pixels of images below the threshold
+	unique_ptr<Texture> texture; // receives the rows of the other images
+	GLenum format;
+	std::exception_ptr error;
+};
+
+static int beginTextureStream(void *user, int width, int height, int channels)
+{
+	TextureStream &stream = *static_cast<TextureStream*>(user);
+	try {
+		stream.image.width = width;
+		stream.image.height = height;
+		stream.image.channels = channels;
+		size_t size = static_cast<size_t>(width) * height * channels;
+		size_t chain = mipmap_chain_size(width, height, channels, &stream.image.levels);
+		if (size < stream.threshold) {
+			// leave room for the mip levels, like ResourceLoader::decodeImage
+			auto all = static_cast<unsigned char*>(std::malloc(size + chain));
+			if (all == nullptr)
+				throw std::bad_alloc();
+			stream.image.pixels = shared_ptr<unsigned char>(all, SOIL_free_image_data);
+			return 1;
+		}
+
+		GLenum internalFormat;
+		const GLint *swizzle;
+		getPixelFormat(channels, stream.format, internalFormat, swizzle);
+		stream.texture.reset(new Texture(Texture::Target::T_2D));
+		stream.texture->setParameter(GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		if (swizzle != nullptr)
+			stream.texture->setParameter(GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+		stream.texture->storage(stream.image.levels, internalFormat, width, height);
+		return 1;
+	} catch (...) {
+		stream.error = std::current_exception();
+		return 0;
+	}
+}
+
+static int streamTextureRows(void *user, int y, int count, const unsigned char *pixels)
+{
+	TextureStream &stream = *static_cast<TextureStream*>(user);
+	try {
+		if (stream.texture) {
+			stream.texture->setSubImage(0, 0, y, stream.image.width, count, stream.format, GL_UNSIGNED_BYTE, pixels);
+		} else {
+			size_t row = static_cast<size_t>(stream.image.width) * stream.image.channels;
+			std::memcpy(stream.image.pixels.get() + row * y, pixels, row * count);
+		}
+		return 1;
+	} catch (...) {
+		stream.error = std::current_exception();
+		return 0;
+	}
+}
+
+/**
+ * @brief Uploads an image resource while it is decoded.
+ *
+ * The rows of images of at least ResourceLoader::setTextureStreamingThreshold
+ * bytes are uploaded in batches as they are decoded, so the decoded image is
+ * never held in memory as a whole. Their mip levels are generated by OpenGL
+ * afterwards. Smaller images are collected and uploaded like
+ * ResourceLoader::createTexture does. Must be called from the thread owning
+ * the OpenGL context.
+ *
+ * @param name The name of the resource.
+ * @return The texture.
+ * @throws ResourceNotFoundException If the resource does not exist or could not be opened.
+ * @throws InvalidResourceException If the resource could not be decoded.
+ */
+Texture ResourceLoader::streamTexture(const string &name) const
+{
+	ResourceView data = map(name);
+
+	TextureStream stream;
+	stream.threshold = mStreamingThreshold;
+	// the rows of the batches are tightly packed
+	UnpackAlignment alignment(1);
+	int ok = SOIL_load_image_rows_from_memory(data.data(), data.size(), SOIL_LOAD_AUTO,
+			&beginTextureStream, &streamTextureRows, &stream);
+	if (stream.error)
+		std::rethrow_exception(stream.error);
+	if (!ok)
+		throw InvalidResourceException(name, SOIL_last_result());
+
+	if (stream.texture) {
+		glGenerateTextureMipmap(stream.texture->getId());
+		return std::move(*stream.texture);
+	}
+
+	Image &image = stream.image;
+	if (image.levels > 1) {
+		size_t size = static_cast<size_t>(image.width) * image.height * image.channels;
+		mipmap_chain(image.pixels.get(), image.width, image.height, image.channels, 0, image.pixels.get() + size);
+	}
+	return createTexture(image);
+}
+
+/**
+ * @brief Where ResourceLoader::stageTexture decodes an image to.
+ */
+struct StagedImage {
+	UploadRing *ring;
+	Image image;
+	bool full; // the image did not fit into the ring
+};
+
+static int beginStagedImage(void *user, int width, int height, int channels)
+{
+	StagedImage &staged = *static_cast<StagedImage*>(user);
+	Image &image = staged.image;
+	image.width = width;
+	image.height = height;
+	image.channels = channels;
+	mipmap_chain_size(width, height, channels, &image.levels);
+	image.generateMipmaps = true;
+
+	unsigned char *slot = staged.ring->acquire(getImageSize(image));
+	if (slot == nullptr) {
+		staged.full = true;
+		return 0;
+	}
+	UploadRing *ring = staged.ring;
+	image.pixels = shared_ptr<unsigned char>(slot, [ring](unsigned char *p){ ring->release(p); });
+	return 1;
+}
+
+static int stageImageRows(void *user, int y, int count, const unsigned char *pixels)
+{
+	Image &image = static_cast<StagedImage*>(user)->image;
+	size_t row = static_cast<size_t>(image.width) * image.channels;
+	std::memcpy(image.pixels.get() + row * y, pixels, row * count);
+	return 1;
+}
+
+/**
+ * @brief Decompresses a cooked texture from the archive into the upload ring.
+ *
+ * The levels are decompressed block by block into cached memory and copied
+ * into a slot from there, as the decompressor reads back what it wrote.
+ *
+ * @return <code>false</code> if the cooked texture is not compressed or no
+ *         free slot is large enough.
+ * @throws InvalidResourceException If the cooked texture is corrupt.
+ */
+bool ResourceLoader::stageArchivedTexture(const string &name, Image &image) const
+{
+	const string cooked = name + ".dds";
+	std::uint64_t fileSize;
+	bool compressed;
+	if (!mArchive->stat(cooked, fileSize, compressed) || !compressed || fileSize < sizeof(DDS_header))
+		return false;
+
+	try {
+		unsigned char header[sizeof(DDS_header)];
+		mArchive->read(cooked, 0, header, sizeof(header));
+		Image staged = parseCookedHeader(cooked, header, fileSize);
+		size_t size = getImageSize(staged);
+		unsigned char *slot = mUploadRing->acquire(size);
+		if (slot == nullptr)
+			return false;
+		UploadRing *ring = mUploadRing.get();
+		staged.pixels = shared_ptr<unsigned char>(slot, [ring](unsigned char *p){ ring->release(p); });
+		mArchive->read(cooked, sizeof(header), slot, size, true);
+		image = std::move(staged);
+		return true;
+	} catch (InvalidResourceException&) {
+		throw;
+	} catch (std::runtime_error &e) {
+		throw InvalidResourceException(cooked, e.what());
+	}
+}
+
+/**
+ * @brief Decodes an image resource into the upload ring.
+ *
+ * The rows are written into a slot of the ring as they are decoded, so
+ * ResourceLoader::createTexture hands them to OpenGL without any further
+ * copy. The mapping is write combined on most drivers and too slow to read
+ * back, so the mip levels are left to OpenGL. Cooked textures are copied
+ * into the ring as they are, or decompressed into it from the archive.
+ * Without a free slot large enough, this falls back to
+ * ResourceLoader::decodeTexture. May be called from any thread.
+ *
+ * @param name The name of the resource.
+ * @return The decoded image.
+ * @throws ResourceNotFoundException If the resource does not exist or could not be opened.
+ * @throws InvalidResourceException If the resource could not be decoded.
+ */
+Image ResourceLoader::stageTexture(const string &name) const
+{
+	Image predecoded;
+	if (takePredecoded(name, predecoded, false))
+		return predecoded;
+	if (!mUploadRing)
+		return decodeTexture(name);
+	if (mCookedTextures && mArchive && stageArchivedTexture(name, predecoded))
+		return predecoded;
+
+	ResourceView cooked = mapCookedTexture(name);
+	if (!cooked.empty()) {
+		Image image = parseCookedTexture(name + ".dds", cooked);
+		size_t size = getImageSize(image);
+		unsigned char *slot = mUploadRing->acquire(size);
+		if (slot != nullptr) {
+			std::memcpy(slot, image.pixels.get(), size);
+			UploadRing *ring = mUploadRing.get();
+			image.pixels = shared_ptr<unsigned char>(slot, [ring](unsigned char *p){ ring->release(p); });
+		}
+		return image;
+	}
+
+	ResourceView data = map(name);
+	StagedImage staged;
+	staged.ring = mUploadRing.get();
+	staged.full = false;
+	if (SOIL_load_image_rows_from_memory(data.data(), data.size(), SOIL_LOAD_AUTO,
+			&beginStagedImage, &stageImageRows, &staged))
+		return staged.image;
+	if (!staged.full)
+		throw InvalidResourceException(name, SOIL_last_result());
+	return decodeImage(name);
+}
+
+/**
+ * @brief Loads a texture in the background.
+ *
+ * The resource is read and decoded by a worker thread, into the upload ring
+ * if it is enabled. The upload to OpenGL
+ * is deferred until ResourceLoader::processUploads is called on the thread
+ * owning the context, so the returned future does not become ready before.
+ *
+ * @param name The name of the resource.
+ * @return A future holding the texture or the exception thrown while loading.
+ */
+std::future<Texture> ResourceLoader::loadTextureAsync(const string &name)
+{
+	PendingUpload job;
+	job.image = mWorkers.submit([this,name](){ return stageTexture(name); });
+	std::future<Texture> result = job.texture.get_future();
+
+	std::lock_guard<std::mutex> lock(mUploadMutex);
+	mUploads.push_back(std::move(job));
+	return result;
+}
+
+shared_ptr<const Texture> ResourceLoader::getTexture(const string &name)
+{
+	return textureCache.get(name);
+}
+
+/**
+ * @brief Loads images into the layers of an array texture.
+ *
+ * The images are decoded in parallel and must have the same size and number
+ * of channels. Must be called from the thread owning the OpenGL context.
+ *
+ * @param names The names of the images, one per layer.
+ * @param len The number of layers.
+ * @return The array texture.
+ * @throws ResourceNotFoundException If an image does not exist or could not be opened.
+ * @throws InvalidResourceException If an image could not be decoded or does not match the first one.
+ */
+Texture ResourceLoader::loadArrayTexture(const string names[], size_t len) const
+{
+	if (len == 0)
+		throw std::invalid_argument("array texture without layers");
+
+	std::vector<std::future<Image>> layers;
+	layers.reserve(len);
+	for (size_t i = 0; i < len; ++i) {
+		string name = names[i];
+		// cooked textures have their own level count and format, so layers are always decoded
+		layers.push_back(mWorkers.submit([this,name](){ return decodeImage(name); }));
+	}
+
+	Image first = layers[0].get();
+	Texture t(Texture::Target::T_2D_ARRAY);
+	t.setParameter(GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	UnpackAlignment alignment(1);
+
+	GLenum format, internalFormat;
+	const GLint *swizzle;
+	getPixelFormat(first.channels, format, internalFormat, swizzle);
+	if (swizzle != nullptr)
+		t.setParameter(GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+
+	t.storage(first.levels, internalFormat, first.width, first.height, len);
+	for (size_t i = 0; i < len; ++i) {
+		Image layer = i == 0 ? first : layers[i].get();
+		if (i > 0 && (layer.width != first.width || layer.height != first.height
+				|| layer.channels != first.channels))
+			throw InvalidResourceException(names[i], "layer does not match " + names[0]);
+		const unsigned char *pixels = layer.pixels.get();
+		for (int level = 0, w = layer.width, h = layer.height; level < layer.levels; ++level) {
+			t.setSubImage(level, 0, 0, i, w, h, 1, format, GL_UNSIGNED_BYTE, pixels);
+			pixels += static_cast<size_t>(w) * h * layer.channels;
+			w = std::max(w / 2, 1);
+			h = std::max(h / 2, 1);
+		}
+	}
+	return t;
+}
+
+Texture ResourceLoader::loadArrayTexture(const string &key) const
+{
+	std::vector<string> names;
+	std::istringstream in(key);
+	for (string name; getline(in, name); )
+		names.push_back(name);
+	return loadArrayTexture(names.data(), names.size());
+}
+
+shared_ptr<const Texture> ResourceLoader::getArrayTexture(const string names[], size_t len)
+{
+	// a name never contains a newline, so the joined names are unique
+	string key;
+	for (size_t i = 0; i < len; ++i)
+		key += names[i] + '\n';
+	return arrayTextureCache.get(key);
+}
+
+/**
+ * @brief Resolves a resource named relative to a directory.
+ *
+ * Names starting with a slash are relative to the searchpath instead.
+ */
+static string resolveName(const string &dir, const string &name)
+{
+	return name[0] == '/' ? name.substr(1) : dir + name;
+}
+
+static string getDirectory(const string &name)
+{
+	size_t lastSlash = name.find_last_of('/');
+	return lastSlash == string::npos ? "" : name.substr(0, lastSlash + 1);
+}
+
+/**
+ * @brief Expands the #include directives of a shader source into it.
+ *
+ * @param name The name of the file to expand.
+ * @param stack The files being expanded, to detect include cycles.
+ * @param once The files marked with #pragma once which were expanded.
+ * @param out Receives the expanded source and the files it depends on.
+ */
+void ResourceLoader::expandShader(const string &name, std::vector<string> &stack,
+			std::vector<string> &once, ShaderSource &out) const
+{
+	static const regex includeDirective("\\s*#\\s*include\\s*[\"<]([^\">]+)[\">]\\s*(//.*)?\r?");
+	static const regex onceDirective("\\s*#\\s*pragma\\s+once\\s*(//.*)?\r?");
+
+	if (std::find(once.begin(), once.end(), name) != once.end())
+		return;
+	if (std::find(stack.begin(), stack.end(), name) != stack.end()) {
+		string cycle;
+		for (auto it = std::find(stack.begin(), stack.end(), name); it != stack.end(); ++it)
+			cycle += *it + " -> ";
+		throw InvalidResourceException(stack.front(), "include cycle: " + cycle + name);
+	}
+
+	// source string numbers in compiler messages are indices into the dependencies
+	auto dep = std::find(out.dependencies.begin(), out.dependencies.end(), name);
+	size_t index = dep - out.dependencies.begin();
+	if (dep == out.dependencies.end())
+		out.dependencies.push_back(name);
+
+	std::istringstream in(load(name));
+	const string dir = getDirectory(name);
+	stack.push_back(name);
+	if (stack.size() > 1)
+		out.source += "#line 1 " + std::to_string(index) + "\n";
+
+	std::smatch match;
+	string line;
+	for (size_t lineNumber = 1; getline(in, line); ++lineNumber) {
+		if (line.find('#') == string::npos) {
+			out.source += line + '\n';
+		} else if (regex_match(line, match, includeDirective)) {
+			const string include = resolveName(dir, match[1]);
+			try {
+				expandShader(include, stack, once, out);
+			} catch (ResourceNotFoundException &e) {
+				throw InvalidResourceException(name, string("Missing include: ") + e.what());
+			}
+			out.source += "#line " + std::to_string(lineNumber + 1) + " " + std::to_string(index) + "\n";
+		} else if (regex_match(line, onceDirective)) {
+			once.push_back(name);
+			out.source += '\n';
+		} else {
+			out.source += line + '\n';
+		}
+	}
+	stack.pop_back();
+}
+
+/**
+ * @brief Gets a shader source with all #include directives expanded.
+ *
+ * Included files are named relative to the including file, or relative to
+ * the searchpath if they start with a slash, like the shaders of a program.
+ * Files containing <code>#pragma once</code> are only included the first
+ * time. The expanded sources are cached until ResourceLoader::reloadChanged
+ * finds one of their files modified.
+ *
+ * @param name The name of the shader.
+ * @return The expanded source and the names of all files it was built from,
+ *         starting with the shader itself.
+ * @throws ResourceNotFoundException If the shader does not exist or could not be opened.
+ * @throws InvalidResourceException If an included file is missing or includes itself.
+ */
+shared_ptr<const ResourceLoader::ShaderSource> ResourceLoader::preprocessShader(const string &name) const
+{
+	{
+		std::lock_guard<std::mutex> lock(mShaderSourceMutex);
+		auto it = mShaderSources.find(name);
+		if (it != mShaderSources.end())
+			return it->second;
+	}
+
+	auto expanded = std::make_shared<ShaderSource>();
+	std::vector<string> stack, once;
+	expandShader(name, stack, once, *expanded);
+
+	std::lock_guard<std::mutex> lock(mShaderSourceMutex);
+	mShaderSources[name] = expanded;
+	return expanded;
+}
+
+/**
+ * @brief Drops the cached expansions depending on a file.
+ */
+void ResourceLoader::invalidateShaderSources(const string &name)
+{
+	std::lock_guard<std::mutex> lock(mShaderSourceMutex);
+	for (auto it = mShaderSources.begin(); it != mShaderSources.end(); ) {
+		const std::vector<string> &deps = it->second->dependencies;
+		if (std::find(deps.begin(), deps.end(), name) != deps.end())
+			it = mShaderSources.erase(it);
+		else
+			++it;
+	}
+}
+
+/**
+ * @brief Builds the source of a shader variant.
+ *
+ * A variant is named by the shader followed by the macros to define, each
+ * separated by a space and given as NAME or NAME=VALUE. The definitions are
+ * inserted right after the #version directive.
+ *
+ * @see ResourceLoader::preprocessShader
+ */
+string ResourceLoader::getShaderSource(const string &variant) const
+{
+	std::istringstream in(variant);
+	string name;
+	in >> name;
+	shared_ptr<const ShaderSource> expanded = preprocessShader(name);
+
+	string defines;
+	for (string macro; in >> macro; ) {
+		size_t eq = macro.find('=');
+		defines += "#define " + (eq == string::npos ? macro : macro.substr(0, eq) + " " + macro.substr(eq + 1)) + "\n";
+	}
+	const string &source = expanded->source;
+	if (defines.empty())
+		return source;
+
+	// #version has to be the first directive
+	size_t pos = 0;
+	size_t version = source.find("#version");
+	if (version != string::npos) {
+		pos = source.find('\n', version);
+		pos = pos == string::npos ? source.size() : pos + 1;
+	}
+	size_t line = std::count(source.begin(), source.begin() + pos, '\n') + 1;
+	return source.substr(0, pos) + defines + "#line " + std::to_string(line) + " 0\n" + source.substr(pos);
+}
+
+/**
+ * @brief Gets the names of all files a shader variant is built from.
+ *
+ * If the shader cannot be read, this is just the shader itself, so it is
+ * reloaded once it appears.
+ */
+std::vector<string> ResourceLoader::getShaderDependencies(const string &variant) const
+{
+	string name = variant.substr(0, variant.find(' '));
+	try {
+		return preprocessShader(name)->dependencies;
+	} catch (std::exception&) {
+		return std::vector<string>(1, name);
+	}
+}
+
+/**
+ * @brief Creates a shader variant without compiling it.
+ *
+ * The type of the shader is derived from the extension of the name.
+ *
+ * @see ResourceLoader::getShaderSource
+ */
+Shader ResourceLoader::createShader(const string &variant) const
+{
+	Shader::Type type;
+	const string name = variant.substr(0, variant.find(' '));
+	string ext = name.substr(name.find_last_of('.'));
+
+	if (ext == ".vert")
+		type = Shader::Type::VERTEX;
+	else if (ext == ".frag")
+		type = Shader::Type::FRAGMENT;
+	else if (ext == ".geom")
+		type = Shader::Type::GEOMETRY;
+	else if (ext == ".tcs")
+		type = Shader::Type::TESS_CONTROL;
+	else if (ext == ".tes")
+		type = Shader::Type::TESS_EVALUATION;
+
+	std::string source = getShaderSource(variant);
+	return Shader(type, source);
+}
+
+Shader ResourceLoader::loadShader(const string &name) const
+{
+	Shader s = createShader(name);
+	try {
+		s.compile();
+	} catch (ShaderException &e) {
+		utl::severe("%s: %s", name.c_str(), s.getInfoLog().c_str());
+		throw;
+	}
+
+#ifndef NDEBUG
+	string log = s.getInfoLog();
+	if (!log.empty())
+		utl::warning("%s: %s", name.c_str(), log.c_str());
+#endif
+
+	return s;
+}
+
+/**
+ * @brief Creates a shader and starts compiling it.
+ *
+ * The function does not wait for the compiler, so the driver may compile
+ * several shaders in parallel. Use checkShader before using the shader.
+ */
+Shader ResourceLoader::compileShader(const string &name) const
+{
+	Shader s = createShader(name);
+	glCompileShader(s.getId());
+	return s;
+}
+
+/**
+ * @brief Checks that a shader from ResourceLoader::compileShader compiled successfully.
+ *
+ * @throws InvalidResourceException If the shader could not be compiled.
+ */
+static void checkShader(const Shader &s, const string &name)
+{
+	GLint status = GL_FALSE;
+	glGetShaderiv(s.getId(), GL_COMPILE_STATUS, &status);
+	if (status != GL_TRUE) {
+		utl::severe("%s: %s", name.c_str(), s.getInfoLog().c_str());
+		throw InvalidResourceException(name, "compilation failed");
+	}
+}
+
+/**
+ * @brief Waits until the driver finished compiling or linking.
+ *
+ * Without GL_KHR_parallel_shader_compile this returns immediately, the
+ * status queries following it block instead.
+ *
+ * @param objects The shaders or programs to wait for.
+ * @param programs Whether the objects are programs.
+ */
+static void waitForCompletion(const std::vector<GLuint> &objects, bool programs)
+{
+	if (!GLTools::isAvailable("GL_KHR_parallel_shader_compile")
+			&& !GLTools::isAvailable("GL_ARB_parallel_shader_compile"))
+		return;
+
+	for (size_t i = 0; i < objects.size(); ) {
+		GLint done = GL_FALSE;
+		if (programs)
+			glGetProgramiv(objects[i], GL_COMPLETION_STATUS_KHR, &done);
+		else
+			glGetShaderiv(objects[i], GL_COMPLETION_STATUS_KHR, &done);
+
+		if (done)
+			++i;
+		else
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+}
+
+shared_ptr<const Shader> ResourceLoader::getShader(const string &name)
+{
+	shared_ptr<const Shader> s = shaderCache.get(name);
+	checkShader(*s, name);
+	return s;
+}
+
+/**
+ * @brief Reads the shader variants of a program.
+ *
+ * Each line of a program lists one shader relative to the directory of the
+ * program, or relative to the searchpath if it starts with a slash. The
+ * shader may be followed by macros to define for it (see
+ * ResourceLoader::getShaderSource). Anything after a hash sign is a comment.
+ *
+ * @param name The name of the program.
+ * @return The shader variants.
+ * @throws ResourceNotFoundException If the program does not exist or could not be opened.
+ */
+std::vector<string> ResourceLoader::parseShaderProgram(const string &name) const
+{
+	const string dir = getDirectory(name);
+	unique_ptr<istream> in = open(name);
+
+	std::vector<string> shaders;
+	std::string line;
+	while (getline(*in, line)) {
+		std::istringstream fields(line.substr(0, line.find('#')));
+		string shader;
+		if (fields >> shader) {
+			string variant = resolveName(dir, shader);
+			for (string macro; fields >> macro; )
+				variant += ' ' + macro;
+			shaders.push_back(variant);
+		}
+	}
+	return shaders;
+}
+
+/**
+ * @brief Computes the key of a program in the program binary cache.
+ *
+ * The key covers the program, the expanded sources of all its shaders and
+ * the OpenGL implementation, so changing any of them, or any included file,
+ * leads to a cache miss.
+ */
+std::uint64_t ResourceLoader::hashShaderProgram(const string &name, const std::vector<string> &shaders) const
+{
+	std::uint64_t hash = fnv1a(load(name));
+	for (const string &shader : shaders) {
+		hash = fnv1a(shader, hash);
+		try {
+			hash = fnv1a(getShaderSource(shader), hash);
+		} catch (ResourceNotFoundException &e) {
+			throw InvalidResourceException(name, string("Missing shader: ") + e.what());
+		}
+	}
+	for (GLenum pname : {GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION}) {
+		const GLubyte *str = glGetString(pname);
+		hash = fnv1a(str != nullptr ? reinterpret_cast<const char*>(str) : "", hash);
+	}
+	return hash;
+}
+
+struct ProgramBinaryHeader {
+	char magic[4];
+	GLenum format;
+	std::uint64_t length;
+};
+
+static const char PROGRAM_BINARY_MAGIC[4] = {'S', 'S', 'A', 'P'};
+
+/**
+ * @brief Replaces a program by a binary from the program binary cache.
+ *
+ * @return <code>true</code> if the program is linked successfully,
+ *         <code>false</code> if there is no binary or the driver rejected it.
+ */
+static bool loadProgramBinary(Program &p, const string &path)
+{
+	std::unique_ptr<MappedFile> file;
+	try {
+		file.reset(new MappedFile(path));
+	} catch (std::system_error&) {
+		return false;
+	}
+
+	ProgramBinaryHeader header;
+	if (file->size() < sizeof(header))
+		return false;
+	std::memcpy(&header, file->data(), sizeof(header));
+	if (std::memcmp(header.magic, PROGRAM_BINARY_MAGIC, sizeof(header.magic)) != 0
+			|| header.length != file->size() - sizeof(header))
+		return false;
+
+	glProgramBinary(p.getId(), header.format, file->data() + sizeof(header),
+				static_cast<GLsizei>(header.length));
+	GLint status = GL_FALSE;
+	glGetProgramiv(p.getId(), GL_LINK_STATUS, &status);
+	return status == GL_TRUE;
+}
+
+/**
+ * @brief Stores the binary of a linked program in the program binary cache.
+ */
+static void saveProgramBinary(const Program &p, const string &path)
+{
+	GLint length = 0;
+	glGetProgramiv(p.getId(), GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	std::vector<char> binary(length);
+	ProgramBinaryHeader header;
+	std::memcpy(header.magic, PROGRAM_BINARY_MAGIC, sizeof(header.magic));
+	glGetProgramBinary(p.getId(), length, &length, &header.format, binary.data());
+	header.length = length;
+
+	// write to a temporary file first, so no other process reads a partial binary
+	string tmp = path + ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(binary.data(), length);
+		if (!out.good()) {
+			utl::warning("Could not write program binary %s", tmp.c_str());
+			return;
+		}
+	}
+	std::rename(tmp.c_str(), path.c_str());
+}
+
+/**
+ * @brief Gets the names of all resources a shader program is built from.
+ *
+ * @param name The name of the program.
+ * @return The name of the program followed by the names of its shaders and
+ *         the files they include.
+ */
+std::vector<string> ResourceLoader::getShaderProgramDependencies(const string &name) const
+{
+	std::vector<string> dependencies(1, name);
+	for (const string &shader : parseShaderProgram(name)) {
+		for (const string &file : getShaderDependencies(shader)) {
+			if (std::find(dependencies.begin(), dependencies.end(), file) == dependencies.end())
+				dependencies.push_back(file);
+		}
+	}
+	return dependencies;
+}
+
+/**
+ * @brief Gets the path of a program in the program binary cache.
+ *
+ * @return The path, or an empty string if no binary may be used.
+ */
+string ResourceLoader::getProgramBinaryPath(const string &name, const std::vector<string> &shaders) const
+{
+	if (mProgramBinaryDir.empty() || !GLTools::isAvailable("GL_ARB_get_program_binary"))
+		return string();
+
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	if (formats <= 0)
+		return string();
+
+	return mProgramBinaryDir + "/" + toHex(hashShaderProgram(name, shaders)) + ".program";
+}
+
+/**
+ * @brief Loads a shader program.
+ *
+ * @see ResourceLoader::loadShaderPrograms
+ * @param name The name of the program.
+ * @return The linked program.
+ */
+Program ResourceLoader::loadShaderProgram(const string &name) const
+{
+	std::vector<Program> programs = loadShaderPrograms(std::vector<string>(1, name));
+	return std::move(programs.front());
+}
+
+/**
+ * @brief Loads several shader programs at once.
+ *
+ * If a program binary cache is set (see ResourceLoader::setProgramBinaryCache)
+ * and the driver supports program binaries, cached binaries are used instead
+ * of compiling the shaders. For all other programs, the compilation of every
+ * shader is started before waiting for any of them and all programs are
+ * linked before checking the results, so drivers supporting
+ * GL_KHR_parallel_shader_compile can build them on their own threads. The
+ * binaries of these programs are stored in the cache afterwards.
+ *
+ * @param names The names of the programs.
+ * @return The linked programs in the same order.
+ * @throws ResourceNotFoundException If a program does not exist or could not be opened.
+ * @throws InvalidResourceException If a shader of a program does not exist, does not compile
+ *         or if a program does not link.
+ */
+std::vector<Program> ResourceLoader::loadShaderPrograms(const std::vector<string> &names) const
+{
+	typedef std::chrono::steady_clock Clock;
+	const Clock::time_point start = Clock::now();
+
+	struct Build {
+		string binaryPath;
+		std::vector<string> shaderNames;
+		std::vector<shared_ptr<Shader>> shaders;
+		bool cached;
+	};
+
+	std::vector<Program> programs;
+	std::vector<Build> builds(names.size());
+	std::vector<GLuint> pending;
+	programs.reserve(names.size());
+
+	// use cached binaries and start compiling the shaders of all other programs
+	size_t cached = 0;
+	for (size_t i = 0; i < names.size(); ++i) {
+		Build &b = builds[i];
+		b.shaderNames = parseShaderProgram(names[i]);
+		b.binaryPath = getProgramBinaryPath(names[i], b.shaderNames);
+		programs.emplace_back(true);
+
+		b.cached = !b.binaryPath.empty() && loadProgramBinary(programs[i], b.binaryPath);
+		if (b.cached) {
+			++cached;
+			continue;
+		}
+
+		for (const string &shader : b.shaderNames) {
+			try {
+				// the cached shader objects are shared by all programs using them
+				b.shaders.push_back(shaderCache.get(shader));
+			} catch (ResourceNotFoundException &e) {
+				throw InvalidResourceException(names[i], string("Missing shader: ") + e.what());
+			}
+			pending.push_back(b.shaders.back()->getId());
+		}
+	}
+	const Clock::time_point compileStart = Clock::now();
+
+	// link all programs once their shaders are compiled
+	waitForCompletion(pending, false);
+	pending.clear();
+	for (size_t i = 0; i < names.size(); ++i) {
+		if (builds[i].cached)
+			continue;
+		GLuint id = programs[i].getId();
+		for (size_t j = 0; j < builds[i].shaders.size(); ++j) {
+			checkShader(*builds[i].shaders[j], builds[i].shaderNames[j]);
+			programs[i].attachShader(*builds[i].shaders[j]);
+		}
+		if (!builds[i].binaryPath.empty())
+			glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glLinkProgram(id);
+		pending.push_back(id);
+	}
+
+	waitForCompletion(pending, true);
+	for (size_t i = 0; i < names.size(); ++i) {
+		if (builds[i].cached)
+			continue;
+		GLint status = GL_FALSE;
+		glGetProgramiv(programs[i].getId(), GL_LINK_STATUS, &status);
+		if (status != GL_TRUE) {
+			utl::severe("%s: %s", names[i].c_str(), programs[i].getInfoLog().c_str());
+			throw InvalidResourceException(names[i], "linking failed");
+		}
+		if (!builds[i].binaryPath.empty())
+			saveProgramBinary(programs[i], builds[i].binaryPath);
+	}
+
+#ifndef NDEBUG
+	for (Program &p : programs)
+		p.validate();
+#endif
+
+	const Clock::time_point end = Clock::now();
+	utl::info("Loaded %zu programs: %zu from binary cache in %.2f ms, %zu compiled in %.2f ms",
+				names.size(), cached,
+				std::chrono::duration<double,std::milli>(compileStart - start).count(),
+				names.size() - cached,
+				std::chrono::duration<double,std::milli>(end - compileStart).count());
+	return programs;
+}
+
+shared_ptr<const Program> ResourceLoader::getShaderProgram(const string &name)
+{
+	return programCache.get(name);
+}
+
+/**
+ * @brief Uploads textures decoded by ResourceLoader::loadTextureAsync.
+ *
+ * Uploads are done in request order as long as the image is decoded and the
+ * budget is not exhausted. An upload started within the budget is always
+ * completed, so the budget may be exceeded by one upload. Must be called from
+ * the thread owning the OpenGL context, typically once per frame.
+ *
+ * @param budget The time in seconds which may be spent on uploads.
+ * @return The number of uploads still pending.
+ */
+size_t ResourceLoader::processUploads(double budget)
+{
+	typedef std::chrono::steady_clock Clock;
+	const Clock::time_point deadline = Clock::now()
+			+ std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(budget));
+
+	if (mUploadRing)
+		mUploadRing->retire();
+
+	std::deque<PendingUpload> jobs;
+	{
+		std::lock_guard<std::mutex> lock(mUploadMutex);
+		jobs.swap(mUploads);
+	}
+
+	std::deque<PendingUpload> remaining;
+	for (PendingUpload &job : jobs) {
+		if (Clock::now() >= deadline
+				|| job.image.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+			remaining.push_back(std::move(job));
+			continue;
+		}
+		try {
+			job.texture.set_value(createTexture(job.image.get()));
+		} catch (...) {
+			job.texture.set_exception(std::current_exception());
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(mUploadMutex);
+	for (PendingUpload &job : mUploads)
+		remaining.push_back(std::move(job));
+	mUploads.swap(remaining);
+	return mUploads.size();
+}
+
+/**
+ * @brief Starts watching the resources for modifications.
+ *
+ * Modified resources are reloaded by ResourceLoader::reloadChanged. From now
+ * on, files are read into memory instead of mapped, as they may be modified
+ * while they are read. Call it before loading resources. Not available if the
+ * resources are read from an archive.
+ */
+void ResourceLoader::enableHotReload()
+{
+	if (mArchive) {
+		utl::warning("Hot reload is not available for resource archives");
+		return;
+	}
+	if (!mWatcher)
+		mWatcher.reset(new ResourceWatcher(mSearchpath));
+}
+
+static void logReload(const string &name, ResourceWatcher::Clock::time_point modified)
+{
+	utl::info("Reloaded %s %.1f ms after modification", name.c_str(),
+				std::chrono::duration<double,std::milli>(ResourceWatcher::Clock::now() - modified).count());
+}
+
+/**
+ * @brief Reloads cached resources modified since the last call.
+ *
+ * The new objects replace the cached ones in place, so every holder of a
+ * resource sees the new version. Textures are decoded in background and
+ * replaced by a later call once ResourceLoader::processUploads uploaded
+ * them. Shader programs are rebuilt if the program or any of its shaders
+ * changed. If a resource fails to reload, the old version is kept.
+ *
+ * Must be called from the thread owning the OpenGL context, typically once
+ * per frame after ResourceLoader::processUploads.
+ */
+void ResourceLoader::reloadChanged()
+{
+	if (!mWatcher)
+		return;
+
+	for (auto it = mReloads.begin(); it != mReloads.end(); ) {
+		if (it->texture.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+			++it;
+			continue;
+		}
+		try {
+			textureCache.replace(it->name, it->texture.get());
+			logReload(it->name, it->time);
+		} catch (std::exception &e) {
+			utl::warning("Could not reload %s: %s", it->name.c_str(), e.what());
+		}
+		it = mReloads.erase(it);
+	}
+
+	std::vector<ResourceWatcher::Change> changes = mWatcher->poll();
+	if (changes.empty())
+		return;
+
+	std::vector<string> arrayTextures = arrayTextureCache.getNames();
+	std::vector<string> programs = programCache.getNames();
+	std::vector<std::vector<string>> dependencies;
+	for (const string &program : programs) {
+		try {
+			dependencies.push_back(getShaderProgramDependencies(program));
+		} catch (std::exception&) {
+			dependencies.push_back(std::vector<string>());
+		}
+	}
+
+	std::vector<bool> programChanged(programs.size(), false);
+	std::vector<ResourceWatcher::Clock::time_point> programModified(programs.size());
+
+	// the dependencies before the change decide what is affected by it
+	std::vector<string> shaders = shaderCache.getNames();
+	std::vector<std::vector<string>> shaderDependencies;
+	for (const string &shader : shaders)
+		shaderDependencies.push_back(getShaderDependencies(shader));
+	std::vector<bool> shaderChanged(shaders.size(), false);
+	std::vector<ResourceWatcher::Clock::time_point> shaderModified(shaders.size());
+
+	for (const ResourceWatcher::Change &change : changes) {
+		invalidateShaderSources(change.name);
+		{
+			// prefetched content is outdated
+			std::lock_guard<std::mutex> lock(mPrefetchMutex);
+			mPrefetched.erase(mSearchpath + "/" + change.name);
+			mPrefetched.erase(mCookedDir + "/" + change.name + ".dds");
+		}
+
+		if (textureCache.contains(change.name))
+			mReloads.push_back(PendingReload{change.name, change.time, loadTextureAsync(change.name)});
+
+		for (const string &key : arrayTextures) {
+			if (("\n" + key).find("\n" + change.name + "\n") == string::npos)
+				continue;
+			try {
+				arrayTextureCache.replace(key, loadArrayTexture(key));
+				logReload(change.name, change.time);
+			} catch (std::exception &e) {
+				utl::warning("Could not reload %s: %s", change.name.c_str(), e.what());
+			}
+		}
+
+		for (size_t i = 0; i < shaders.size(); ++i) {
+			const std::vector<string> &deps = shaderDependencies[i];
+			if (!shaderChanged[i] && std::find(deps.begin(), deps.end(), change.name) != deps.end()) {
+				shaderChanged[i] = true;
+				shaderModified[i] = change.time;
+			}
+		}
+
+		for (size_t i = 0; i < programs.size(); ++i) {
+			const std::vector<string> &deps = dependencies[i];
+			if (!programChanged[i] && std::find(deps.begin(), deps.end(), change.name) != deps.end()) {
+				programChanged[i] = true;
+				programModified[i] = change.time;
+			}
+		}
+	}
+
+	// programs are relinked with the reloaded shaders
+	for (size_t i = 0; i < shaders.size(); ++i) {
+		if (!shaderChanged[i])
+			continue;
+		try {
+			Shader s = compileShader(shaders[i]);
+			checkShader(s, shaders[i]);
+			shaderCache.replace(shaders[i], std::move(s));
+			logReload(shaders[i], shaderModified[i]);
+		} catch (std::exception &e) {
+			utl::warning("Could not reload %s: %s", shaders[i].c_str(), e.what());
+		}
+	}
+
+	for (size_t i = 0; i < programs.size(); ++i) {
+		if (!programChanged[i])
+			continue;
+		try {
+			programCache.replace(programs[i], loadShaderProgram(programs[i]));
+			logReload(programs[i], programModified[i]);
+		} catch (std::exception &e) {
+			utl::warning("Could not reload %s: %s", programs[i].c_str(), e.what());
+		}
+	}
+}
+
+/**
+ * @brief Sets how many bytes of unused textures are kept in memory.
+ *
+ * @see ResourceCache
+ */
+void ResourceLoader::setTextureCacheBudget(size_t bytes)
+{
+	textureCache.setBudget(bytes);
+	arrayTextureCache.setBudget(bytes);
+}
+
+/**
+ * @brief Sets how many bytes of unused shaders and programs are kept in memory.
+ *
+ * @see ResourceCache
+ */
+void ResourceLoader::setProgramCacheBudget(size_t bytes)
+{
+	programCache.setBudget(bytes);
+	shaderCache.setBudget(bytes);
+}
+
+/**
+ * @brief Shares one texture between names of images with equal content.
+ *
+ * Loading a texture not cached yet hashes its file, and decodes it if the
+ * file is new. Textures decoded to the same pixels share one OpenGL texture.
+ *
+ * @see ResourceLoader::getTextureDedupStats
+ */
+void ResourceLoader::enableTextureDedup()
+{
+	textureCache.setContentKey([this](const string &name, std::function<Texture()> &load){
+		return getTextureContentKey(name, load);
+	}, [this](std::uint64_t key){
+		dropTextureContentKey(key);
+	});
+}
+
+/**
+ * @brief Gets how many textures were shared and the memory this saved.
+ */
+DedupStats ResourceLoader::getTextureDedupStats()
+{
+	return textureCache.getDedupStats();
+}
+
+/**
+ * @brief Sets the size from which decoded images are uploaded while decoding.
+ *
+ * ResourceLoader::loadTexture uploads the rows of PNG and JPEG images whose
+ * decoded size is at least the given number of bytes as soon as they are
+ * decoded, keeping only a few rows in memory. Zero disables streaming.
+ * Textures loaded with ResourceLoader::loadTextureAsync are always decoded as
+ * a whole, on a worker thread.
+ */
+void ResourceLoader::setTextureStreamingThreshold(size_t bytes)
+{
+	mStreamingThreshold = bytes;
+}
+
+/**
+ * @brief Lets textures loaded in background be decoded into mapped memory.
+ *
+ * Creates an UploadRing the workers of ResourceLoader::loadTextureAsync
+ * decode into, which ResourceLoader::processUploads uploads from without a
+ * copy on the render thread. Images larger than a slot and images decoded
+ * while all slots are in use are uploaded as before. Must be called from the
+ * thread owning the OpenGL context.
+ *
+ * @param size The size of the ring in bytes.
+ * @param slots The number of images the ring holds at once.
+ */
+void ResourceLoader::enableUploadRing(size_t size, size_t slots)
+{
+	if (!GLTools::isAvailable("GL_ARB_buffer_storage")) {
+		utl::warning("The upload ring requires GL_ARB_buffer_storage");
+		return;
+	}
+	try {
+		mUploadRing.reset(new UploadRing(size, slots));
+	} catch (std::exception &e) {
+		utl::warning("Could not create upload ring: %s", e.what());
+	}
+}
+
+/**
+ * @brief Estimates the video memory of all levels of a texture.
+ */
+size_t ResourceSize<Texture>::estimate(const Texture &texture)
+{
+	static const GLenum componentSizes[] = {
+		GL_TEXTURE_RED_SIZE, GL_TEXTURE_GREEN_SIZE, GL_TEXTURE_BLUE_SIZE,
+		GL_TEXTURE_ALPHA_SIZE, GL_TEXTURE_DEPTH_SIZE, GL_TEXTURE_STENCIL_SIZE
+	};
+
+	GLuint id = texture.getId();
+	GLint levels = 0;
+	glGetTextureParameteriv(id, GL_TEXTURE_IMMUTABLE_LEVELS, &levels);
+
+	size_t size = 0;
+	for (GLint level = 0; level < std::max(levels, 1); ++level) {
+		GLint width = 0, height = 0, depth = 0, compressed = GL_FALSE;
+		glGetTextureLevelParameteriv(id, level, GL_TEXTURE_WIDTH, &width);
+		glGetTextureLevelParameteriv(id, level, GL_TEXTURE_HEIGHT, &height);
+		glGetTextureLevelParameteriv(id, level, GL_TEXTURE_DEPTH, &depth);
+		glGetTextureLevelParameteriv(id, level, GL_TEXTURE_COMPRESSED, &compressed);
+
+		if (compressed) {
+			GLint bytes = 0;
+			glGetTextureLevelParameteriv(id, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &bytes);
+			size += bytes;
+		} else {
+			GLint bits = 0;
+			for (GLenum pname : componentSizes) {
+				GLint b = 0;
+				glGetTextureLevelParameteriv(id, level, pname, &b);
+				bits += b;
+			}
+			size += static_cast<size_t>(width) * height * depth * bits / 8;
+		}
+	}
+	return size;
+}
+
+/**
+ * @brief Estimates the memory of a shader by the length of its source.
+ */
+size_t ResourceSize<Shader>::estimate(const Shader &shader)
+{
+	GLint length = 0;
+	glGetShaderiv(shader.getId(), GL_SHADER_SOURCE_LENGTH, &length);
+	return sizeof(Shader) + length;
+}
+
+/**
+ * @brief Estimates the memory of a linked program by the size of its binary.
+ */
+size_t ResourceSize<Program>::estimate(const Program &program)
+{
+	GLint length = 0;
+	if (GLTools::isAvailable("GL_ARB_get_program_binary"))
+		glGetProgramiv(program.getId(), GL_PROGRAM_BINARY_LENGTH, &length);
+	return length > 0 ? static_cast<size_t>(length) : sizeof(Program);
+}
+
+/**
+ * @brief Sets the directory of the program binary cache.
+ *
+ * The directory is created if it does not exist. An empty string disables
+ * the cache.
+ *
+ * @param dir The directory to store program binaries in.
+ */
+void ResourceLoader::setProgramBinaryCache(const string &dir)
+{
+	if (!dir.empty() && mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+		utl::warning("Could not create %s: %s", dir.c_str(), strerror(errno));
+	mProgramBinaryDir = dir;
+}
+
+/**
+ * @brief Uses the textures cooked by ssacook instead of decoding images.
+ *
+ * Requires GL_EXT_texture_compression_s3tc. Resource archives contain the
+ * cooked textures themselves, the directory is only used if the resources are
+ * read from a directory.
+ *
+ * @param dir The output directory of ssacook.
+ */
+void ResourceLoader::setCookedTextures(const string &dir)
+{
+	if (!GLTools::isAvailable("GL_EXT_texture_compression_s3tc")) {
+		utl::warning("Cooked textures require GL_EXT_texture_compression_s3tc");
+		return;
+	}
+	mCookedDir = dir;
+	mCookedTextures = true;
 }
 
 ResourceNotFoundException::ResourceNotFoundException(const string &file, const string &msg) :
@@ -0,0 +1,45 @@
+#include "resourceview.h"
+
+#include <ios>
+#include <streambuf>
+
+
+ResourceViewBuf::ResourceViewBuf(const ResourceView &view) :
+	mView(view)
+{
+	// the get area is never written, std::streambuf just lacks a const variant
+	char *begin = const_cast<char*>(reinterpret_cast<const char*>(mView.data()));
+	setg(begin, begin, begin + mView.size());
+}
+
+ResourceViewBuf::pos_type ResourceViewBuf::seekoff(off_type off, std::ios_base::seekdir dir,
+			std::ios_base::openmode which)
+{
+	if (!(which & std::ios_base::in))
+		return pos_type(off_type(-1));
+
+	off_type pos;
+	switch (dir) {
+	case std::ios_base::beg:
+		pos = off;
+		break;
+	case std::ios_base::cur:
+		pos = (gptr() - eback()) + off;
+		break;
+	case std::ios_base::end:
+		pos = (egptr() - eback()) + off;
+		break;
+	default:
+		return pos_type(off_type(-1));
+	}
+
+	if (pos < 0 || pos > egptr() - eback())
+		return pos_type(off_type(-1));
+	setg(eback(), eback() + pos, egptr());
+	return pos_type(pos);
+}
+
+ResourceViewBuf::pos_type ResourceViewBuf::seekpos(pos_type pos, std::ios_base::openmode which)
+{
+	return seekoff(off_type(pos), std::ios_base::beg, which);
+}
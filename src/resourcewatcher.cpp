@@ -0,0 +1,150 @@
+#include "resourcewatcher.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#  include <dirent.h>
+#  include <fcntl.h>
+#  include <poll.h>
+#  include <sys/inotify.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#define UTL_LOGGER resources
+#include <utl/logging.h>
+
+using std::string;
+using std::vector;
+
+
+/**
+ * @brief Starts watching a directory and all its subdirectories.
+ *
+ * @param dir The directory to watch.
+ */
+ResourceWatcher::ResourceWatcher(const string &dir) :
+	mDir(dir),
+	mFd(-1),
+	mWakeup{-1, -1}
+{
+#ifdef __linux__
+	mFd = inotify_init1(IN_CLOEXEC);
+	if (mFd < 0 || pipe2(mWakeup, O_CLOEXEC) != 0) {
+		utl::warning("Could not watch %s: %s", dir.c_str(), strerror(errno));
+		return;
+	}
+	addWatches("");
+	mThread = std::thread(&ResourceWatcher::run, this);
+#endif
+}
+
+ResourceWatcher::~ResourceWatcher()
+{
+#ifdef __linux__
+	if (mThread.joinable()) {
+		char c = 0;
+		if (write(mWakeup[1], &c, 1) != 1)
+			utl::warning("Could not stop watching %s", mDir.c_str());
+		mThread.join();
+	}
+	for (int fd : {mFd, mWakeup[0], mWakeup[1]}) {
+		if (fd >= 0)
+			close(fd);
+	}
+#endif
+}
+
+/**
+ * @brief Takes the names of all resources modified since the last call.
+ *
+ * Each name is reported once with the time of its first modification.
+ */
+vector<ResourceWatcher::Change> ResourceWatcher::poll()
+{
+	vector<Change> changes;
+	std::lock_guard<std::mutex> lock(mMutex);
+	changes.swap(mChanges);
+	return changes;
+}
+
+void ResourceWatcher::addWatches(const string &name)
+{
+#ifdef __linux__
+	string path = name.empty() ? mDir : mDir + "/" + name;
+	int wd = inotify_add_watch(mFd, path.c_str(),
+				IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+	if (wd < 0) {
+		utl::warning("Could not watch %s: %s", path.c_str(), strerror(errno));
+		return;
+	}
+	mWatches[wd] = name;
+
+	DIR *dir = opendir(path.c_str());
+	if (dir == nullptr)
+		return;
+	while (struct dirent *e = readdir(dir)) {
+		if (std::strcmp(e->d_name, ".") == 0 || std::strcmp(e->d_name, "..") == 0)
+			continue;
+		bool isDir = e->d_type == DT_DIR;
+		// some file systems do not report the type
+		struct stat st;
+		if (e->d_type == DT_UNKNOWN && lstat((path + "/" + e->d_name).c_str(), &st) == 0)
+			isDir = S_ISDIR(st.st_mode);
+		if (isDir)
+			addWatches(name.empty() ? e->d_name : name + "/" + e->d_name);
+	}
+	closedir(dir);
+#else
+	(void) name;
+#endif
+}
+
+void ResourceWatcher::run()
+{
+#ifdef __linux__
+	alignas(struct inotify_event) char buffer[4096];
+	struct pollfd fds[2] = {{mFd, POLLIN, 0}, {mWakeup[0], POLLIN, 0}};
+
+	for (;;) {
+		if (::poll(fds, 2, -1) < 0 && errno != EINTR)
+			return;
+		if (fds[1].revents)
+			return;
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		ssize_t len = read(mFd, buffer, sizeof(buffer));
+		if (len <= 0)
+			continue;
+
+		Clock::time_point now = Clock::now();
+		for (char *p = buffer; p < buffer + len; ) {
+			struct inotify_event *event = reinterpret_cast<struct inotify_event*>(p);
+			p += sizeof(struct inotify_event) + event->len;
+
+			auto it = mWatches.find(event->wd);
+			if (it == mWatches.end() || event->len == 0)
+				continue;
+			string name = it->second.empty() ? event->name : it->second + "/" + event->name;
+
+			if (event->mask & IN_ISDIR) {
+				if (event->mask & (IN_CREATE | IN_MOVED_TO))
+					addWatches(name);
+			} else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+				// editors often replace files by moving a new file over them
+				std::lock_guard<std::mutex> lock(mMutex);
+				auto known = std::find_if(mChanges.begin(), mChanges.end(),
+							[&name](const Change &c){ return c.name == name; });
+				if (known == mChanges.end())
+					mChanges.push_back(Change{name, now});
+			}
+		}
+	}
+#endif
+}
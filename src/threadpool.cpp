@@ -0,0 +1,78 @@
+#include "threadpool.h"
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// the pool the calling thread is a worker of
+static thread_local const ThreadPool *currentPool = nullptr;
+
+
+/**
+ * @brief Creates a pool of worker threads.
+ *
+ * @param threads The number of workers. If it is zero, one worker per
+ *        hardware thread is created.
+ */
+ThreadPool::ThreadPool(std::size_t threads) :
+	mStop(false)
+{
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+
+	mThreads.reserve(threads);
+	for (std::size_t i = 0; i < threads; ++i)
+		mThreads.emplace_back(&ThreadPool::run, this);
+}
+
+/**
+ * @brief Finishes all queued jobs and joins the workers.
+ */
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStop = true;
+	}
+	mCondition.notify_all();
+	for (std::thread &t : mThreads)
+		t.join();
+}
+
+/**
+ * @brief Checks whether the calling thread is one of the workers.
+ *
+ * A job waiting for other jobs of the same pool may wait forever, as they
+ * are queued behind it.
+ */
+bool ThreadPool::isWorker() const
+{
+	return currentPool == this;
+}
+
+void ThreadPool::post(std::function<void()> &&job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mJobs.push_back(std::move(job));
+	}
+	mCondition.notify_one();
+}
+
+void ThreadPool::run()
+{
+	currentPool = this;
+	for (;;) {
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mCondition.wait(lock, [this](){ return mStop || !mJobs.empty(); });
+			if (mJobs.empty())
+				return;
+			job = std::move(mJobs.front());
+			mJobs.pop_front();
+		}
+		job();
+	}
+}
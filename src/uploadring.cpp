@@ -0,0 +1,127 @@
+#include "uploadring.h"
+
+#include <cassert>
+#include <mutex>
+#include <stdexcept>
+
+using std::size_t;
+
+
+/**
+ * @brief Creates a persistently mapped pixel buffer split into equal slots.
+ *
+ * The buffer stays mapped for the lifetime of the ring, coherently, so any
+ * thread can write into an acquired slot without calling OpenGL. Must be
+ * called from the thread owning the OpenGL context, which requires
+ * GL_ARB_buffer_storage.
+ *
+ * @param size The size of the buffer in bytes.
+ * @param slots The number of slots the buffer is split into.
+ * @throws std::runtime_error If the buffer could not be mapped.
+ */
+UploadRing::UploadRing(size_t size, size_t slots) :
+	mBuffer(0),
+	mData(nullptr),
+	mSlotSize(size / slots),
+	mSlots(slots, Slot{false, nullptr})
+{
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glCreateBuffers(1, &mBuffer);
+	glNamedBufferStorage(mBuffer, mSlotSize * slots, nullptr, flags);
+	mData = static_cast<unsigned char*>(glMapNamedBufferRange(mBuffer, 0, mSlotSize * slots, flags));
+	if (mData == nullptr) {
+		glDeleteBuffers(1, &mBuffer);
+		throw std::runtime_error("could not map upload buffer");
+	}
+}
+
+/**
+ * @brief Unmaps and deletes the buffer.
+ *
+ * No slot may be used anymore. Uploads still reading from the buffer are
+ * not affected, OpenGL deletes it once they are done.
+ */
+UploadRing::~UploadRing()
+{
+	for (Slot &slot : mSlots) {
+		assert(!slot.used);
+		if (slot.fence != nullptr)
+			glDeleteSync(slot.fence);
+	}
+	glUnmapNamedBuffer(mBuffer);
+	glDeleteBuffers(1, &mBuffer);
+}
+
+/**
+ * @brief Reserves a slot to write data into.
+ *
+ * Does not wait for a slot to become free and may be called from any thread.
+ *
+ * @param size The number of bytes to write.
+ * @return The start of the slot, or nullptr if the data does not fit into a
+ *         slot or all slots are in use.
+ */
+unsigned char *UploadRing::acquire(size_t size)
+{
+	if (size > mSlotSize)
+		return nullptr;
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (size_t i = 0; i < mSlots.size(); ++i) {
+		if (!mSlots[i].used && mSlots[i].fence == nullptr) {
+			mSlots[i].used = true;
+			return mData + i * mSlotSize;
+		}
+	}
+	return nullptr;
+}
+
+/**
+ * @brief Gives up a slot returned by UploadRing::acquire.
+ *
+ * If an upload from the slot was fenced, the slot is reused once OpenGL
+ * finished reading it. May be called from any thread.
+ */
+void UploadRing::release(const unsigned char *data)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	Slot &slot = mSlots[getOffset(data) / mSlotSize];
+	assert(slot.used);
+	slot.used = false;
+}
+
+/**
+ * @brief Marks the end of the uploads reading from a slot.
+ *
+ * Must be called from the thread owning the OpenGL context right after
+ * issuing the uploads.
+ */
+void UploadRing::fence(const unsigned char *data)
+{
+	GLsync sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	std::lock_guard<std::mutex> lock(mMutex);
+	Slot &slot = mSlots[getOffset(data) / mSlotSize];
+	if (slot.fence != nullptr)
+		glDeleteSync(slot.fence);
+	slot.fence = sync;
+}
+
+/**
+ * @brief Frees the slots OpenGL finished reading.
+ *
+ * Does not wait for pending uploads. Must be called from the thread owning
+ * the OpenGL context.
+ */
+void UploadRing::retire()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (Slot &slot : mSlots) {
+		if (slot.fence == nullptr)
+			continue;
+		GLenum status = glClientWaitSync(slot.fence, 0, 0);
+		if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+			glDeleteSync(slot.fence);
+			slot.fence = nullptr;
+		}
+	}
+}
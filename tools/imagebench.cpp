@@ -0,0 +1,282 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SOIL.h"
+
+#include "utils.h"
+
+using std::string;
+typedef std::chrono::steady_clock Clock;
+
+
+static bool readFile(const string &path, std::vector<unsigned char> &data)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		return false;
+	data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	return true;
+}
+
+/**
+ * @brief Outcome of a decode: the hash of the pixels or the error message.
+ */
+static string decode(const std::vector<unsigned char> &data, int channels)
+{
+	int width = 0, height = 0, comp = 0;
+	unsigned char *pixels = SOIL_load_image_from_memory(data.data(), static_cast<int>(data.size()),
+			&width, &height, &comp, channels);
+	if (!pixels)
+		return string("error: ") + SOIL_last_result();
+
+	std::uint64_t hash = fnv1a(pixels, static_cast<size_t>(width) * height * (channels ? channels : comp));
+	SOIL_free_image_data(pixels);
+	return toHex(hash);
+}
+
+/**
+ * @brief Rows of a streamed decode, collected into one image.
+ */
+struct Rows {
+	int width = 0, height = 0, channels = 0;
+	// the next row expected, rows have to arrive in order
+	int next = 0;
+	bool ordered = true;
+	std::vector<unsigned char> pixels;
+};
+
+static int beginRows(void *user, int width, int height, int channels)
+{
+	Rows &rows = *static_cast<Rows*>(user);
+	rows.width = width;
+	rows.height = height;
+	rows.channels = channels;
+	return 1;
+}
+
+static int collectRows(void *user, int y, int count, const unsigned char *pixels)
+{
+	Rows &rows = *static_cast<Rows*>(user);
+	if (y != rows.next || count < 1 || y + count > rows.height) {
+		rows.ordered = false;
+		return 0;
+	}
+	const size_t stride = static_cast<size_t>(rows.width) * rows.channels;
+	rows.pixels.resize(stride * rows.height);
+	std::memcpy(rows.pixels.data() + y * stride, pixels, count * stride);
+	rows.next += count;
+	return 1;
+}
+
+static int skipRows(void *, int, int, const unsigned char *)
+{
+	return 1;
+}
+
+/**
+ * @brief Like decode, but decodes the image row by row.
+ *
+ * The rows are hashed like the pixels of a full decode, so both results have
+ * to match. Without forced channels, a full decode reports the channels of
+ * the file even if tRNS added an alpha channel to the pixels, so the rows
+ * have to be compared to a full decode forced to rowChannels.
+ */
+static string decodeRows(const std::vector<unsigned char> &data, int channels, int &rowChannels)
+{
+	Rows rows;
+	int ok = SOIL_load_image_rows_from_memory(data.data(), static_cast<int>(data.size()), channels,
+			&beginRows, &collectRows, &rows);
+	rowChannels = rows.channels ? rows.channels : channels;
+	if (!rows.ordered)
+		return "error: rows out of order";
+	if (!ok)
+		return string("error: ") + SOIL_last_result();
+	if (rows.next != rows.height)
+		return "error: rows missing";
+	return toHex(fnv1a(rows.pixels.data(), rows.pixels.size()));
+}
+
+/**
+ * @brief Decodes all images on several threads at once.
+ *
+ * Every image and a truncated copy of it, to run the error paths as well, is
+ * decoded ITERATIONS times by every thread. All results, including the error
+ * messages, have to match a full decode on a single thread, also when the
+ * threads decode row by row.
+ */
+static int stress(const std::vector<std::vector<unsigned char>> &images, int channels,
+			int iterations, int threads, bool streaming)
+{
+	std::vector<std::vector<unsigned char>> inputs;
+	for (const std::vector<unsigned char> &data : images) {
+		inputs.push_back(data);
+		inputs.push_back(std::vector<unsigned char>(data.begin(), data.begin() + data.size() / 2));
+	}
+	std::vector<string> expected;
+	for (const std::vector<unsigned char> &data : inputs) {
+		int forced = channels;
+		if (streaming)
+			decodeRows(data, channels, forced);
+		expected.push_back(decode(data, forced));
+	}
+
+	std::vector<size_t> mismatches(threads, 0);
+	std::vector<std::thread> workers;
+	Clock::time_point start = Clock::now();
+	for (int t = 0; t < threads; ++t) {
+		workers.emplace_back([&,t](){
+			for (int n = 0; n < iterations; ++n) {
+				// every thread walks the images in a different order
+				for (size_t i = 0; i < inputs.size(); ++i) {
+					size_t j = (i + t) % inputs.size();
+					int forced;
+					string result = streaming ? decodeRows(inputs[j], channels, forced) : decode(inputs[j], channels);
+					if (result != expected[j])
+						++mismatches[t];
+				}
+			}
+		});
+	}
+	for (std::thread &worker : workers)
+		worker.join();
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	size_t total = 0;
+	for (size_t m : mismatches)
+		total += m;
+	std::printf("%zu decodes on %d threads in %.2f s, %zu mismatches\n",
+			inputs.size() * iterations * threads, threads, seconds, total);
+	return total == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = 10;
+	int channels = SOIL_LOAD_AUTO;
+	int threads = 0;
+	bool streaming = false;
+	int first = 1;
+	for (; first < argc && argv[first][0] == '-'; ++first) {
+		if (std::strcmp(argv[first], "-n") == 0 && first + 1 < argc)
+			iterations = std::max(1, std::atoi(argv[++first]));
+		else if (std::strcmp(argv[first], "-c") == 0 && first + 1 < argc)
+			channels = std::atoi(argv[++first]);
+		else if (std::strcmp(argv[first], "-t") == 0 && first + 1 < argc)
+			threads = std::max(1, std::atoi(argv[++first]));
+		else if (std::strcmp(argv[first], "-s") == 0)
+			streaming = true;
+		else
+			break;
+	}
+
+	if (first >= argc) {
+		std::cerr << "usage: " << argv[0] << " [-n ITERATIONS] [-c CHANNELS] [-t THREADS] [-s] IMAGE..." << std::endl
+				  << "Decodes every image ITERATIONS times (default 10) from memory and prints" << std::endl
+				  << "the median and best decode time. CHANNELS forces the number of channels" << std::endl
+				  << "like the loader would (0 keeps the channels of the image)." << std::endl
+				  << "With THREADS, the images are decoded on that many threads at once instead" << std::endl
+				  << "and every result is checked against a decode on a single thread." << std::endl
+				  << "With -s, the images are decoded row by row like large textures are" << std::endl
+				  << "streamed, discarding the rows. The rows are checked against a full decode" << std::endl
+				  << "first, or by every thread together with THREADS." << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (threads > 0) {
+		std::vector<std::vector<unsigned char>> images(argc - first);
+		for (int i = first; i < argc; ++i) {
+			if (!readFile(argv[i], images[i - first])) {
+				std::cerr << "Could not read " << argv[i] << std::endl;
+				return EXIT_FAILURE;
+			}
+		}
+		return stress(images, channels, iterations, threads, streaming);
+	}
+
+	std::printf("%-32s %11s %10s %10s %8s %8s\n", "image", "size", "median ms", "best ms", "MP/s", "MB/s");
+
+	double totalTime = 0.0, totalPixels = 0.0, totalBytes = 0.0;
+	int result = EXIT_SUCCESS;
+	for (int i = first; i < argc; ++i) {
+		std::vector<unsigned char> data;
+		if (!readFile(argv[i], data)) {
+			std::cerr << "Could not read " << argv[i] << std::endl;
+			result = EXIT_FAILURE;
+			continue;
+		}
+
+		if (streaming) {
+			int forced;
+			string rows = decodeRows(data, channels, forced);
+			string expected = decode(data, forced);
+			if (rows != expected) {
+				std::cerr << "Rows of " << argv[i] << " differ from a full decode: "
+						  << rows << " instead of " << expected << std::endl;
+				result = EXIT_FAILURE;
+				continue;
+			}
+		}
+
+		std::vector<double> times;
+		int width = 0, height = 0, comp = 0;
+		for (int n = 0; n < iterations; ++n) {
+			Clock::time_point start = Clock::now();
+			if (streaming) {
+				Rows rows;
+				int ok = SOIL_load_image_rows_from_memory(data.data(), static_cast<int>(data.size()), channels,
+						&beginRows, &skipRows, &rows);
+				times.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+				width = rows.width;
+				height = rows.height;
+				comp = rows.channels;
+				if (ok)
+					continue;
+				std::cerr << "Could not decode " << argv[i] << ": " << SOIL_last_result() << std::endl;
+				result = EXIT_FAILURE;
+				break;
+			}
+			unsigned char *pixels = SOIL_load_image_from_memory(data.data(), static_cast<int>(data.size()),
+					&width, &height, &comp, channels);
+			times.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+			if (!pixels) {
+				std::cerr << "Could not decode " << argv[i] << ": " << SOIL_last_result() << std::endl;
+				result = EXIT_FAILURE;
+				break;
+			}
+			SOIL_free_image_data(pixels);
+		}
+		if (times.size() != static_cast<size_t>(iterations))
+			continue;
+
+		std::sort(times.begin(), times.end());
+		double median = times[times.size() / 2];
+		double megapixels = width * static_cast<double>(height) / 1e6;
+		// decoded bytes, as returned to the caller
+		double megabytes = megapixels * (channels ? channels : comp);
+		totalTime += median;
+		totalPixels += megapixels;
+		totalBytes += megabytes;
+
+		string name = argv[i];
+		if (name.size() > 32)
+			name = "..." + name.substr(name.size() - 29);
+		char size[16];
+		std::snprintf(size, sizeof(size), "%dx%d", width, height);
+		std::printf("%-32s %11s %10.2f %10.2f %8.1f %8.1f\n", name.c_str(), size,
+				median * 1e3, times.front() * 1e3, megapixels / median, megabytes / median);
+	}
+
+	if (totalTime > 0.0)
+		std::printf("%-32s %11s %10.2f %10s %8.1f %8.1f\n", "total", "", totalTime * 1e3, "",
+				totalPixels / totalTime, totalBytes / totalTime);
+	return result;
+}
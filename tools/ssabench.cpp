@@ -0,0 +1,490 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <ftw.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <gtl/ogl/program.h>
+#include <gtl/ogl/texture.h>
+
+#include "config.h"
+#include "defines.h"
+#include "gltools.h"
+#include "resourceloader.h"
+
+using std::size_t;
+using std::string;
+using std::vector;
+typedef std::chrono::steady_clock Clock;
+
+
+#ifdef __GLIBC__
+// count the heap allocations of everything, SOIL and the driver included
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+}
+
+static std::atomic<std::uint64_t> allocations(0);
+static std::atomic<std::uint64_t> allocatedBytes(0);
+
+extern "C" void *malloc(size_t size)
+{
+	++allocations;
+	allocatedBytes += size;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+	++allocations;
+	allocatedBytes += count * size;
+	return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+	++allocations;
+	allocatedBytes += size;
+	return __libc_realloc(ptr, size);
+}
+#else
+static std::atomic<std::uint64_t> allocations(0);
+static std::atomic<std::uint64_t> allocatedBytes(0);
+#endif
+
+/**
+ * @brief The resources the scenarios work on.
+ */
+struct Corpus {
+	vector<string> files;
+	vector<string> textures;
+	vector<string> programs;
+	std::map<string,size_t> sizes;
+};
+
+/**
+ * @brief A part of the resource pipeline to measure.
+ *
+ * The throughput is measured in resources and bytes of the resource files
+ * per second, so scenarios working on the same resources can be compared.
+ */
+struct Scenario {
+	const char *name;
+	const char *description;
+	vector<string> Corpus::*resources;
+	void (*run)(ResourceLoader &loader, const vector<string> &names);
+};
+
+static string root;
+static Corpus corpus;
+
+static bool endsWith(const string &s, const char *suffix)
+{
+	size_t len = std::strlen(suffix);
+	return s.size() > len && s.compare(s.size() - len, len, suffix) == 0;
+}
+
+static int collect(const char *path, const struct stat *st, int type, struct FTW *)
+{
+	if (type == FTW_F) {
+		// resource names are relative to the searched directory
+		string name = string(path).substr(root.size());
+		while (!name.empty() && name[0] == '/')
+			name.erase(0, 1);
+		corpus.files.push_back(name);
+		corpus.sizes[name] = st->st_size;
+		if (name.compare(0, 8, "texture/") == 0 && (endsWith(name, ".png") || endsWith(name, ".jpg")
+				|| endsWith(name, ".jpeg") || endsWith(name, ".tga") || endsWith(name, ".bmp")))
+			corpus.textures.push_back(name);
+		else if (endsWith(name, ".prog"))
+			corpus.programs.push_back(name);
+	}
+	return 0;
+}
+
+static void readFiles(ResourceLoader &loader, const vector<string> &names)
+{
+	for (const string &name : names)
+		loader.load(name);
+}
+
+/**
+ * @brief Reads every resource like ResourceLoader::load did before it mapped the files.
+ */
+static void readFilesStream(ResourceLoader &, const vector<string> &names)
+{
+	for (const string &name : names) {
+		std::ifstream f(root + "/" + name, std::ios::binary);
+		if (!f.good())
+			throw std::runtime_error("could not open " + name);
+		std::stringstream buffer;
+		buffer << f.rdbuf();
+		buffer.str();
+	}
+}
+
+static void prefetchFiles(ResourceLoader &loader, const vector<string> &names)
+{
+	loader.prefetch(names);
+	readFiles(loader, names);
+}
+
+static void decodeTextures(ResourceLoader &loader, const vector<string> &names)
+{
+	for (const string &name : names)
+		loader.decodeTexture(name);
+}
+
+static void decodeTexturesParallel(ResourceLoader &loader, const vector<string> &names)
+{
+	vector<std::future<Image>> images;
+	for (const string &name : names)
+		images.push_back(std::async(std::launch::async, [&loader,name](){ return loader.decodeTexture(name); }));
+	for (std::future<Image> &image : images)
+		image.get();
+}
+
+static void loadTextures(ResourceLoader &loader, const vector<string> &names)
+{
+	vector<gtl::ogl::Texture> textures;
+	for (const string &name : names)
+		textures.push_back(loader.loadTexture(name));
+	// the uploads are only done once the driver finished them
+	glFinish();
+}
+
+static void streamTextures(ResourceLoader &loader, const vector<string> &names)
+{
+	loader.setTextureStreamingThreshold(1);
+	try {
+		loadTextures(loader, names);
+	} catch (...) {
+		loader.setTextureStreamingThreshold(0);
+		throw;
+	}
+	loader.setTextureStreamingThreshold(0);
+}
+
+static void loadTexturesAsync(ResourceLoader &loader, const vector<string> &names)
+{
+	vector<std::future<gtl::ogl::Texture>> pending;
+	for (const string &name : names)
+		pending.push_back(loader.loadTextureAsync(name));
+
+	vector<gtl::ogl::Texture> textures;
+	for (std::future<gtl::ogl::Texture> &texture : pending) {
+		while (texture.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+			loader.processUploads(std::numeric_limits<double>::infinity());
+		textures.push_back(texture.get());
+	}
+	glFinish();
+}
+
+static void linkPrograms(ResourceLoader &loader, const vector<string> &names)
+{
+	vector<gtl::ogl::Program> programs = loader.loadShaderPrograms(names);
+	glFinish();
+}
+
+static const Scenario SCENARIOS[] = {
+	{"read", "read every resource into memory", &Corpus::files, &readFiles},
+	{"read_stream", "read every resource with ifstream and stringstream", &Corpus::files, &readFilesStream},
+	{"prefetch", "prefetch every resource at once, then read them", &Corpus::files, &prefetchFiles},
+	{"decode", "decode every texture on one thread", &Corpus::textures, &decodeTextures},
+	{"decode_parallel", "decode all textures at once, one thread per texture", &Corpus::textures, &decodeTexturesParallel},
+	{"load", "decode and upload every texture", &Corpus::textures, &loadTextures},
+	{"stream", "upload every texture while decoding it", &Corpus::textures, &streamTextures},
+	{"async", "load all textures in background and upload them", &Corpus::textures, &loadTexturesAsync},
+	{"link", "compile and link all shader programs", &Corpus::programs, &linkPrograms},
+};
+
+/**
+ * @brief Creates an OpenGL context without window.
+ *
+ * Mesa's surfaceless platform needs neither a display server nor a GPU, so
+ * the benchmark runs on any Linux box. Other EGL implementations use their
+ * default display.
+ */
+static bool createContext(EGLDisplay &display, EGLContext &context)
+{
+	display = EGL_NO_DISPLAY;
+	const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+			eglGetProcAddress("eglGetPlatformDisplayEXT"));
+	if (getPlatformDisplay != nullptr && extensions != nullptr
+			&& std::strstr(extensions, "EGL_MESA_platform_surfaceless") != nullptr)
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	if (display == EGL_NO_DISPLAY)
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr))
+		return false;
+
+	static const EGLint configAttribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	// the same context version as the game
+	static const EGLint contextAttribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint count = 0;
+	if (!eglBindAPI(EGL_OPENGL_API) || !eglChooseConfig(display, configAttribs, &config, 1, &count)
+			|| count < 1) {
+		eglTerminate(display);
+		return false;
+	}
+	context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+	if (context == EGL_NO_CONTEXT) {
+		eglTerminate(display);
+		return false;
+	}
+	// no surface at all, the benchmark never draws
+	if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		eglDestroyContext(display, context);
+		eglTerminate(display);
+		return false;
+	}
+	return true;
+}
+
+static string quote(const string &s)
+{
+	std::ostringstream out;
+	out << '"';
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			out << '\\' << c;
+		} else if (static_cast<unsigned char>(c) < 0x20) {
+			char escaped[8];
+			std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			out << escaped;
+		} else {
+			out << c;
+		}
+	}
+	out << '"';
+	return out.str();
+}
+
+/**
+ * @brief Resets the peak resident set size of the process to the current one.
+ *
+ * @return <code>false</code> if the kernel does not support it.
+ */
+static bool resetPeakRss()
+{
+	std::FILE *f = std::fopen("/proc/self/clear_refs", "w");
+	if (f == nullptr)
+		return false;
+	bool ok = std::fputs("5", f) >= 0;
+	return std::fclose(f) == 0 && ok;
+}
+
+/**
+ * @brief Runs a scenario once to warm up, then ITERATIONS times measured.
+ *
+ * The allocations are counted per iteration, by all threads. The peak
+ * resident set size is the one of the scenario if it could be reset before,
+ * and the one of the whole process so far otherwise.
+ *
+ * @return The results as JSON object, or an empty string if it failed.
+ */
+static string measure(const Scenario &scenario, ResourceLoader &loader, int iterations)
+{
+	const vector<string> &names = corpus.*scenario.resources;
+	size_t bytes = 0;
+	for (const string &name : names)
+		bytes += corpus.sizes[name];
+
+	vector<double> times;
+	std::uint64_t calls = 0, allocated = 0;
+	bool peakReset = resetPeakRss();
+	try {
+		scenario.run(loader, names);
+		for (int i = 0; i < iterations; ++i) {
+			std::uint64_t callsBefore = allocations, allocatedBefore = allocatedBytes;
+			Clock::time_point start = Clock::now();
+			scenario.run(loader, names);
+			times.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+			calls += allocations - callsBefore;
+			allocated += allocatedBytes - allocatedBefore;
+		}
+	} catch (std::exception &e) {
+		std::cerr << "Scenario " << scenario.name << " failed: " << e.what() << std::endl;
+		return string();
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	std::sort(times.begin(), times.end());
+	double median = times[times.size() / 2];
+	double mean = 0.0;
+	for (double t : times)
+		mean += t;
+	mean /= times.size();
+
+	char buffer[512];
+	std::snprintf(buffer, sizeof(buffer),
+			"\"iterations\": %d, \"items\": %zu, \"bytes\": %zu, "
+			"\"median_ms\": %.3f, \"mean_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f, "
+			"\"items_per_s\": %.2f, \"mb_per_s\": %.2f, "
+			"\"allocations\": %llu, \"allocated_bytes\": %llu, "
+			"\"peak_rss_kb\": %ld, \"peak_rss_of_scenario\": %s",
+			iterations, names.size(), bytes,
+			median * 1e3, mean * 1e3, times.front() * 1e3, times.back() * 1e3,
+			median > 0.0 ? names.size() / median : 0.0, median > 0.0 ? bytes / median / 1e6 : 0.0,
+			static_cast<unsigned long long>(calls / iterations),
+			static_cast<unsigned long long>(allocated / iterations),
+			static_cast<long>(usage.ru_maxrss), peakReset ? "true" : "false");
+	return "{\"name\": " + quote(scenario.name) + ", " + buffer + "}";
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = 5;
+	string output, cooked;
+	vector<string> selected;
+	int first = 1;
+	for (; first < argc && argv[first][0] == '-'; ++first) {
+		if (std::strcmp(argv[first], "-n") == 0 && first + 1 < argc)
+			iterations = std::max(1, std::atoi(argv[++first]));
+		else if (std::strcmp(argv[first], "-s") == 0 && first + 1 < argc)
+			selected.push_back(argv[++first]);
+		else if (std::strcmp(argv[first], "-o") == 0 && first + 1 < argc)
+			output = argv[++first];
+		else if (std::strcmp(argv[first], "-c") == 0 && first + 1 < argc)
+			cooked = argv[++first];
+		else
+			break;
+	}
+
+	if (first + 1 < argc || (first < argc && argv[first][0] == '-')) {
+		std::cerr << "usage: " << argv[0] << " [-n ITERATIONS] [-s SCENARIO]... [-o FILE] [-c COOKED] [DIRECTORY]" << std::endl
+				  << "Runs the scenarios of the resource pipeline on the resources in DIRECTORY" << std::endl
+				  << "(default " << RESOURCE_DIR << ") in an OpenGL context without window and" << std::endl
+				  << "writes the results as JSON to FILE (default stdout). Every scenario is run" << std::endl
+				  << "once to warm up and then ITERATIONS times (default 5). With COOKED, the" << std::endl
+				  << "textures cooked by ssacook into that directory are used. Scenarios:" << std::endl;
+		for (const Scenario &scenario : SCENARIOS)
+			std::fprintf(stderr, "  %-16s %s\n", scenario.name, scenario.description);
+		return EXIT_FAILURE;
+	}
+	root = first < argc ? argv[first] : RESOURCE_DIR;
+	for (const string &name : selected) {
+		if (std::none_of(std::begin(SCENARIOS), std::end(SCENARIOS),
+				[&name](const Scenario &s){ return name == s.name; })) {
+			std::cerr << "Unknown scenario " << name << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (nftw(root.c_str(), &collect, 16, FTW_PHYS) != 0) {
+		std::cerr << "Could not read " << root << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::sort(corpus.files.begin(), corpus.files.end());
+	std::sort(corpus.textures.begin(), corpus.textures.end());
+	std::sort(corpus.programs.begin(), corpus.programs.end());
+
+	EGLDisplay display;
+	EGLContext context;
+	if (!createContext(display, context)) {
+		std::cerr << "Could not create an OpenGL context: EGL error 0x" << std::hex << eglGetError() << std::endl;
+		return EXIT_FAILURE;
+	}
+	glewExperimental = GL_TRUE;
+	GLenum ret = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+	// GLEW built for GLX finds no X display, the OpenGL functions are loaded anyway
+	if (ret == GLEW_ERROR_NO_GLX_DISPLAY)
+		ret = GLEW_OK;
+#endif
+	if (ret != GLEW_OK) {
+		std::cerr << "Could not initialize GLEW: " << glewGetErrorString(ret) << std::endl;
+		return EXIT_FAILURE;
+	}
+	GLTools::checkExtension("GL_ARB_direct_state_access", true);
+	GLTools::checkExtension("GL_ARB_separate_shader_objects", true);
+	GLTools::checkExtension("GL_ARB_buffer_storage", false);
+	GLTools::checkExtension("GL_EXT_texture_compression_s3tc", false);
+	GLTools::checkExtension("GL_KHR_parallel_shader_compile", false);
+	GLTools::checkExtension("GL_ARB_parallel_shader_compile", false);
+	if (GLTools::isExtensionMissing()) {
+		std::cerr << "Required OpenGL extensions are missing." << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	int result = EXIT_SUCCESS;
+	std::ostringstream json;
+	{
+		ResourceLoader loader(root);
+		loader.enableUploadRing(UPLOAD_RING_SIZE, UPLOAD_RING_SLOTS);
+		if (!cooked.empty())
+			loader.setCookedTextures(cooked);
+
+		json << "{\n"
+			 << "  \"renderer\": " << quote(reinterpret_cast<const char*>(glGetString(GL_RENDERER))) << ",\n"
+			 << "  \"version\": " << quote(reinterpret_cast<const char*>(glGetString(GL_VERSION))) << ",\n"
+			 << "  \"resources\": " << quote(root) << ",\n"
+			 << "  \"textures\": " << corpus.textures.size() << ",\n"
+			 << "  \"programs\": " << corpus.programs.size() << ",\n"
+			 << "  \"scenarios\": [";
+		const char *separator = "\n";
+		for (const Scenario &scenario : SCENARIOS) {
+			if (!selected.empty() && std::find(selected.begin(), selected.end(), scenario.name) == selected.end())
+				continue;
+			string measured = measure(scenario, loader, iterations);
+			if (measured.empty()) {
+				result = EXIT_FAILURE;
+				continue;
+			}
+			json << separator << "    " << measured;
+			separator = ",\n";
+		}
+		json << "\n  ]\n}\n";
+	}
+
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(display, context);
+	eglTerminate(display);
+
+	if (output.empty()) {
+		std::cout << json.str();
+	} else {
+		std::ofstream out(output, std::ios::trunc);
+		out << json.str();
+		if (!out.good()) {
+			std::cerr << "Could not write " << output << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	return result;
+}
@@ -0,0 +1,246 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "SOIL.h"
+extern "C" {
+#include "image_DXT.h"
+#include "image_helper.h"
+}
+
+#include "utils.h"
+
+using std::string;
+
+// bump to recook everything after changing the output
+static const char COOKER_VERSION[] = "ssacook 1";
+static const char MANIFEST[] = "manifest.txt";
+
+static string root;
+static std::vector<string> sources;
+
+static bool isImage(const string &name)
+{
+	static const char *const extensions[] = {".png", ".jpg", ".jpeg", ".tga", ".bmp"};
+	string lower = name;
+	for (char &c : lower)
+		c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+	for (const char *ext : extensions) {
+		size_t len = std::strlen(ext);
+		if (lower.size() > len && lower.compare(lower.size() - len, len, ext) == 0)
+			return true;
+	}
+	return false;
+}
+
+static int collect(const char *path, const struct stat *, int type, struct FTW *)
+{
+	if (type == FTW_F) {
+		// resource names are relative to the searched directory
+		string name = string(path).substr(root.size());
+		while (!name.empty() && name[0] == '/')
+			name.erase(0, 1);
+		if (name.compare(0, 8, "texture/") == 0 && isImage(name))
+			sources.push_back(name);
+	}
+	return 0;
+}
+
+static bool readFile(const string &path, std::vector<unsigned char> &data)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		return false;
+	data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	return true;
+}
+
+static bool makeDirectories(const string &path)
+{
+	for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+		string dir = path.substr(0, pos);
+		if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+			return false;
+		if (pos == string::npos)
+			return true;
+	}
+}
+
+/**
+ * @brief Compresses an image and all its mip levels into a DDS file.
+ *
+ * Images with an odd number of channels are stored as DXT1 (BC1), the others
+ * as DXT5 (BC3), like SOIL does when compressing on upload. The levels are
+ * reduced with a 2x2 box filter (see mipmap_chain) down to 1x1, matching the
+ * sizes OpenGL expects.
+ */
+static bool cook(const std::vector<unsigned char> &data, const string &path, string &error)
+{
+	int width, height, channels;
+	unsigned char *img = SOIL_load_image_from_memory(data.data(), static_cast<int>(data.size()),
+				&width, &height, &channels, SOIL_LOAD_AUTO);
+	if (img == nullptr) {
+		error = SOIL_last_result();
+		return false;
+	}
+	// all levels below the first are built at once into a single buffer
+	int levels = 0;
+	std::vector<unsigned char> chain(mipmap_chain_size(width, height, channels, &levels));
+	if (!chain.empty())
+		mipmap_chain(img, width, height, channels, 0, chain.data());
+
+	const bool dxt1 = (channels & 1) == 1;
+	std::vector<unsigned char> blocks;
+	const unsigned char *level = img;
+	for (int i = 0, w = width, h = height; i < levels; ++i) {
+		int size = 0;
+		unsigned char *dxt = dxt1 ? convert_image_to_DXT1(level, w, h, channels, &size)
+				: convert_image_to_DXT5(level, w, h, channels, &size);
+		if (dxt == nullptr) {
+			SOIL_free_image_data(img);
+			error = "compression failed";
+			return false;
+		}
+		blocks.insert(blocks.end(), dxt, dxt + size);
+		std::free(dxt);
+
+		level = i == 0 ? chain.data() : level + w * h * channels;
+		w = std::max(w / 2, 1);
+		h = std::max(h / 2, 1);
+	}
+	SOIL_free_image_data(img);
+
+	DDS_header header;
+	std::memset(&header, 0, sizeof(header));
+	header.dwMagic = ('D' << 0) | ('D' << 8) | ('S' << 16) | (' ' << 24);
+	header.dwSize = 124;
+	header.dwFlags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT
+			| DDSD_LINEARSIZE | DDSD_MIPMAPCOUNT;
+	header.dwWidth = width;
+	header.dwHeight = height;
+	header.dwPitchOrLinearSize = ((width + 3) / 4) * ((height + 3) / 4) * (dxt1 ? 8 : 16);
+	header.dwMipMapCount = levels;
+	header.sPixelFormat.dwSize = 32;
+	header.sPixelFormat.dwFlags = DDPF_FOURCC;
+	header.sPixelFormat.dwFourCC = ('D' << 0) | ('X' << 8) | ('T' << 16)
+			| ((dxt1 ? '1' : '5') << 24);
+	header.sCaps.dwCaps1 = DDSCAPS_TEXTURE | DDSCAPS_COMPLEX | DDSCAPS_MIPMAP;
+
+	// write to a temporary file first, so nobody reads a partial texture
+	string tmp = path + ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(blocks.data()), blocks.size());
+		if (!out.good()) {
+			error = "could not write " + tmp;
+			return false;
+		}
+	}
+	if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+		error = "could not write " + path;
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3) {
+		std::cerr << "usage: " << argv[0] << " OUTPUT DIRECTORY" << std::endl
+				  << "Compresses the images in DIRECTORY/texture into DDS files with all mip" << std::endl
+				  << "levels. A texture named NAME is written to OUTPUT/NAME.dds. Images whose" << std::endl
+				  << "content did not change since the last run are skipped." << std::endl;
+		return EXIT_FAILURE;
+	}
+	const string output = argv[1];
+	root = argv[2];
+
+	if (nftw(root.c_str(), &collect, 16, FTW_PHYS) != 0) {
+		std::cerr << "Could not read " << root << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (!makeDirectories(output)) {
+		std::cerr << "Could not create " << output << ": " << std::strerror(errno) << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// the manifest maps the names of all cooked textures to the hash of their source
+	std::map<string,string> manifest;
+	{
+		std::ifstream in(output + "/" + MANIFEST);
+		string hash, name;
+		while (in >> hash && std::getline(in >> std::ws, name))
+			manifest[name] = hash;
+	}
+
+	std::map<string,string> cooked;
+	size_t skipped = 0, failed = 0;
+	for (const string &name : sources) {
+		std::vector<unsigned char> data;
+		if (!readFile(root + "/" + name, data)) {
+			std::cerr << "Could not read " << name << std::endl;
+			++failed;
+			continue;
+		}
+
+		const string hash = toHex(fnv1a(data.data(), data.size(), fnv1a(COOKER_VERSION)));
+		const string path = output + "/" + name + ".dds";
+		struct stat st;
+		auto it = manifest.find(name);
+		if (it != manifest.end() && it->second == hash && stat(path.c_str(), &st) == 0) {
+			cooked[name] = hash;
+			++skipped;
+			continue;
+		}
+
+		string error;
+		if (!makeDirectories(path.substr(0, path.find_last_of('/')))) {
+			error = std::strerror(errno);
+		} else if (cook(data, path, error)) {
+			cooked[name] = hash;
+			std::cout << "Cooked " << name << std::endl;
+			continue;
+		}
+		std::cerr << "Could not cook " << name << ": " << error << std::endl;
+		std::remove(path.c_str());
+		++failed;
+	}
+
+	// drop the textures of removed images, so they do not end up in archives
+	for (const auto &entry : manifest) {
+		if (!cooked.count(entry.first))
+			std::remove((output + "/" + entry.first + ".dds").c_str());
+	}
+
+	{
+		string tmp = output + "/" + MANIFEST + ".tmp";
+		std::ofstream out(tmp, std::ios::trunc);
+		for (const auto &entry : cooked)
+			out << entry.second << ' ' << entry.first << '\n';
+		out.close();
+		if (!out.good() || std::rename(tmp.c_str(), (output + "/" + MANIFEST).c_str()) != 0) {
+			std::cerr << "Could not write " << output << "/" << MANIFEST << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	std::cout << "Cooked " << cooked.size() - skipped << " textures, " << skipped << " up to date";
+	if (failed > 0)
+		std::cout << ", " << failed << " failed";
+	std::cout << std::endl;
+	return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
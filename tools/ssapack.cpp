@@ -0,0 +1,68 @@
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "resourcearchive.h"
+
+using std::string;
+
+
+static string root;
+static std::map<string,string> files;
+
+static int collect(const char *path, const struct stat *, int type, struct FTW *)
+{
+	if (type == FTW_F) {
+		// resource names are relative to the searched directory
+		string name = string(path).substr(root.size());
+		while (!name.empty() && name[0] == '/')
+			name.erase(0, 1);
+		files[name] = path;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3) {
+		std::cerr << "usage: " << argv[0] << " ARCHIVE DIRECTORY..." << std::endl
+				  << "Packs all files in the given directories into ARCHIVE. Files in later" << std::endl
+				  << "directories replace files with the same name in earlier directories." << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	for (int i = 2; i < argc; ++i) {
+		root = argv[i];
+		if (nftw(argv[i], &collect, 16, FTW_PHYS) != 0) {
+			std::cerr << "Could not read " << argv[i] << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	try {
+		ResourceArchive::write(argv[1], std::vector<std::pair<string,string>>(files.begin(), files.end()));
+	} catch (std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// entries are compressed automatically if that makes them smaller
+	double size = 0;
+	struct stat st;
+	for (const auto &file : files) {
+		if (stat(file.second.c_str(), &st) == 0)
+			size += st.st_size;
+	}
+	double packed = stat(argv[1], &st) == 0 ? st.st_size : 0;
+	std::cout << "Packed " << files.size() << " resources into " << argv[1] << " ("
+			  << std::fixed << std::setprecision(1) << packed / 1048576 << " of " << size / 1048576 << " MiB)" << std::endl;
+	return EXIT_SUCCESS;
+}